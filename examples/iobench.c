@@ -0,0 +1,1398 @@
+/*
+ * libusb example program to measure the cost of libusb I/O paths
+ * Copyright © 2026 The libusb project
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
+#include "libusb.h"
+
+#if defined(PLATFORM_POSIX)
+#include <pthread.h>
+
+#define THREAD_RETURN_VALUE	NULL
+typedef pthread_t thread_t;
+
+static inline int thread_create(thread_t *thread,
+	void *(*thread_entry)(void *arg), void *arg)
+{
+	return pthread_create(thread, NULL, thread_entry, arg) == 0 ? 0 : -1;
+}
+
+static inline void thread_join(thread_t thread)
+{
+	(void)pthread_join(thread, NULL);
+}
+#elif defined(PLATFORM_WINDOWS)
+#include <process.h>
+
+#define THREAD_RETURN_VALUE	0
+typedef HANDLE thread_t;
+
+static inline int thread_create(thread_t *thread,
+	unsigned (__stdcall *thread_entry)(void *arg), void *arg)
+{
+	*thread = (HANDLE)_beginthreadex(NULL, 0, thread_entry, arg, 0, NULL);
+	return *thread != NULL ? 0 : -1;
+}
+
+static inline void thread_join(thread_t thread)
+{
+	(void)WaitForSingleObject(thread, INFINITE);
+	(void)CloseHandle(thread);
+}
+#endif
+
+/*
+ * Usage: iobench -d VID:PID [-i INTERFACE] [-e ENDPOINT] [-s ENDPOINT]
+ *		  [-D VID:PID] [-E ENGINE] [-T THREADS] [-S SHARDS] TEST
+ *
+ * The device is opened, the interface claimed and TEST is run against the
+ * given endpoint. Each test prints one line per measurement. ENGINE selects
+ * the event engine (poll, epoll or io_uring) so that the same workload can
+ * be compared across engines, THREADS the number of threads running the
+ * callbacks (LIBUSB_OPTION_CALLBACK_THREADS, 0 to run them while handling
+ * events) and SHARDS the number of event shards
+ * (LIBUSB_OPTION_EVENT_SHARDS).
+ *
+ *  submit	Submit/complete cost as a function of the number of transfers in
+ *		flight. ENDPOINT should be an IN endpoint that stays idle for
+ *		the duration of the test (e.g. an interrupt endpoint), so that
+ *		the transfers stay in flight until they are cancelled.
+ *
+ *  rate	Completion rate and CPU time per completion with a fixed number
+ *		of transfers kept in flight, each resubmitted from its callback.
+ *		ENDPOINT should be an IN endpoint that returns data as fast as
+ *		it is asked for (e.g. the bulk IN endpoint of a loopback device).
+ *
+ *  latency	Distribution of the time from submitting a single transfer to its
+ *		callback, with and without LIBUSB_OPTION_BUSY_POLL_US. ENDPOINT
+ *		should be an IN endpoint that answers right away.
+ *
+ *  slowcb	Same as latency without busy polling, first alone and then while
+ *		transfers on the second endpoint given with -s have a callback
+ *		taking 2 ms. With THREADS of 2 or more, the latency should not
+ *		be affected by the slow callbacks.
+ *
+ *  openclose	Distribution of the time another thread takes to open and close
+ *		the device, first while idle and then while transfers on
+ *		ENDPOINT are kept in flight as in rate, with callbacks spending
+ *		50 us each on the data. ENDPOINT should be an IN endpoint that
+ *		returns data as fast as it is asked for.
+ *
+ *  sync	Completion rate and CPU time per transfer with 1 to 64 threads each
+ *		calling libusb_bulk_transfer() in a loop, one of them handling
+ *		the events while the others wait for their own transfer.
+ *		ENDPOINT should be an IN endpoint that returns data as fast as
+ *		it is asked for.
+ *
+ *  cycle	Completion rate on ENDPOINT as in rate, overall and over the worst
+ *		100 ms window, first alone and then while another thread opens
+ *		and closes the device given with -D (the tested device if not
+ *		given) in a loop. Closing a device should not cause dips in the
+ *		completion rate of the other devices.
+ *
+ *  shards	Completion rate on ENDPOINT of both the tested device and the
+ *		device given with -D, each kept busy as in rate and served by its
+ *		own thread. With SHARDS of 2 or more the devices are on different
+ *		event shards and handled in parallel, otherwise both threads
+ *		share the event handling of the context.
+ *
+ *  multi	Completion rate on ENDPOINT, kept busy as in rate, while the
+ *		thread handling its events serves 0 to 63 other idle contexts
+ *		as well with libusb_handle_events_multi(). The rate should not
+ *		depend much on the number of contexts.
+ *
+ *  pool	Throughput and CPU time per GB with 16 transfers of 16 KiB kept
+ *		in flight on ENDPOINT, first with malloc'd buffers and then with
+ *		buffers of a libusb_buffer_pool. ENDPOINT should be a bulk IN
+ *		endpoint that returns data as fast as it is asked for.
+ *
+ *  ctrl	Distribution of the time libusb_control_transfer() takes to read
+ *		64 bytes with vendor request 0x5c (the control read of Linux
+ *		gadget zero), and CPU time per request, with and without
+ *		LIBUSB_OPTION_SYNC_FAST_PATH. ENDPOINT is not used. Run under
+ *		strace -c -f to compare the number of system calls per request.
+ */
+
+static libusb_context *ctx = NULL;
+static libusb_device_handle *devh = NULL;
+static unsigned char endpoint = 0x81;
+static unsigned char slow_endpoint = 0x82;
+static unsigned int cycle_vid, cycle_pid;
+static int iface = 0;
+
+static double now_us(void)
+{
+#if defined(HAVE_CLOCK_GETTIME)
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec * 1e6 + (double)tv.tv_usec;
+#endif
+}
+
+static void LIBUSB_CALL cb_count(struct libusb_transfer *xfr)
+{
+	int *completed = xfr->user_data;
+
+	(*completed)++;
+}
+
+static int bench_submit_one(int count)
+{
+	struct libusb_transfer **xfrs;
+	unsigned char *bufs;
+	double t_submit, t_complete;
+	int completed = 0;
+	int i, r = 0;
+
+	xfrs = calloc((size_t)count, sizeof(*xfrs));
+	bufs = malloc((size_t)count * 8);
+	if (!xfrs || !bufs) {
+		free(xfrs);
+		free(bufs);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		xfrs[i] = libusb_alloc_transfer(0);
+		if (!xfrs[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		/* spread the deadlines so that inserts land all over the ordering */
+		libusb_fill_interrupt_transfer(xfrs[i], devh, endpoint, bufs + i * 8, 8,
+			cb_count, &completed, 60000 + (unsigned int)(rand() % 10000));
+	}
+
+	t_submit = now_us();
+	for (i = 0; i < count; i++) {
+		r = libusb_submit_transfer(xfrs[i]);
+		if (r < 0) {
+			fprintf(stderr, "submit %d failed: %s\n", i, libusb_error_name(r));
+			count = i;
+			break;
+		}
+	}
+	t_submit = now_us() - t_submit;
+
+	t_complete = now_us();
+	for (i = 0; i < count; i++)
+		libusb_cancel_transfer(xfrs[i]);
+	while (completed < count) {
+		r = libusb_handle_events_completed(ctx, NULL);
+		if (r < 0)
+			break;
+	}
+	t_complete = now_us() - t_complete;
+
+	if (count)
+		printf("%6d in flight: submit %8.3f us/transfer, cancel+complete %8.3f us/transfer\n",
+			count, t_submit / count, t_complete / count);
+
+out:
+	for (i = 0; i < count; i++)
+		libusb_free_transfer(xfrs[i]);
+	free(xfrs);
+	free(bufs);
+	return r < 0 ? r : 0;
+}
+
+/* CPU time used by the process, or 0 where it can't be measured */
+static double cpu_us(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+		return 0;
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+#else
+	return 0;
+#endif
+}
+
+static int rate_running;
+static int rate_in_flight;
+
+static void LIBUSB_CALL cb_resubmit(struct libusb_transfer *xfr)
+{
+	int *completed = xfr->user_data;
+
+	rate_in_flight--;
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (xfr->status != LIBUSB_TRANSFER_CANCELLED)
+			rate_running = 0;
+		return;
+	}
+
+	(*completed)++;
+	if (rate_running && libusb_submit_transfer(xfr) == 0)
+		rate_in_flight++;
+}
+
+static int bench_rate_one(int count, int seconds)
+{
+	struct libusb_transfer **xfrs;
+	unsigned char *bufs;
+	double t_run, t_cpu;
+	int completed = 0;
+	int i, r = 0;
+
+	xfrs = calloc((size_t)count, sizeof(*xfrs));
+	bufs = malloc((size_t)count * 512);
+	if (!xfrs || !bufs) {
+		free(xfrs);
+		free(bufs);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		xfrs[i] = libusb_alloc_transfer(0);
+		if (!xfrs[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(xfrs[i], devh, endpoint, bufs + i * 512, 512,
+			cb_resubmit, &completed, 1000);
+	}
+
+	rate_running = 1;
+	rate_in_flight = 0;
+	t_run = now_us();
+	t_cpu = cpu_us();
+	for (i = 0; i < count; i++) {
+		r = libusb_submit_transfer(xfrs[i]);
+		if (r < 0) {
+			fprintf(stderr, "submit %d failed: %s\n", i, libusb_error_name(r));
+			rate_running = 0;
+			break;
+		}
+		rate_in_flight++;
+	}
+
+	while (rate_running && now_us() - t_run < seconds * 1e6) {
+		r = libusb_handle_events(ctx);
+		if (r < 0)
+			break;
+	}
+	rate_running = 0;
+	t_run = now_us() - t_run;
+	t_cpu = cpu_us() - t_cpu;
+
+	/* transfers still in flight complete without being resubmitted */
+	for (i = 0; i < count; i++)
+		libusb_cancel_transfer(xfrs[i]);
+	while (rate_in_flight > 0) {
+		if (libusb_handle_events(ctx) < 0)
+			break;
+	}
+
+	if (completed)
+		printf("%6d in flight: %10.0f completions/s, cpu %8.3f us/completion\n",
+			count, completed / (t_run / 1e6), t_cpu / completed);
+
+out:
+	for (i = 0; i < count; i++)
+		libusb_free_transfer(xfrs[i]);
+	free(xfrs);
+	free(bufs);
+	return r < 0 ? r : 0;
+}
+
+static int bench_rate(void)
+{
+	static const int counts[] = { 1, 4, 16, 64 };
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		r = bench_rate_one(counts[i], 5);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+static void LIBUSB_CALL cb_done(struct libusb_transfer *xfr)
+{
+	int *completed = xfr->user_data;
+
+	*completed = 1;
+}
+
+/* time ROUNDS round trips of xfr and print their distribution */
+static int measure_latency(struct libusb_transfer *xfr, const char *label)
+{
+	enum { ROUNDS = 2000 };
+	double *samples;
+	int i, completed, r;
+
+	samples = malloc(ROUNDS * sizeof(*samples));
+	if (!samples)
+		return LIBUSB_ERROR_NO_MEM;
+
+	xfr->user_data = &completed;
+	for (i = 0; i < ROUNDS; i++) {
+		double t = now_us();
+
+		completed = 0;
+		r = libusb_submit_transfer(xfr);
+		if (r < 0)
+			goto out;
+		while (!completed) {
+			r = libusb_handle_events_completed(ctx, &completed);
+			if (r < 0)
+				goto out;
+		}
+		samples[i] = now_us() - t;
+		if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
+			r = LIBUSB_ERROR_IO;
+			goto out;
+		}
+	}
+
+	qsort(samples, ROUNDS, sizeof(*samples), cmp_double);
+	printf("%s: p50 %8.1f us, p99 %8.1f us, max %8.1f us\n", label,
+		samples[ROUNDS / 2], samples[ROUNDS * 99 / 100], samples[ROUNDS - 1]);
+	r = 0;
+
+out:
+	free(samples);
+	return r;
+}
+
+static int bench_latency_one(struct libusb_transfer *xfr, int busy_poll_us)
+{
+	char label[32];
+	int r;
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_BUSY_POLL_US, busy_poll_us);
+	if (r < 0)
+		return r;
+
+	snprintf(label, sizeof(label), "busy poll %6d us", busy_poll_us);
+	return measure_latency(xfr, label);
+}
+
+static int bench_latency(void)
+{
+	static const int busy_poll_us[] = { 0, 50, 1000 };
+	struct libusb_transfer *xfr;
+	unsigned char buf[64];
+	size_t i;
+	int r = 0;
+
+	xfr = libusb_alloc_transfer(0);
+	if (!xfr)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* usbfs turns this into an interrupt transfer on interrupt endpoints */
+	libusb_fill_bulk_transfer(xfr, devh, endpoint, buf, sizeof(buf), cb_done, NULL, 1000);
+
+	for (i = 0; i < sizeof(busy_poll_us) / sizeof(busy_poll_us[0]); i++) {
+		r = bench_latency_one(xfr, busy_poll_us[i]);
+		if (r < 0)
+			break;
+	}
+
+	libusb_free_transfer(xfr);
+	return r;
+}
+
+static void msleep(int msecs)
+{
+#if defined(_WIN32)
+	Sleep(msecs);
+#else
+	const struct timespec ts = { msecs / 1000, (msecs % 1000) * 1000000L };
+
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static volatile int slow_running;
+static volatile int slow_in_flight;
+
+static void LIBUSB_CALL cb_slow(struct libusb_transfer *xfr)
+{
+	msleep(2);
+	if (xfr->status == LIBUSB_TRANSFER_COMPLETED && slow_running &&
+	    libusb_submit_transfer(xfr) == 0)
+		return;
+	slow_in_flight = 0;
+}
+
+static int bench_slowcb(void)
+{
+	struct libusb_transfer *xfr, *slow_xfr;
+	unsigned char buf[64], slow_buf[512];
+	int r;
+
+	xfr = libusb_alloc_transfer(0);
+	slow_xfr = libusb_alloc_transfer(0);
+	if (!xfr || !slow_xfr) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	libusb_fill_bulk_transfer(xfr, devh, endpoint, buf, sizeof(buf), cb_done, NULL, 1000);
+	libusb_fill_bulk_transfer(slow_xfr, devh, slow_endpoint, slow_buf, sizeof(slow_buf),
+		cb_slow, NULL, 1000);
+
+	r = measure_latency(xfr, "alone         ");
+	if (r < 0)
+		goto out;
+
+	slow_running = 1;
+	r = libusb_submit_transfer(slow_xfr);
+	if (r < 0)
+		goto out;
+	slow_in_flight = 1;
+
+	r = measure_latency(xfr, "slow callbacks");
+
+	slow_running = 0;
+	libusb_cancel_transfer(slow_xfr);
+	while (slow_in_flight) {
+		struct timeval tv = { 0, 100000 };
+
+		if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+			break;
+	}
+
+out:
+	libusb_free_transfer(slow_xfr);
+	libusb_free_transfer(xfr);
+	return r;
+}
+
+static volatile int openclose_done;
+
+/* time ROUNDS opens and closes of the device and print their distribution */
+#if defined(PLATFORM_POSIX)
+static void *openclose_thread_main(void *arg)
+#elif defined(PLATFORM_WINDOWS)
+static unsigned __stdcall openclose_thread_main(void *arg)
+#endif
+{
+	enum { ROUNDS = 500 };
+	const char *label = arg;
+	double *samples;
+	int i, r = 0;
+
+	samples = malloc(ROUNDS * sizeof(*samples));
+	if (!samples) {
+		openclose_done = LIBUSB_ERROR_NO_MEM;
+		return THREAD_RETURN_VALUE;
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		libusb_device_handle *h;
+		double t = now_us();
+
+		r = libusb_open(libusb_get_device(devh), &h);
+		if (r < 0)
+			break;
+		libusb_close(h);
+		samples[i] = now_us() - t;
+	}
+
+	if (r == 0) {
+		qsort(samples, ROUNDS, sizeof(*samples), cmp_double);
+		printf("%s: open+close p50 %8.1f us, p99 %8.1f us, max %8.1f us\n", label,
+			samples[ROUNDS / 2], samples[ROUNDS * 99 / 100], samples[ROUNDS - 1]);
+	}
+
+	free(samples);
+	openclose_done = r < 0 ? r : 1;
+	libusb_interrupt_event_handler(ctx);
+	return THREAD_RETURN_VALUE;
+}
+
+static int measure_openclose(const char *label)
+{
+	thread_t thread;
+
+	openclose_done = 0;
+	if (thread_create(&thread, openclose_thread_main, (void *)label) != 0)
+		return LIBUSB_ERROR_OTHER;
+
+	while (!openclose_done) {
+		struct timeval tv = { 0, 100000 };
+
+		if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+			break;
+	}
+
+	thread_join(thread);
+	return openclose_done < 0 ? openclose_done : 0;
+}
+
+static void LIBUSB_CALL cb_process(struct libusb_transfer *xfr)
+{
+	double t = now_us();
+
+	/* stand in for the application working on the data */
+	while (now_us() - t < 50)
+		;
+	cb_resubmit(xfr);
+}
+
+static int bench_openclose(void)
+{
+	enum { COUNT = 16 };
+	struct libusb_transfer *xfrs[COUNT] = { NULL };
+	unsigned char *bufs;
+	int completed = 0;
+	int i, r;
+
+	bufs = malloc(COUNT * 512);
+	if (!bufs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < COUNT; i++) {
+		xfrs[i] = libusb_alloc_transfer(0);
+		if (!xfrs[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(xfrs[i], devh, endpoint, bufs + i * 512, 512,
+			cb_process, &completed, 1000);
+	}
+
+	r = measure_openclose("idle   ");
+	if (r < 0)
+		goto out;
+
+	rate_running = 1;
+	rate_in_flight = 0;
+	for (i = 0; i < COUNT; i++) {
+		r = libusb_submit_transfer(xfrs[i]);
+		if (r < 0)
+			break;
+		rate_in_flight++;
+	}
+
+	if (r == 0)
+		r = measure_openclose("traffic");
+
+	rate_running = 0;
+	for (i = 0; i < COUNT; i++)
+		libusb_cancel_transfer(xfrs[i]);
+	while (rate_in_flight > 0) {
+		if (libusb_handle_events(ctx) < 0)
+			break;
+	}
+
+out:
+	for (i = 0; i < COUNT; i++)
+		libusb_free_transfer(xfrs[i]);
+	free(bufs);
+	return r;
+}
+
+static volatile int sync_running;
+static volatile int sync_error;
+
+/* perform synchronous transfers until told to stop, counting them in the
+ * integer pointed to by arg */
+#if defined(PLATFORM_POSIX)
+static void *sync_thread_main(void *arg)
+#elif defined(PLATFORM_WINDOWS)
+static unsigned __stdcall sync_thread_main(void *arg)
+#endif
+{
+	int *transfers = arg;
+	unsigned char buf[512];
+
+	while (sync_running) {
+		int transferred;
+		int r = libusb_bulk_transfer(devh, endpoint, buf, sizeof(buf),
+			&transferred, 1000);
+
+		if (r < 0) {
+			sync_error = r;
+			break;
+		}
+		(*transfers)++;
+	}
+
+	return THREAD_RETURN_VALUE;
+}
+
+static int bench_sync_one(int count, int seconds)
+{
+	thread_t *threads;
+	int *transfers;
+	double t_run, t_cpu;
+	int i, started, total = 0;
+
+	threads = calloc((size_t)count, sizeof(*threads));
+	transfers = calloc((size_t)count, sizeof(*transfers));
+	if (!threads || !transfers) {
+		free(threads);
+		free(transfers);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	sync_running = 1;
+	sync_error = 0;
+	t_run = now_us();
+	t_cpu = cpu_us();
+	for (started = 0; started < count; started++) {
+		if (thread_create(&threads[started], sync_thread_main, &transfers[started]) != 0) {
+			sync_error = LIBUSB_ERROR_OTHER;
+			break;
+		}
+	}
+
+	while (!sync_error && now_us() - t_run < seconds * 1e6)
+		msleep(10);
+	sync_running = 0;
+	for (i = 0; i < started; i++)
+		thread_join(threads[i]);
+	t_run = now_us() - t_run;
+	t_cpu = cpu_us() - t_cpu;
+
+	for (i = 0; i < started; i++)
+		total += transfers[i];
+	if (!sync_error && total)
+		printf("%6d threads: %10.0f transfers/s, cpu %8.3f us/transfer\n",
+			count, total / (t_run / 1e6), t_cpu / total);
+
+	free(threads);
+	free(transfers);
+	return sync_error;
+}
+
+static int bench_sync(void)
+{
+	static const int counts[] = { 1, 4, 16, 64 };
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		r = bench_sync_one(counts[i], 5);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static libusb_device *cycle_dev;
+static volatile int cycle_running;
+static volatile int cycle_result;
+
+/* open and close cycle_dev until told to stop, leaving the number of cycles
+ * or an error code in cycle_result */
+#if defined(PLATFORM_POSIX)
+static void *cycle_thread_main(void *arg)
+#elif defined(PLATFORM_WINDOWS)
+static unsigned __stdcall cycle_thread_main(void *arg)
+#endif
+{
+	int cycles = 0;
+	int r = 0;
+
+	(void)arg;
+	while (cycle_running) {
+		libusb_device_handle *h;
+
+		r = libusb_open(cycle_dev, &h);
+		if (r < 0)
+			break;
+		libusb_close(h);
+		cycles++;
+	}
+
+	cycle_result = r < 0 ? r : cycles;
+	return THREAD_RETURN_VALUE;
+}
+
+static int measure_cycle_rate(const char *label, int cycling)
+{
+	enum { COUNT = 16, SECONDS = 5, WINDOW_US = 100000 };
+	struct libusb_transfer *xfrs[COUNT] = { NULL };
+	unsigned char *bufs;
+	thread_t thread;
+	double t_start, t_window, rate, worst = -1;
+	int completed = 0, window_completed = 0;
+	int i, r = 0;
+
+	bufs = malloc(COUNT * 512);
+	if (!bufs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < COUNT; i++) {
+		xfrs[i] = libusb_alloc_transfer(0);
+		if (!xfrs[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(xfrs[i], devh, endpoint, bufs + i * 512, 512,
+			cb_resubmit, &completed, 1000);
+	}
+
+	rate_running = 1;
+	rate_in_flight = 0;
+	for (i = 0; i < COUNT; i++) {
+		r = libusb_submit_transfer(xfrs[i]);
+		if (r < 0) {
+			rate_running = 0;
+			break;
+		}
+		rate_in_flight++;
+	}
+
+	cycle_running = cycling;
+	cycle_result = 0;
+	if (r == 0 && cycling && thread_create(&thread, cycle_thread_main, NULL) != 0) {
+		cycle_running = 0;
+		rate_running = 0;
+		r = LIBUSB_ERROR_OTHER;
+	}
+
+	t_start = t_window = now_us();
+	while (rate_running && now_us() - t_start < SECONDS * 1e6) {
+		struct timeval tv = { 0, 10000 };
+		double t;
+
+		r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (r < 0)
+			break;
+
+		t = now_us();
+		if (t - t_window >= WINDOW_US) {
+			rate = (completed - window_completed) / ((t - t_window) / 1e6);
+			if (worst < 0 || rate < worst)
+				worst = rate;
+			window_completed = completed;
+			t_window = t;
+		}
+	}
+	rate = completed / ((now_us() - t_start) / 1e6);
+	rate_running = 0;
+
+	if (cycle_running) {
+		cycle_running = 0;
+		thread_join(thread);
+		if (cycle_result < 0)
+			r = cycle_result;
+	}
+
+	/* transfers still in flight complete without being resubmitted */
+	for (i = 0; i < COUNT; i++)
+		libusb_cancel_transfer(xfrs[i]);
+	while (rate_in_flight > 0) {
+		if (libusb_handle_events(ctx) < 0)
+			break;
+	}
+
+	if (r == 0)
+		printf("%s: %10.0f completions/s, worst window %10.0f completions/s, %d open+close\n",
+			label, rate, worst, cycle_result);
+
+out:
+	for (i = 0; i < COUNT; i++)
+		libusb_free_transfer(xfrs[i]);
+	free(bufs);
+	return r;
+}
+
+static int bench_cycle(void)
+{
+	libusb_device **devs;
+	ssize_t cnt, i;
+	int r;
+
+	cycle_dev = libusb_get_device(devh);
+	if (cycle_vid) {
+		cnt = libusb_get_device_list(ctx, &devs);
+		if (cnt < 0)
+			return (int)cnt;
+
+		cycle_dev = NULL;
+		for (i = 0; i < cnt && !cycle_dev; i++) {
+			struct libusb_device_descriptor desc;
+
+			if (libusb_get_device_descriptor(devs[i], &desc) == 0 &&
+			    desc.idVendor == cycle_vid && desc.idProduct == cycle_pid)
+				cycle_dev = libusb_ref_device(devs[i]);
+		}
+		libusb_free_device_list(devs, 1);
+		if (!cycle_dev)
+			return LIBUSB_ERROR_NO_DEVICE;
+	}
+
+	r = measure_cycle_rate("alone  ", 0);
+	if (r == 0)
+		r = measure_cycle_rate("cycling", 1);
+
+	if (cycle_vid)
+		libusb_unref_device(cycle_dev);
+	return r;
+}
+
+/* a device kept busy by the shards test and the thread serving it */
+struct shard_dev {
+	libusb_device_handle *h;
+	struct libusb_transfer *xfrs[16];
+	unsigned char bufs[16][512];
+	volatile int running;
+	int in_flight;
+	int completed;
+	int result;
+};
+
+static void LIBUSB_CALL cb_shard_resubmit(struct libusb_transfer *xfr)
+{
+	struct shard_dev *sd = xfr->user_data;
+
+	sd->in_flight--;
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (xfr->status != LIBUSB_TRANSFER_CANCELLED)
+			sd->running = 0;
+		return;
+	}
+
+	sd->completed++;
+	if (sd->running && libusb_submit_transfer(xfr) == 0)
+		sd->in_flight++;
+}
+
+/* handle the events of one device, on its event shard if it has one, until
+ * its transfers are all back */
+#if defined(PLATFORM_POSIX)
+static void *shard_thread_main(void *arg)
+#elif defined(PLATFORM_WINDOWS)
+static unsigned __stdcall shard_thread_main(void *arg)
+#endif
+{
+	struct shard_dev *sd = arg;
+	int shard = libusb_get_handle_shard(sd->h);
+	int r = 0;
+
+	while (sd->in_flight > 0) {
+		struct timeval tv = { 0, 10000 };
+
+		if (shard >= 0)
+			r = libusb_handle_events_shard(ctx, shard, &tv, NULL);
+		else
+			r = libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+		if (r < 0)
+			break;
+	}
+
+	sd->result = r;
+	return THREAD_RETURN_VALUE;
+}
+
+static int bench_shards(void)
+{
+	enum { SECONDS = 5 };
+	struct shard_dev sds[2];
+	thread_t threads[2];
+	double t_run;
+	int i, j, started = 0, r = 0;
+
+	if (!cycle_vid)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	memset(sds, 0, sizeof(sds));
+	sds[0].h = devh;
+	sds[1].h = libusb_open_device_with_vid_pid(ctx, (uint16_t)cycle_vid, (uint16_t)cycle_pid);
+	if (!sds[1].h)
+		return LIBUSB_ERROR_NO_DEVICE;
+	libusb_set_auto_detach_kernel_driver(sds[1].h, 1);
+	r = libusb_claim_interface(sds[1].h, iface);
+	if (r < 0) {
+		libusb_close(sds[1].h);
+		return r;
+	}
+
+	for (i = 0; i < 2 && r == 0; i++) {
+		struct shard_dev *sd = &sds[i];
+
+		sd->running = 1;
+		for (j = 0; j < 16; j++) {
+			sd->xfrs[j] = libusb_alloc_transfer(0);
+			if (!sd->xfrs[j]) {
+				r = LIBUSB_ERROR_NO_MEM;
+				break;
+			}
+			libusb_fill_bulk_transfer(sd->xfrs[j], sd->h, endpoint, sd->bufs[j], 512,
+				cb_shard_resubmit, sd, 1000);
+			r = libusb_submit_transfer(sd->xfrs[j]);
+			if (r < 0)
+				break;
+			sd->in_flight++;
+		}
+	}
+
+	t_run = now_us();
+	for (started = 0; r == 0 && started < 2; started++) {
+		if (thread_create(&threads[started], shard_thread_main, &sds[started]) != 0) {
+			r = LIBUSB_ERROR_OTHER;
+			break;
+		}
+	}
+
+	while (r == 0 && sds[0].running && sds[1].running && now_us() - t_run < SECONDS * 1e6)
+		msleep(10);
+	t_run = now_us() - t_run;
+
+	/* transfers still in flight complete without being resubmitted */
+	for (i = 0; i < 2; i++) {
+		sds[i].running = 0;
+		for (j = 0; j < 16 && sds[i].xfrs[j]; j++)
+			libusb_cancel_transfer(sds[i].xfrs[j]);
+	}
+	for (i = 0; i < started; i++) {
+		thread_join(threads[i]);
+		if (r == 0)
+			r = sds[i].result;
+	}
+	/* nobody handles the events of a device whose thread did not start */
+	for (i = started; i < 2; i++) {
+		while (sds[i].in_flight > 0) {
+			int shard = libusb_get_handle_shard(sds[i].h);
+
+			if ((shard >= 0 ? libusb_handle_events_shard(ctx, shard, NULL, NULL) :
+			     libusb_handle_events(ctx)) < 0)
+				break;
+		}
+	}
+
+	if (r == 0)
+		printf("shards %d/%d: %10.0f + %10.0f = %10.0f completions/s\n",
+			libusb_get_handle_shard(sds[0].h), libusb_get_handle_shard(sds[1].h),
+			sds[0].completed / (t_run / 1e6), sds[1].completed / (t_run / 1e6),
+			(sds[0].completed + sds[1].completed) / (t_run / 1e6));
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 16; j++)
+			libusb_free_transfer(sds[i].xfrs[j]);
+	}
+	libusb_release_interface(sds[1].h, iface);
+	libusb_close(sds[1].h);
+	return r;
+}
+
+static int bench_multi_one(libusb_context **ctxs, int n)
+{
+	enum { SECONDS = 2 };
+	struct shard_dev sd;
+	double t_run;
+	int j, r = 0;
+
+	memset(&sd, 0, sizeof(sd));
+	sd.h = devh;
+	sd.running = 1;
+	for (j = 0; j < 16; j++) {
+		sd.xfrs[j] = libusb_alloc_transfer(0);
+		if (!sd.xfrs[j]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+		libusb_fill_bulk_transfer(sd.xfrs[j], devh, endpoint, sd.bufs[j], 512,
+			cb_shard_resubmit, &sd, 1000);
+		r = libusb_submit_transfer(sd.xfrs[j]);
+		if (r < 0)
+			break;
+		sd.in_flight++;
+	}
+
+	t_run = now_us();
+	while (r == 0 && sd.running && now_us() - t_run < SECONDS * 1e6) {
+		struct timeval tv = { 0, 10000 };
+
+		r = libusb_handle_events_multi(ctxs, n, &tv);
+	}
+	t_run = now_us() - t_run;
+
+	sd.running = 0;
+	for (j = 0; j < 16 && sd.xfrs[j]; j++)
+		libusb_cancel_transfer(sd.xfrs[j]);
+	while (sd.in_flight > 0) {
+		if (libusb_handle_events(ctx) < 0)
+			break;
+	}
+
+	if (r == 0)
+		printf("multi %2d contexts: %10.0f completions/s\n", n,
+			sd.completed / (t_run / 1e6));
+
+	for (j = 0; j < 16; j++)
+		libusb_free_transfer(sd.xfrs[j]);
+	return r;
+}
+
+static int bench_multi(void)
+{
+	static const int counts[] = { 1, 8, 64 };
+	libusb_context *ctxs[64];
+	size_t i;
+	int n, r = 0;
+
+	ctxs[0] = ctx;
+	for (n = 1; n < 64; n++) {
+		r = libusb_init_context(&ctxs[n], /*options=*/NULL, /*num_options=*/0);
+		if (r < 0)
+			break;
+	}
+
+	for (i = 0; r == 0 && i < sizeof(counts) / sizeof(counts[0]); i++)
+		r = bench_multi_one(ctxs, counts[i]);
+
+	while (--n > 0)
+		libusb_exit(ctxs[n]);
+	return r;
+}
+
+static void LIBUSB_CALL cb_resubmit_bytes(struct libusb_transfer *xfr)
+{
+	double *bytes = xfr->user_data;
+
+	rate_in_flight--;
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		if (xfr->status != LIBUSB_TRANSFER_CANCELLED)
+			rate_running = 0;
+		return;
+	}
+
+	*bytes += xfr->actual_length;
+	if (rate_running && libusb_submit_transfer(xfr) == 0)
+		rate_in_flight++;
+}
+
+static int bench_pool_one(int pooled)
+{
+	enum { COUNT = 16, LENGTH = 16384, SECONDS = 5 };
+	struct libusb_transfer *xfrs[COUNT];
+	libusb_buffer_pool *pool = NULL;
+	unsigned char *bufs = NULL;
+	double t_run, t_cpu, bytes = 0;
+	int i, r = 0;
+
+	memset(xfrs, 0, sizeof(xfrs));
+	if (pooled)
+		pool = libusb_buffer_pool_create(devh, LENGTH, COUNT);
+	else
+		bufs = malloc((size_t)COUNT * LENGTH);
+	if (!pool && !bufs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < COUNT; i++) {
+		xfrs[i] = libusb_alloc_transfer(0);
+		if (!xfrs[i]) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(xfrs[i], devh, endpoint, bufs ? bufs + i * LENGTH : NULL,
+			LENGTH, cb_resubmit_bytes, &bytes, 1000);
+		if (pool) {
+			r = libusb_buffer_pool_attach(pool, xfrs[i]);
+			if (r < 0)
+				goto out;
+		}
+	}
+
+	rate_running = 1;
+	rate_in_flight = 0;
+	t_run = now_us();
+	t_cpu = cpu_us();
+	for (i = 0; i < COUNT; i++) {
+		r = libusb_submit_transfer(xfrs[i]);
+		if (r < 0) {
+			rate_running = 0;
+			break;
+		}
+		rate_in_flight++;
+	}
+
+	while (rate_running && now_us() - t_run < SECONDS * 1e6) {
+		r = libusb_handle_events(ctx);
+		if (r < 0)
+			break;
+	}
+	rate_running = 0;
+	t_run = now_us() - t_run;
+	t_cpu = cpu_us() - t_cpu;
+
+	for (i = 0; i < COUNT; i++)
+		libusb_cancel_transfer(xfrs[i]);
+	while (rate_in_flight > 0) {
+		if (libusb_handle_events(ctx) < 0)
+			break;
+	}
+
+	if (bytes > 0)
+		printf("%-14s %10.1f MB/s, cpu %8.1f ms/GB\n",
+			!pool ? "malloc" : libusb_buffer_pool_is_device_memory(pool) ?
+			"pool (devmem)" : "pool (malloc)",
+			bytes / t_run, t_cpu / 1e3 / (bytes / 1e9));
+
+out:
+	/* the pool buffers return to the pool with their transfers */
+	for (i = 0; i < COUNT; i++)
+		libusb_free_transfer(xfrs[i]);
+	libusb_buffer_pool_destroy(pool);
+	free(bufs);
+	return r < 0 ? r : 0;
+}
+
+#define CTRL_REQUEST	0x5c
+
+static int bench_ctrl_one(int fast_path)
+{
+	enum { ROUNDS = 10000 };
+	unsigned char buf[64];
+	double *samples, t_run, t_cpu;
+	int i, r;
+
+	r = libusb_set_option(ctx, LIBUSB_OPTION_SYNC_FAST_PATH, fast_path);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		printf("fast path %d: not supported\n", fast_path);
+		return 0;
+	} else if (r < 0) {
+		return r;
+	}
+
+	samples = malloc(ROUNDS * sizeof(*samples));
+	if (!samples)
+		return LIBUSB_ERROR_NO_MEM;
+
+	t_run = now_us();
+	t_cpu = cpu_us();
+	for (i = 0; i < ROUNDS; i++) {
+		double t = now_us();
+
+		r = libusb_control_transfer(devh,
+			LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+			CTRL_REQUEST, 0, 0, buf, sizeof(buf), 1000);
+		if (r < 0)
+			goto out;
+		samples[i] = now_us() - t;
+	}
+	t_run = now_us() - t_run;
+	t_cpu = cpu_us() - t_cpu;
+
+	qsort(samples, ROUNDS, sizeof(*samples), cmp_double);
+	printf("fast path %d: p50 %8.1f us, p99 %8.1f us, max %8.1f us, "
+		"%8.0f requests/s, cpu %8.3f us/request\n", fast_path,
+		samples[ROUNDS / 2], samples[ROUNDS * 99 / 100], samples[ROUNDS - 1],
+		ROUNDS / (t_run / 1e6), t_cpu / ROUNDS);
+	r = 0;
+
+out:
+	free(samples);
+	return r;
+}
+
+static int bench_ctrl(void)
+{
+	int r;
+
+	r = bench_ctrl_one(0);
+	if (r < 0)
+		return r;
+
+	r = bench_ctrl_one(1);
+	libusb_set_option(ctx, LIBUSB_OPTION_SYNC_FAST_PATH, 0);
+	return r;
+}
+
+static int bench_pool(void)
+{
+	int r;
+
+	r = bench_pool_one(0);
+	if (r < 0)
+		return r;
+
+	return bench_pool_one(1);
+}
+
+static int bench_submit(void)
+{
+	static const int counts[] = { 10, 100, 1000, 10000 };
+	size_t i;
+	int r;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		r = bench_submit_one(counts[i]);
+		if (r < 0)
+			return r;
+	}
+
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} tests[] = {
+	{ "submit", bench_submit },
+	{ "rate", bench_rate },
+	{ "latency", bench_latency },
+	{ "slowcb", bench_slowcb },
+	{ "openclose", bench_openclose },
+	{ "sync", bench_sync },
+	{ "cycle", bench_cycle },
+	{ "shards", bench_shards },
+	{ "multi", bench_multi },
+	{ "pool", bench_pool },
+	{ "ctrl", bench_ctrl },
+};
+
+static void usage(const char *argv0)
+{
+	size_t i;
+
+	fprintf(stderr, "usage: %s -d VID:PID [-i INTERFACE] [-e ENDPOINT] [-s ENDPOINT]"
+		" [-D VID:PID] [-E ENGINE] [-T THREADS] [-S SHARDS] TEST\n", argv0);
+	fprintf(stderr, "engines: poll epoll io_uring\n");
+	fprintf(stderr, "tests:");
+	for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+		fprintf(stderr, " %s", tests[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const char *engines[] = { "poll", "epoll", "io_uring" };
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_EVENT_ENGINE, .value = { .ival = LIBUSB_EVENT_ENGINE_POLL } },
+		{ .option = LIBUSB_OPTION_CALLBACK_THREADS, .value = { .ival = 0 } },
+		{ .option = LIBUSB_OPTION_EVENT_SHARDS, .value = { .ival = 0 } },
+	};
+	unsigned int vid = 0, pid = 0;
+	const char *test = NULL;
+	size_t t;
+	int i, r;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			if (sscanf(argv[++i], "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "-D") && i + 1 < argc) {
+			if (sscanf(argv[++i], "%x:%x", &cycle_vid, &cycle_pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+			iface = (int)strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+			endpoint = (unsigned char)strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+			slow_endpoint = (unsigned char)strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-T") && i + 1 < argc) {
+			options[1].value.ival = (int)strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-S") && i + 1 < argc) {
+			options[2].value.ival = (int)strtol(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-E") && i + 1 < argc) {
+			const char *engine = argv[++i];
+			int e;
+
+			for (e = 0; e < (int)(sizeof(engines) / sizeof(engines[0])); e++) {
+				if (!strcmp(engines[e], engine))
+					break;
+			}
+			if (e == (int)(sizeof(engines) / sizeof(engines[0]))) {
+				usage(argv[0]);
+				return 1;
+			}
+			options[0].value.ival = e;
+		} else if (argv[i][0] != '-' && !test) {
+			test = argv[i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!vid || !test) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (t = 0; t < sizeof(tests) / sizeof(tests[0]); t++) {
+		if (!strcmp(tests[t].name, test))
+			break;
+	}
+	if (t == sizeof(tests) / sizeof(tests[0])) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	r = libusb_init_context(&ctx, options, /*num_options=*/3);
+	if (r < 0) {
+		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	devh = libusb_open_device_with_vid_pid(ctx, (uint16_t)vid, (uint16_t)pid);
+	if (!devh) {
+		fprintf(stderr, "Error finding USB device\n");
+		r = LIBUSB_ERROR_NO_DEVICE;
+		goto out;
+	}
+
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	r = libusb_claim_interface(devh, iface);
+	if (r < 0) {
+		fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(r));
+		goto out;
+	}
+
+	r = tests[t].run();
+	if (r < 0)
+		fprintf(stderr, "%s: %s\n", test, libusb_error_name(r));
+
+	libusb_release_interface(devh, iface);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(ctx);
+	return r < 0;
+}
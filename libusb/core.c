@@ -28,6 +28,10 @@
 #endif
 #include <stdio.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #ifdef HAVE_SYSLOG
 #include <syslog.h>
 #endif
@@ -718,6 +722,8 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	dev->ctx = ctx;
 	dev->session_data = session_id;
 	dev->speed = LIBUSB_SPEED_UNKNOWN;
+	dev->event_shard = -1;
+	dev->numa_node = -1;
 
 	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
 		usbi_connect_device(dev);
@@ -1014,6 +1020,26 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
+/** \ingroup libusb_dev
+ * Get the NUMA node of the host controller a device is attached to. Memory
+ * on that node is the closest to the controller doing the DMA of the
+ * transfers of the device, see \ref LIBUSB_OPTION_NUMA_BINDING.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev a device
+ * \returns the NUMA node of the device
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the platform does not report the
+ * node, e.g. on systems with a single node
+ */
+int API_EXPORTED libusb_get_device_numa_node(libusb_device *dev)
+{
+	if (dev->numa_node < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return dev->numa_node;
+}
+
 static const struct libusb_endpoint_descriptor *find_endpoint(
 	struct libusb_config_descriptor *config, unsigned char endpoint)
 {
@@ -1309,6 +1335,45 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 	}
 }
 
+/* Pick the event shard serving a new device handle, the one requested or
+ * else the one with the fewest handles. Returns NULL if the context has no
+ * event shards. */
+static struct usbi_event_shard *assign_event_shard(struct libusb_context *ctx,
+	int requested)
+{
+	struct usbi_event_shard *shard;
+	unsigned int i;
+
+	if (!ctx->num_event_shards)
+		return NULL;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (requested >= 0) {
+		shard = &ctx->event_shards[requested];
+	} else {
+		shard = &ctx->event_shards[0];
+		for (i = 1; i < ctx->num_event_shards; i++) {
+			if (ctx->event_shards[i].num_handles < shard->num_handles)
+				shard = &ctx->event_shards[i];
+		}
+	}
+	shard->num_handles++;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	return shard;
+}
+
+static void release_event_shard(struct libusb_context *ctx,
+	struct usbi_event_shard *shard)
+{
+	if (!shard)
+		return;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	shard->num_handles--;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+}
+
 /** \ingroup libusb_dev
  * Wrap a platform-specific system device handle and obtain a libusb device
  * handle for the underlying device. The handle allows you to use libusb to
@@ -1363,10 +1428,13 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	list_init(&_dev_handle->flying_transfers);
+	_dev_handle->shard = assign_event_shard(ctx, -1);
 
 	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
 	if (r < 0) {
 		usbi_dbg(ctx, "wrap_sys_device 0x%" PRIxPTR " returns %d", (uintptr_t)sys_dev, r);
+		release_event_shard(ctx, _dev_handle->shard);
 		usbi_mutex_destroy(&_dev_handle->lock);
 		free(_dev_handle);
 		return r;
@@ -1417,12 +1485,15 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	list_init(&_dev_handle->flying_transfers);
 
 	_dev_handle->dev = libusb_ref_device(dev);
+	_dev_handle->shard = assign_event_shard(ctx, dev->event_shard);
 
 	r = usbi_backend.open(_dev_handle);
 	if (r < 0) {
 		usbi_dbg(DEVICE_CTX(dev), "open %d.%d returns %d", dev->bus_number, dev->device_address, r);
+		release_event_shard(ctx, _dev_handle->shard);
 		libusb_unref_device(dev);
 		usbi_mutex_destroy(&_dev_handle->lock);
 		free(_dev_handle);
@@ -1434,6 +1505,7 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 	*dev_handle = _dev_handle;
 
+	usbi_numa_bind_event_thread(dev);
 	return 0;
 }
 
@@ -1494,22 +1566,18 @@ static void do_close(struct libusb_context *ctx,
 {
 	struct usbi_transfer *itransfer;
 	struct usbi_transfer *tmp;
+	struct list_head *completing;
 
 	/* remove any transfers in flight that are for this device */
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	for_each_transfer_safe(ctx, itransfer, tmp) {
+	for_each_transfer_safe(dev_handle, itransfer, tmp) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-		uint32_t state_flags;
+		long state_flags;
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
-		usbi_mutex_lock(&itransfer->lock);
-		state_flags = itransfer->state_flags;
-		usbi_mutex_unlock(&itransfer->lock);
+		state_flags = usbi_atomic_load(&itransfer->state_flags);
 		if (!(state_flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
@@ -1523,7 +1591,7 @@ static void do_close(struct libusb_context *ctx,
 		 * we don't accidentally use the device handle in the future
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
-		list_del(&itransfer->list);
+		usbi_detach_flying_transfer(itransfer);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1535,14 +1603,70 @@ static void do_close(struct libusb_context *ctx,
 	}
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
+	/* transfers whose completion is being reported, when a callback closes
+	 * the device handle, are no longer on the in-flight list */
+	completing = *usbi_completing_transfers(dev_handle);
+	if (completing) {
+		__for_each_completed_transfer(completing, itransfer) {
+			struct libusb_transfer *transfer =
+				USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+			if (transfer->dev_handle == dev_handle)
+				transfer->dev_handle = NULL;
+		}
+	}
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
+	if (dev_handle->shard)
+		dev_handle->shard->num_handles--;
 	usbi_mutex_unlock(&ctx->open_devs_lock);
 
 	usbi_backend.close(dev_handle);
-	libusb_unref_device(dev_handle->dev);
-	usbi_mutex_destroy(&dev_handle->lock);
-	free(dev_handle);
+}
+
+/* A device handle waiting in the closing_handles list of the context or of
+ * its event shard for the event handler to close it. Lives on the stack of
+ * the thread calling libusb_close() */
+struct usbi_close_request {
+	struct list_head list;
+	struct libusb_device_handle *dev_handle;
+	int done;
+};
+
+/* Close the device handles queued by libusb_close(), for the context or
+ * for one of its event shards. Called by the event handler, with the event
+ * handling lock held, once it is done with the event sources it was woken up
+ * for */
+void usbi_handle_pending_closes(struct libusb_context *ctx,
+	struct usbi_event_shard *shard)
+{
+	struct list_head *closing_handles = shard ? &shard->closing_handles : &ctx->closing_handles;
+	struct usbi_close_request *req, *tmp;
+	struct list_head closing;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (list_empty(closing_handles)) {
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		return;
+	}
+	list_cut(&closing, closing_handles);
+	if (!shard) {
+		ctx->event_flags &= ~USBI_EVENT_DEVICE_CLOSE;
+		if (!ctx->event_flags)
+			usbi_clear_event(&ctx->event);
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	list_for_each_entry(req, &closing, list, struct usbi_close_request)
+		do_close(ctx, req->dev_handle);
+
+	/* the requests go away as soon as their closing thread sees them done */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	list_for_each_entry_safe(req, tmp, &closing, list, struct usbi_close_request)
+		req->done = 1;
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
 /** \ingroup libusb_dev
@@ -1559,55 +1683,79 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
+	struct usbi_event_shard *shard;
+	struct usbi_close_request req;
 	unsigned int event_flags;
-	int handling_events;
 
 	if (!dev_handle)
 		return;
 	ctx = HANDLE_CTX(dev_handle);
+	shard = dev_handle->shard;
 	usbi_dbg(ctx, " ");
 
-	handling_events = usbi_handling_events(ctx);
-
-	/* Similarly to libusb_open(), we want to interrupt all event handlers
-	 * at this point. More importantly, we want to perform the actual close of
-	 * the device while holding the event handling lock (preventing any other
-	 * thread from doing event handling) because we will be removing a file
-	 * descriptor from the polling loop. If this is being called by the current
-	 * event handler, we can bypass the interruption code because we already
-	 * hold the event handling lock. */
+	/* Let the callbacks still queued for the device run while events are
+	 * being handled, as they may wait for events themselves */
+	usbi_executor_flush_handle(dev_handle);
+
+	/* The actual close of the device has to be performed by the event handler
+	 * because we will be removing a file descriptor from the polling loop. If
+	 * this is being called by the current event handler, we can close the
+	 * device right away. Otherwise we hand the device handle over to the event
+	 * handler and wait for it to be closed. Unlike libusb_open(), this doesn't
+	 * interrupt event handling, so the other devices keep being served. The
+	 * device handles of an event shard are closed by the event handler of
+	 * the shard. */
+	if (usbi_handling_events_of(dev_handle)) {
+		do_close(ctx, dev_handle);
+	} else {
+		req.dev_handle = dev_handle;
+		req.done = 0;
 
-	if (!handling_events) {
-		/* Record that we are closing a device.
-		 * Only signal an event if there are no prior pending events. */
+		/* Only signal an event if there are no prior pending events. */
 		usbi_mutex_lock(&ctx->event_data_lock);
-		event_flags = ctx->event_flags;
-		if (!ctx->device_close++)
+		if (shard) {
+			list_add_tail(&req.list, &shard->closing_handles);
+		} else {
+			event_flags = ctx->event_flags;
 			ctx->event_flags |= USBI_EVENT_DEVICE_CLOSE;
-		if (!event_flags)
-			usbi_signal_event(&ctx->event);
+			list_add_tail(&req.list, &ctx->closing_handles);
+			if (!event_flags)
+				usbi_signal_event(&ctx->event);
+		}
 		usbi_mutex_unlock(&ctx->event_data_lock);
-
-		/* take event handling lock */
-		libusb_lock_events(ctx);
+		if (shard)
+			usbi_signal_shard_event(shard);
+
+		/* If no one is handling events, close the device ourselves. The
+		 * event waiters are woken up both when the event handling lock is
+		 * released and when the pending closes have been handled. */
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		while (!req.done) {
+			if (shard && usbi_try_lock_shard_events(shard) == 0) {
+				usbi_mutex_unlock(&ctx->event_waiters_lock);
+				usbi_handle_pending_closes(ctx, shard);
+				usbi_unlock_shard_events(shard);
+				usbi_mutex_lock(&ctx->event_waiters_lock);
+			} else if (!shard && usbi_mutex_trylock(&ctx->events_lock)) {
+				usbi_mutex_unlock(&ctx->event_waiters_lock);
+				ctx->event_handler_active = 1;
+				usbi_handle_pending_closes(ctx, NULL);
+				libusb_unlock_events(ctx);
+				usbi_mutex_lock(&ctx->event_waiters_lock);
+			} else {
+				usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
+			}
+		}
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
 	}
 
-	/* Close the device */
-	do_close(ctx, dev_handle);
-
-	if (!handling_events) {
-		/* We're done with closing this device.
-		 * Clear the event pipe if there are no further pending events. */
-		usbi_mutex_lock(&ctx->event_data_lock);
-		if (!--ctx->device_close)
-			ctx->event_flags &= ~USBI_EVENT_DEVICE_CLOSE;
-		if (!ctx->event_flags)
-			usbi_clear_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+	/* callbacks of transfers completed before the device was closed may
+	 * still be queued on the executor */
+	usbi_executor_flush_handle(dev_handle);
 
-		/* Release event handling lock and wake up event waiters */
-		libusb_unlock_events(ctx);
-	}
+	libusb_unref_device(dev_handle->dev);
+	usbi_mutex_destroy(&dev_handle->lock);
+	free(dev_handle);
 }
 
 /** \ingroup libusb_dev
@@ -1623,6 +1771,50 @@ libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle)
 	return dev_handle->dev;
 }
 
+/** \ingroup libusb_dev
+ * Choose the event shard serving the handles opened on a device from now on,
+ * see \ref LIBUSB_OPTION_EVENT_SHARDS. Device handles already open keep
+ * their event shard. Devices that share a shard are served by the same
+ * thread, so this can be used to keep devices that work together, or that
+ * are latency-sensitive, apart from the others.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev a device
+ * \param shard index of the event shard, or -1 to pick the one serving the
+ * fewest device handles when a handle is opened
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the context of the device has
+ * no such event shard
+ */
+int API_EXPORTED libusb_set_device_shard(libusb_device *dev, int shard)
+{
+	if (shard < -1 || shard >= (int)DEVICE_CTX(dev)->num_event_shards)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	dev->event_shard = shard;
+	return 0;
+}
+
+/** \ingroup libusb_dev
+ * Get the event shard serving a device handle, whose events are handled
+ * with libusb_handle_events_shard(), see \ref LIBUSB_OPTION_EVENT_SHARDS.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \returns the index of the event shard
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the events of the device handle are
+ * handled by the event handling of the context
+ */
+int API_EXPORTED libusb_get_handle_shard(libusb_device_handle *dev_handle)
+{
+	if (!dev_handle->shard)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return (int)(dev_handle->shard - HANDLE_CTX(dev_handle)->event_shards);
+}
+
 /** \ingroup libusb_dev
  * Determine the bConfigurationValue of the currently active configuration.
  *
@@ -2061,6 +2253,311 @@ int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+static void * LIBUSB_CALL malloc_alloc(void *user_data, size_t length)
+{
+	UNUSED(user_data);
+	return malloc(length);
+}
+
+static void LIBUSB_CALL malloc_free(void *user_data, void *buffer)
+{
+	UNUSED(user_data);
+	free(buffer);
+}
+
+static const struct libusb_allocator malloc_allocator = {
+	malloc_alloc, malloc_free, NULL
+};
+
+/* Every buffer from libusb_buffer_alloc() is preceded by a header recording
+ * the allocator that provided it, so that libusb_buffer_free() releases it
+ * with that allocator even if another one was installed since. The header
+ * takes one cache line to keep the buffer aligned */
+#define BUFFER_HEADER_SIZE	64
+
+struct buffer_header {
+	struct libusb_allocator allocator;
+};
+
+static struct buffer_header *buffer_to_header(void *buffer)
+{
+	return (struct buffer_header *)(void *)((unsigned char *)buffer - BUFFER_HEADER_SIZE);
+}
+
+#ifdef __linux__
+/* The mmap based allocators precede their memory with another header of the
+ * same size, telling how to release it */
+#define MMAP_HEADER_SIZE	64
+
+/* Buffers smaller than this are not worth huge pages */
+#define HUGEPAGE_MIN_LENGTH	(1UL << 20)
+#define HUGEPAGE_SIZE		(2UL << 20)
+
+/* Buffers smaller than this are not worth the system calls of a memfd, which
+ * notably covers the buffers of synchronous control transfers */
+#define MEMFD_MIN_LENGTH	(64UL << 10)
+
+struct mmap_header {
+	/* length of the mapping, 0 if allocated with malloc() */
+	size_t map_length;
+	/* memfd backing the mapping, or -1 */
+	int fd;
+};
+
+static void *mmap_header_to_mem(void *mem, size_t map_length, int fd)
+{
+	struct mmap_header *header = mem;
+
+	header->map_length = map_length;
+	header->fd = fd;
+	return (unsigned char *)mem + MMAP_HEADER_SIZE;
+}
+
+static struct mmap_header *mem_to_mmap_header(void *mem)
+{
+	return (struct mmap_header *)(void *)((unsigned char *)mem - MMAP_HEADER_SIZE);
+}
+
+static void * LIBUSB_CALL hugepage_alloc(void *user_data, size_t length)
+{
+	size_t map_length;
+	void *mem = MAP_FAILED;
+
+	UNUSED(user_data);
+	if (length < HUGEPAGE_MIN_LENGTH) {
+		mem = malloc(MMAP_HEADER_SIZE + length);
+		return mem ? mmap_header_to_mem(mem, 0, -1) : NULL;
+	}
+
+	map_length = (MMAP_HEADER_SIZE + length + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+	/* reserved huge pages, if the system has any */
+	mem = mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, map_length, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		(void)madvise(mem, map_length, MADV_HUGEPAGE);
+#endif
+	}
+
+	return mmap_header_to_mem(mem, map_length, -1);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static void * LIBUSB_CALL memfd_alloc(void *user_data, size_t length)
+{
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t map_length = (MMAP_HEADER_SIZE + length + page_size - 1) & ~(page_size - 1);
+	void *mem;
+	int fd;
+
+	UNUSED(user_data);
+	if (length < MEMFD_MIN_LENGTH) {
+		mem = malloc(MMAP_HEADER_SIZE + length);
+		return mem ? mmap_header_to_mem(mem, 0, -1) : NULL;
+	}
+
+	fd = memfd_create("libusb-buffer", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, (off_t)map_length) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	mem = mmap(NULL, map_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	return mmap_header_to_mem(mem, map_length, fd);
+}
+#endif
+
+static void LIBUSB_CALL mmap_free(void *user_data, void *mem)
+{
+	struct mmap_header *header = mem_to_mmap_header(mem);
+	int fd = header->fd;
+
+	UNUSED(user_data);
+	if (!header->map_length) {
+		free(header);
+		return;
+	}
+
+	munmap(header, header->map_length);
+	if (fd >= 0)
+		close(fd);
+}
+
+static const struct libusb_allocator hugepage_allocator = {
+	hugepage_alloc, mmap_free, NULL
+};
+
+#ifdef HAVE_MEMFD_CREATE
+static const struct libusb_allocator memfd_allocator = {
+	memfd_alloc, mmap_free, NULL
+};
+#endif
+#endif
+
+/* the built-in allocator selected with LIBUSB_OPTION_BUFFER_ALLOCATOR, whose
+ * availability libusb_set_option() has already checked */
+static const struct libusb_allocator *builtin_allocator(enum libusb_buffer_allocator id)
+{
+	switch (id) {
+#ifdef __linux__
+	case LIBUSB_BUFFER_ALLOCATOR_HUGEPAGE:
+		return &hugepage_allocator;
+#endif
+#ifdef HAVE_MEMFD_CREATE
+	case LIBUSB_BUFFER_ALLOCATOR_MEMFD:
+		return &memfd_allocator;
+#endif
+	default:
+		return &malloc_allocator;
+	}
+}
+
+/** \ingroup libusb_asyncio
+ * Install the allocator providing the transfer buffers of a context, in place
+ * of the one selected with \ref LIBUSB_OPTION_BUFFER_ALLOCATOR. See that
+ * option for what the allocator is used for. The buffers already allocated
+ * are still released by the allocator that provided them, whose user data
+ * must remain valid until then.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param allocator the allocator to use, or NULL to go back to malloc()
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a function of the allocator is
+ * missing or there is no context
+ */
+int API_EXPORTED libusb_set_allocator(libusb_context *ctx,
+	const struct libusb_allocator *allocator)
+{
+	if (allocator && (!allocator->alloc || !allocator->free))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = usbi_get_context(ctx);
+	if (!ctx)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx->allocator = allocator ? *allocator : malloc_allocator;
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a transfer buffer with the allocator of a context. The buffer
+ * must be released with libusb_buffer_free(). As with libusb_dev_mem_alloc(),
+ * the flag \ref LIBUSB_TRANSFER_FREE_BUFFER cannot be used to release it.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param length size of the buffer
+ * \returns a pointer to the newly allocated memory, or NULL on failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_buffer_alloc(libusb_context *ctx,
+	size_t length)
+{
+	const struct libusb_allocator *allocator = &malloc_allocator;
+	struct buffer_header *header;
+
+	ctx = usbi_get_context(ctx);
+	if (ctx)
+		allocator = &ctx->allocator;
+
+	header = allocator->alloc(allocator->user_data, BUFFER_HEADER_SIZE + length);
+	if (!header)
+		return NULL;
+
+	header->allocator = *allocator;
+	return (unsigned char *)header + BUFFER_HEADER_SIZE;
+}
+
+/** \ingroup libusb_asyncio
+ * Release a buffer allocated with libusb_buffer_alloc(). The buffer is
+ * released by the allocator that provided it, even if another allocator was
+ * installed since.
+ *
+ * It is legal to call this function with a NULL buffer. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context the buffer was allocated with, or NULL for the
+ * default context
+ * \param buffer the buffer to release
+ */
+void API_EXPORTED libusb_buffer_free(libusb_context *ctx, unsigned char *buffer)
+{
+	struct buffer_header *header;
+
+	UNUSED(ctx);
+	if (!buffer)
+		return;
+
+	header = buffer_to_header(buffer);
+	header->allocator.free(header->allocator.user_data, header);
+}
+
+/** \ingroup libusb_asyncio
+ * Retrieve the memfd backing a buffer allocated with libusb_buffer_alloc()
+ * while \ref LIBUSB_BUFFER_ALLOCATOR_MEMFD is in use. Another process that
+ * receives the file descriptor (e.g. over a UNIX socket) and maps it finds
+ * the data of the buffer at the returned offset. The file descriptor remains
+ * owned by libusb and is closed when the buffer is released.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context the buffer was allocated with, or NULL for the
+ * default context
+ * \param buffer the buffer
+ * \param offset output location for the offset of the buffer data in the file
+ * \returns the file descriptor on success
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the buffer is not backed by a
+ * memfd, which includes buffers smaller than 64 KiB
+ */
+int API_EXPORTED libusb_buffer_get_memfd(libusb_context *ctx,
+	unsigned char *buffer, size_t *offset)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct buffer_header *header;
+	struct mmap_header *map_header;
+
+	UNUSED(ctx);
+	if (!buffer)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	header = buffer_to_header(buffer);
+	if (header->allocator.alloc != memfd_alloc)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	map_header = mem_to_mmap_header(header);
+	if (map_header->fd < 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (offset)
+		*offset = MMAP_HEADER_SIZE + BUFFER_HEADER_SIZE;
+	return map_header->fd;
+#else
+	UNUSED(ctx);
+	UNUSED(buffer);
+	UNUSED(offset);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 /** \ingroup libusb_dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -2265,6 +2762,59 @@ void API_EXPORTED libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
 #endif
 }
 
+/* Parse a list of CPUs in the format of the kernel's cpulist files, such as
+ * "0-3,8-11", into cpus. Returns the number of CPUs in the list or
+ * LIBUSB_ERROR_INVALID_PARAM if it is malformed. */
+int usbi_parse_cpu_list(const char *list, struct usbi_cpu_set *cpus)
+{
+	unsigned int first, last, cpu;
+	int num_cpus = 0;
+
+	memset(cpus, 0, sizeof(*cpus));
+	if (!list)
+		return 0;
+
+	while (*list && *list != '\n') {
+		if (*list < '0' || *list > '9')
+			return LIBUSB_ERROR_INVALID_PARAM;
+		for (first = 0; *list >= '0' && *list <= '9'; list++) {
+			first = 10 * first + (unsigned int)(*list - '0');
+			if (first >= USBI_MAX_CPUS)
+				return LIBUSB_ERROR_INVALID_PARAM;
+		}
+
+		last = first;
+		if (*list == '-') {
+			list++;
+			if (*list < '0' || *list > '9')
+				return LIBUSB_ERROR_INVALID_PARAM;
+			for (last = 0; *list >= '0' && *list <= '9'; list++) {
+				last = 10 * last + (unsigned int)(*list - '0');
+				if (last >= USBI_MAX_CPUS)
+					return LIBUSB_ERROR_INVALID_PARAM;
+			}
+			if (last < first)
+				return LIBUSB_ERROR_INVALID_PARAM;
+		}
+
+		for (cpu = first; cpu <= last; cpu++) {
+			if (!usbi_cpu_isset(cpus, cpu))
+				num_cpus++;
+			cpus->bits[cpu / USBI_CPU_WORD_BITS] |= 1UL << (cpu % USBI_CPU_WORD_BITS);
+		}
+
+		if (*list == ',') {
+			list++;
+			if (!*list || *list == '\n')
+				return LIBUSB_ERROR_INVALID_PARAM;
+		} else if (*list && *list != '\n') {
+			return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	return num_cpus;
+}
+
 /** \ingroup libusb_lib
  * Set an option in the library.
  *
@@ -2292,6 +2842,8 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	enum libusb_option option, ...)
 {
 	int arg = 0, r = LIBUSB_SUCCESS;
+	const char *sval = NULL;
+	struct usbi_cpu_set cpus;
 	va_list ap;
 
 	va_start(ap, option);
@@ -2300,6 +2852,90 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 		if (arg < LIBUSB_LOG_LEVEL_NONE || arg > LIBUSB_LOG_LEVEL_DEBUG) {
 			r = LIBUSB_ERROR_INVALID_PARAM;
 		}
+	} else if (LIBUSB_OPTION_TIMEOUT_SLACK_US == option ||
+		   LIBUSB_OPTION_REAP_BUDGET == option ||
+		   LIBUSB_OPTION_EVENT_THREAD == option ||
+		   LIBUSB_OPTION_REALTIME == option ||
+		   LIBUSB_OPTION_REALTIME_IN_FLIGHT == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	} else if (LIBUSB_OPTION_SYNC_FAST_PATH == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		} else if (arg && !usbi_backend.sync_control_transfer) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+	} else if (LIBUSB_OPTION_BUSY_POLL_US == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		} else if (arg && !usbi_backend.busy_poll) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+	} else if (LIBUSB_OPTION_EVENT_THREAD_CPUS == option) {
+		sval = va_arg(ap, const char *);
+		arg = usbi_parse_cpu_list(sval, &cpus);
+		if (arg < 0) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	} else if (LIBUSB_OPTION_EVENT_THREAD_PRIORITY == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > 99) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	} else if (LIBUSB_OPTION_CALLBACK_THREADS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_CALLBACK_THREADS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	} else if (LIBUSB_OPTION_EVENT_SHARDS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_EVENT_SHARDS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		} else if (arg && !(usbi_backend.caps & USBI_CAP_HANDLE_EVENT_SOURCES)) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+	} else if (LIBUSB_OPTION_BUFFER_ALLOCATOR == option) {
+		arg = va_arg(ap, int);
+		if (arg < LIBUSB_BUFFER_ALLOCATOR_MALLOC || arg > LIBUSB_BUFFER_ALLOCATOR_MEMFD) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+#ifndef __linux__
+		else if (arg == LIBUSB_BUFFER_ALLOCATOR_HUGEPAGE) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+#endif
+#ifndef HAVE_MEMFD_CREATE
+		else if (arg == LIBUSB_BUFFER_ALLOCATOR_MEMFD) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+#endif
+	} else if (LIBUSB_OPTION_NUMA_BINDING == option) {
+		arg = va_arg(ap, int);
+		if (arg & ~(LIBUSB_NUMA_BIND_BUFFER_POOLS | LIBUSB_NUMA_BIND_EVENT_THREAD)) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		} else if (((arg & LIBUSB_NUMA_BIND_BUFFER_POOLS) && !usbi_backend.numa_bind_memory) ||
+			   ((arg & LIBUSB_NUMA_BIND_EVENT_THREAD) && !usbi_backend.numa_bind_thread)) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+	} else if (LIBUSB_OPTION_EVENT_ENGINE == option) {
+		arg = va_arg(ap, int);
+		if (arg < LIBUSB_EVENT_ENGINE_POLL || arg > LIBUSB_EVENT_ENGINE_IO_URING) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+#ifndef HAVE_EPOLL
+		else if (arg == LIBUSB_EVENT_ENGINE_EPOLL) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+#endif
+#ifndef HAVE_IO_URING
+		else if (arg == LIBUSB_EVENT_ENGINE_IO_URING) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+		}
+#endif
 	}
 	va_end(ap);
 
@@ -2314,8 +2950,21 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	if (NULL == ctx) {
 		usbi_mutex_static_lock(&default_context_lock);
 		default_context_options[option].is_set = 1;
-		if (LIBUSB_OPTION_LOG_LEVEL == option) {
+		if (LIBUSB_OPTION_LOG_LEVEL == option || LIBUSB_OPTION_TIMEOUT_SLACK_US == option ||
+		    LIBUSB_OPTION_EVENT_ENGINE == option || LIBUSB_OPTION_REAP_BUDGET == option ||
+		    LIBUSB_OPTION_BUSY_POLL_US == option || LIBUSB_OPTION_CALLBACK_THREADS == option ||
+		    LIBUSB_OPTION_EVENT_SHARDS == option || LIBUSB_OPTION_EVENT_THREAD == option ||
+		    LIBUSB_OPTION_EVENT_THREAD_PRIORITY == option ||
+		    LIBUSB_OPTION_BUFFER_ALLOCATOR == option ||
+		    LIBUSB_OPTION_NUMA_BINDING == option ||
+		    LIBUSB_OPTION_REALTIME == option ||
+		    LIBUSB_OPTION_REALTIME_IN_FLIGHT == option ||
+		    LIBUSB_OPTION_SYNC_FAST_PATH == option) {
 			default_context_options[option].arg.ival = arg;
+		} else if (LIBUSB_OPTION_EVENT_THREAD_CPUS == option) {
+			free(default_context_options[option].arg.sval);
+			default_context_options[option].arg.sval =
+				arg ? strdup(sval) : NULL;
 		}
 		usbi_mutex_static_unlock(&default_context_lock);
 	}
@@ -2333,6 +2982,71 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 #endif
 		break;
 
+	case LIBUSB_OPTION_TIMEOUT_SLACK_US:
+		ctx->timeout_slack_us = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_EVENT_ENGINE:
+		/* only used when the context is initialized */
+		ctx->event_engine = (enum libusb_event_engine)arg;
+		break;
+
+	case LIBUSB_OPTION_REAP_BUDGET:
+		ctx->reap_budget = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_BUSY_POLL_US:
+		ctx->busy_poll_us = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_CALLBACK_THREADS:
+		/* only used when the context is initialized */
+		ctx->callback_threads = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_EVENT_SHARDS:
+		/* only used when the context is initialized */
+		ctx->num_event_shards = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_EVENT_THREAD:
+		/* only used when the context is initialized */
+		ctx->event_thread_enabled = arg != 0;
+		break;
+
+	case LIBUSB_OPTION_EVENT_THREAD_CPUS:
+		/* only used when the context is initialized */
+		ctx->event_thread_cpus = cpus;
+		ctx->event_thread_num_cpus = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_EVENT_THREAD_PRIORITY:
+		/* only used when the context is initialized */
+		ctx->event_thread_priority = arg;
+		break;
+
+	case LIBUSB_OPTION_BUFFER_ALLOCATOR:
+		ctx->allocator = *builtin_allocator((enum libusb_buffer_allocator)arg);
+		break;
+
+	case LIBUSB_OPTION_NUMA_BINDING:
+		ctx->numa_binding = arg;
+		break;
+
+	case LIBUSB_OPTION_REALTIME:
+		/* only used when the context is initialized */
+		ctx->realtime_transfers = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_REALTIME_IN_FLIGHT:
+		/* only used when the context is initialized */
+		ctx->realtime_in_flight = (unsigned int)arg;
+		break;
+
+	case LIBUSB_OPTION_SYNC_FAST_PATH:
+		ctx->sync_fast_path = arg != 0;
+		break;
+
 		/* Handle all backend-specific options here */
 	case LIBUSB_OPTION_USE_USBDK:
 	case LIBUSB_OPTION_NO_DEVICE_DISCOVERY:
@@ -2350,6 +3064,33 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	return LIBUSB_SUCCESS;;
 }
 
+/** \ingroup libusb_lib
+ * Retrieve the current value of one of the statistics counters of a
+ * context. Counters start at zero when the context is created and are never
+ * reset.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx context to query, or NULL for the default context
+ * \param stat which counter to read, see \ref libusb_stat
+ * \param value output location for the counter value
+ * \returns \ref LIBUSB_SUCCESS on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the counter or context is invalid
+ */
+int API_EXPORTED libusb_get_stat(libusb_context *ctx, enum libusb_stat stat,
+	uint64_t *value)
+{
+	if (stat >= LIBUSB_STAT_MAX || !value)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = usbi_get_context(ctx);
+	if (!ctx)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*value = (uint64_t)usbi_atomic_load(&ctx->stats[stat]);
+	return LIBUSB_SUCCESS;
+}
+
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 /* returns the log level as defined in the LIBUSB_DEBUG environment variable.
  * if LIBUSB_DEBUG is not present or not a number, returns LIBUSB_LOG_LEVEL_NONE.
@@ -2433,6 +3174,9 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 	}
 
 	_ctx->debug = LIBUSB_LOG_LEVEL_NONE;
+	_ctx->reap_budget = USBI_DEFAULT_REAP_BUDGET;
+	_ctx->allocator = malloc_allocator;
+	_ctx->event_thread_numa_node = -1;
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 	if (getenv("LIBUSB_DEBUG")) {
 		_ctx->debug = get_env_debug_level();
@@ -2452,14 +3196,20 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		if (LIBUSB_OPTION_LOG_LEVEL == option || !default_context_options[option].is_set) {
 			continue;
 		}
-		r = libusb_set_option(_ctx, option);
+		if (LIBUSB_OPTION_EVENT_THREAD_CPUS == option)
+			r = libusb_set_option(_ctx, option, default_context_options[option].arg.sval);
+		else
+			r = libusb_set_option(_ctx, option, default_context_options[option].arg.ival);
 		if (LIBUSB_SUCCESS != r)
 			goto err_free_ctx;
 	}
 
 	/* apply any options provided by the user */
 	for (int i = 0 ; i < num_options ; ++i) {
-		r = libusb_set_option(_ctx, options[i].option, options[i].value.ival);
+		if (LIBUSB_OPTION_EVENT_THREAD_CPUS == options[i].option)
+			r = libusb_set_option(_ctx, options[i].option, options[i].value.sval);
+		else
+			r = libusb_set_option(_ctx, options[i].option, options[i].value.ival);
 		if (LIBUSB_SUCCESS != r)
 			goto err_free_ctx;
 	}
@@ -2491,6 +3241,11 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 	/* Initialize hotplug after the initial enumeration is done. */
 	usbi_hotplug_init(_ctx);
 
+	/* The event thread may handle hotplug events right away */
+	r = usbi_start_event_thread(_ctx);
+	if (r < 0)
+		goto err_backend_exit;
+
 	if (ctx) {
 		*ctx = _ctx;
 
@@ -2504,12 +3259,17 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 
 	return 0;
 
+err_backend_exit:
+	/* Exit hotplug before backend dependency, as libusb_exit() does */
+	usbi_hotplug_exit(_ctx);
+	if (usbi_backend.exit)
+		usbi_backend.exit(_ctx);
+
 err_io_exit:
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del(&_ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
-	usbi_hotplug_exit(_ctx);
 	usbi_io_exit(_ctx);
 
 err_free_ctx:
@@ -2567,6 +3327,11 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 	list_del(&_ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
+	/* Nothing handles the events from here on, then run the callbacks
+	 * still queued before their hotplug callbacks and devices go away */
+	usbi_stop_event_thread(_ctx);
+	usbi_stop_executor(_ctx);
+
 	/* Exit hotplug before backend dependency */
 	usbi_hotplug_exit(_ctx);
 
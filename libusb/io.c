@@ -23,6 +23,8 @@
 
 #include "libusbi.h"
 
+#include <string.h>
+
 /**
  * \page libusb_io Synchronous and asynchronous device I/O
  *
@@ -282,6 +284,25 @@ if (r == 0 && actual_length == sizeof(data)) {
  * functions are any listed in the \ref libusb_syncio "synchronous API" and any of
  * the blocking functions that retrieve \ref libusb_desc "USB descriptors".
  *
+ * If the context was created with \ref LIBUSB_OPTION_CALLBACK_THREADS, the
+ * callbacks are invoked from a pool of threads started by libusb instead, so
+ * that a slow callback does not hold up the completions of other devices.
+ *
+ * \subsection asynccq Completion queues
+ *
+ * As an alternative to callbacks, completed transfers can be collected by
+ * the application itself. Create a completion queue with libusb_cq_create()
+ * and attach it to a device handle, or to the whole context, with
+ * libusb_cq_attach(). The transfers completing there are then appended to the
+ * queue by the event handling thread instead of being passed to their
+ * callback, so that no application code runs in the event handling context.
+ *
+ * Any thread can take the completed transfers out of the queue in batches
+ * with libusb_cq_poll(). The file descriptor returned by libusb_cq_get_fd()
+ * is readable while the queue is not empty, for waiting on completions with
+ * poll() or as part of a main loop. Events still need to be handled as
+ * usual, e.g. by a dedicated thread calling libusb_handle_events().
+ *
  * \subsection Deallocation
  *
  * When a transfer has completed (i.e. the callback function has been invoked),
@@ -789,6 +810,11 @@ while (user has not requested application exit) {
  * call libusb_get_pollfds(), you can set up notification functions for when
  * the file descriptor set changes using libusb_set_pollfd_notifiers().
  *
+ * On Linux, a context created with the \ref LIBUSB_EVENT_ENGINE_EPOLL or
+ * \ref LIBUSB_EVENT_ENGINE_IO_URING event engine also offers a single file descriptor through libusb_get_event_fd()
+ * which stands for the whole set. Monitoring it instead of the set avoids
+ * tracking these changes altogether.
+ *
  * \subsection mtissues Multi-threaded considerations
  *
  * Unfortunately, the situation is complicated further when multiple threads
@@ -1083,34 +1109,26 @@ printf("completed!\n");
  *
  * -# During initialization, libusb opens an internal pipe, and it adds the read
  *    end of this pipe to the set of file descriptors to be polled.
- * -# During libusb_close(), libusb writes some dummy data on this event pipe.
- *    This immediately interrupts the event handler. libusb also records
- *    internally that it is trying to interrupt event handlers for this
- *    high-priority event.
- * -# At this point, some of the functions described above start behaving
- *    differently:
- *   - libusb_event_handling_ok() starts returning 1, indicating that it is NOT
- *     OK for event handling to continue.
- *   - libusb_try_lock_events() starts returning 1, indicating that another
- *     thread holds the event handling lock, even if the lock is uncontended.
- *   - libusb_event_handler_active() starts returning 1, indicating that
- *     another thread is doing event handling, even if that is not true.
- * -# The above changes in behaviour result in the event handler stopping and
- *    giving up the events lock very quickly, giving the high-priority
- *    libusb_close() operation a "free ride" to acquire the events lock. All
- *    threads that are competing to do event handling become event waiters.
- * -# With the events lock held inside libusb_close(), libusb can safely remove
- *    a file descriptor from the poll set, in the safety of knowledge that
- *    nobody is polling those descriptors or trying to access the poll set.
- * -# After obtaining the events lock, the close operation completes very
- *    quickly (usually a matter of milliseconds) and then immediately releases
- *    the events lock.
- * -# At the same time, the behaviour of libusb_event_handling_ok() and friends
- *    reverts to the original, documented behaviour.
- * -# The release of the events lock causes the threads that are waiting for
- *    events to be woken up and to start competing to become event handlers
- *    again. One of them will succeed; it will then re-obtain the list of poll
- *    descriptors, and USB I/O will then continue as normal.
+ * -# During libusb_close(), libusb queues the device handle for the event
+ *    handler to close and writes some dummy data on this event pipe. This
+ *    immediately interrupts the event handler.
+ * -# Once it is done with the file descriptors it was woken up for, the event
+ *    handler closes the queued device handles from within
+ *    libusb_handle_events_locked() and friends, while still holding the events
+ *    lock. As nobody else can be polling the descriptors at that time, libusb
+ *    can safely remove a file descriptor from the poll set. The event handler
+ *    then wakes up the threads waiting in libusb_close().
+ * -# If no thread is handling events, libusb_close() obtains the events lock
+ *    and closes the device itself.
+ * -# The event handler re-obtains the list of poll descriptors on its next
+ *    iteration, and USB I/O continues as normal. The I/O on the other devices
+ *    is never paused: event handling threads do not have to give up the
+ *    events lock for a device to be closed.
+ *
+ * Event handlers therefore have to keep calling
+ * libusb_handle_events_locked() (or one of the other event handling functions)
+ * when the internal event pipe becomes readable, as they already do for the
+ * other descriptors, or give up the events lock.
  *
  * libusb_open() is similar, and is actually a more simplistic case. Upon a
  * call to libusb_open():
@@ -1118,14 +1136,7 @@ printf("completed!\n");
  * -# The device is opened and a file descriptor is added to the poll set.
  * -# libusb sends some dummy data on the event pipe, and records that it
  *    is trying to modify the poll descriptor set.
- * -# The event handler is interrupted, and the same behaviour change as for
- *    libusb_close() takes effect, causing all event handling threads to become
- *    event waiters.
- * -# The libusb_open() implementation takes its free ride to the events lock.
- * -# Happy that it has successfully paused the events handler, libusb_open()
- *    releases the events lock.
- * -# The event waiter threads are all woken up and compete to become event
- *    handlers again. The one that succeeds will obtain the list of poll
+ * -# The event handler is interrupted and obtains the list of poll
  *    descriptors again, which will include the addition of the new device.
  *
  * \subsection concl Closing remarks
@@ -1157,6 +1168,198 @@ printf("completed!\n");
  * give up the events lock if instructed.
  */
 
+/* event sources come from the real-time reserve if the context has one */
+static struct usbi_event_source *alloc_event_source(struct libusb_context *ctx)
+{
+	struct usbi_realtime_reserve *rt = ctx->realtime;
+	struct usbi_event_source *ievent_source = NULL;
+
+	if (!rt)
+		return malloc(sizeof(*ievent_source));
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!list_empty(&rt->free_event_sources)) {
+		ievent_source = list_first_entry(&rt->free_event_sources,
+			struct usbi_event_source, list);
+		list_del(&ievent_source->list);
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (!ievent_source)
+		usbi_warn(ctx, "all %d event sources of the real-time reserve in use",
+			  USBI_REALTIME_EVENT_SOURCES);
+	return ievent_source;
+}
+
+/* Call with event_data_lock held, or while the context is not used */
+static void free_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	if (ctx->realtime)
+		list_add(&ievent_source->list, &ctx->realtime->free_event_sources);
+	else
+		free(ievent_source);
+}
+
+static void cleanup_removed_event_sources(struct libusb_context *ctx)
+{
+	struct usbi_event_source *ievent_source, *tmp;
+
+	for_each_removed_event_source_safe(ctx, ievent_source, tmp) {
+		/* the event engine may still report events for it */
+		if (ievent_source->engine_busy)
+			continue;
+		list_del(&ievent_source->list);
+		free_event_source(ctx, ievent_source);
+	}
+}
+
+static int create_event_shards(struct libusb_context *ctx)
+{
+	unsigned int i;
+	int r;
+
+	if (!ctx->num_event_shards)
+		return 0;
+
+	ctx->event_shards = calloc(ctx->num_event_shards, sizeof(*ctx->event_shards));
+	if (!ctx->event_shards)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < ctx->num_event_shards; i++) {
+		struct usbi_event_shard *shard = &ctx->event_shards[i];
+
+		r = usbi_create_event(&shard->event);
+		if (r < 0)
+			goto err_destroy_shards;
+
+		shard->ctx = ctx;
+		usbi_mutex_init(&shard->events_lock);
+		list_init(&shard->event_sources);
+		list_init(&shard->closing_handles);
+		list_init(&shard->event_followers);
+		/* the event data is built on the first wait */
+		shard->event_sources_modified = 1;
+	}
+
+	usbi_dbg(ctx, "using %u event shards", ctx->num_event_shards);
+	return 0;
+
+err_destroy_shards:
+	while (i--) {
+		usbi_destroy_event(&ctx->event_shards[i].event);
+		usbi_mutex_destroy(&ctx->event_shards[i].events_lock);
+	}
+	free(ctx->event_shards);
+	ctx->event_shards = NULL;
+	return r;
+}
+
+static void destroy_event_shards(struct libusb_context *ctx)
+{
+	unsigned int i;
+
+	if (!ctx->event_shards)
+		return;
+
+	for (i = 0; i < ctx->num_event_shards; i++) {
+		struct usbi_event_shard *shard = &ctx->event_shards[i];
+		struct usbi_event_source *ievent_source, *tmp;
+
+		/* left behind by device handles that were never closed */
+		list_for_each_entry_safe(ievent_source, tmp, &shard->event_sources, list, struct usbi_event_source) {
+			list_del(&ievent_source->list);
+			free_event_source(ctx, ievent_source);
+		}
+		usbi_free_shard_event_data(shard);
+		usbi_destroy_event(&shard->event);
+		usbi_mutex_destroy(&shard->events_lock);
+	}
+	free(ctx->event_shards);
+	ctx->event_shards = NULL;
+}
+
+static void destroy_realtime_reserve(struct libusb_context *ctx)
+{
+	struct usbi_realtime_reserve *rt = ctx->realtime;
+
+	if (!rt)
+		return;
+
+	libusb_transfer_pool_destroy(rt->transfers);
+	free(rt->control_buffers);
+	free(rt->event_sources);
+	free(rt);
+	ctx->realtime = NULL;
+}
+
+/* preallocate what the steady state of the context needs and lock it in
+ * memory, if the context is configured to use the real-time profile. Has to
+ * run before any event source is added. */
+static int create_realtime_reserve(struct libusb_context *ctx)
+{
+	unsigned int num_transfers = ctx->realtime_transfers;
+	struct usbi_realtime_reserve *rt;
+	size_t heap_size;
+	unsigned int i;
+	int r, failed;
+
+	if (!num_transfers)
+		return 0;
+
+	/* the synchronous transfers of the reserve have a timeout too */
+	heap_size = (size_t)num_transfers +
+		(ctx->realtime_in_flight ? ctx->realtime_in_flight : USBI_REALTIME_IN_FLIGHT);
+
+	rt = calloc(1, sizeof(*rt));
+	if (!rt)
+		return LIBUSB_ERROR_NO_MEM;
+	ctx->realtime = rt;
+	list_init(&rt->free_event_sources);
+
+	rt->transfers = libusb_transfer_pool_create(ctx, (int)num_transfers, 0);
+	rt->control_buffers = malloc((size_t)num_transfers * USBI_REALTIME_CONTROL_SIZE);
+	rt->event_sources = calloc(USBI_REALTIME_EVENT_SOURCES, sizeof(*rt->event_sources));
+	ctx->timeout_heap = malloc(heap_size * sizeof(*ctx->timeout_heap));
+	if (!rt->transfers || !rt->control_buffers || !rt->event_sources || !ctx->timeout_heap) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_destroy_reserve;
+	}
+	ctx->timeout_heap_size = heap_size;
+
+	r = usbi_reserve_event_data(ctx, USBI_REALTIME_EVENT_SOURCES);
+	if (r < 0)
+		goto err_destroy_reserve;
+
+	for (i = 0; i < USBI_REALTIME_EVENT_SOURCES; i++)
+		list_add_tail(&rt->event_sources[i].list, &rt->free_event_sources);
+
+	failed = usbi_lock_memory(rt, sizeof(*rt)) != 0;
+	failed |= usbi_lock_memory(rt->transfers, sizeof(*rt->transfers)) != 0;
+	failed |= usbi_lock_memory(rt->transfers->slab,
+		num_transfers * rt->transfers->transfer_size) != 0;
+	failed |= usbi_lock_memory(rt->control_buffers,
+		(size_t)num_transfers * USBI_REALTIME_CONTROL_SIZE) != 0;
+	failed |= usbi_lock_memory(rt->event_sources,
+		USBI_REALTIME_EVENT_SOURCES * sizeof(*rt->event_sources)) != 0;
+	failed |= usbi_lock_memory(ctx->timeout_heap,
+		heap_size * sizeof(*ctx->timeout_heap)) != 0;
+	if (failed)
+		usbi_warn(ctx, "could not lock the real-time reserve in memory, check RLIMIT_MEMLOCK");
+
+	usbi_dbg(ctx, "real-time profile with %u transfers, %zu in flight",
+		 num_transfers, heap_size);
+	return 0;
+
+err_destroy_reserve:
+	usbi_free_event_data(ctx);
+	free(ctx->timeout_heap);
+	ctx->timeout_heap = NULL;
+	ctx->timeout_heap_size = 0;
+	destroy_realtime_reserve(ctx);
+	return r;
+}
+
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
@@ -1167,25 +1370,56 @@ int usbi_io_init(struct libusb_context *ctx)
 	usbi_cond_init(&ctx->event_waiters_cond);
 	usbi_mutex_init(&ctx->event_data_lock);
 	usbi_tls_key_create(&ctx->event_handling_key);
-	list_init(&ctx->flying_transfers);
 	list_init(&ctx->event_sources);
 	list_init(&ctx->removed_event_sources);
 	list_init(&ctx->hotplug_msgs);
 	list_init(&ctx->completed_transfers);
+	list_init(&ctx->closing_handles);
+	list_init(&ctx->event_followers);
+
+#ifdef HAVE_OS_EVENT_ENGINE
+	r = usbi_create_event_engine(ctx);
+	if (r < 0)
+		usbi_warn(ctx, "event engine %d not available, falling back to poll",
+			  ctx->event_engine);
+#endif
+
+	/* the event data depends on the event engine */
+	r = create_realtime_reserve(ctx);
+	if (r < 0)
+		goto err_destroy_event_engine;
+
+	r = usbi_start_executor(ctx);
+	if (r < 0)
+		goto err_destroy_event_engine;
+
+	r = create_event_shards(ctx);
+	if (r < 0)
+		goto err_stop_executor;
 
 	r = usbi_create_event(&ctx->event);
 	if (r < 0)
-		goto err;
+		goto err_destroy_event_shards;
 
-	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS);
+	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS,
+		&ctx->event);
 	if (r < 0)
 		goto err_destroy_event;
 
 #ifdef HAVE_OS_TIMER
+#ifdef HAVE_IO_URING
+	if (usbi_using_io_uring(ctx)) {
+		/* timeouts are waited for on the ring, no timerfd is needed */
+		usbi_create_io_uring_timer(ctx, &ctx->timer);
+		usbi_dbg(ctx, "using io_uring for timeouts");
+		return 0;
+	}
+#endif
 	r = usbi_create_timer(&ctx->timer);
 	if (r == 0) {
 		usbi_dbg(ctx, "using timer for timeouts");
-		r = usbi_add_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer), USBI_TIMER_POLL_EVENTS);
+		r = usbi_add_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer), USBI_TIMER_POLL_EVENTS,
+			&ctx->timer);
 		if (r < 0)
 			goto err_destroy_timer;
 	} else {
@@ -1202,7 +1436,18 @@ err_destroy_timer:
 #endif
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
-err:
+err_destroy_event_shards:
+	destroy_event_shards(ctx);
+err_stop_executor:
+	usbi_stop_executor(ctx);
+err_destroy_event_engine:
+#ifdef HAVE_OS_EVENT_ENGINE
+	usbi_destroy_event_engine(ctx);
+#endif
+	cleanup_removed_event_sources(ctx);
+	usbi_free_event_data(ctx);
+	free(ctx->timeout_heap);
+	destroy_realtime_reserve(ctx);
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
@@ -1212,40 +1457,41 @@ err:
 	return r;
 }
 
-static void cleanup_removed_event_sources(struct libusb_context *ctx)
-{
-	struct usbi_event_source *ievent_source, *tmp;
-
-	for_each_removed_event_source_safe(ctx, ievent_source, tmp) {
-		list_del(&ievent_source->list);
-		free(ievent_source);
-	}
-}
-
 void usbi_io_exit(struct libusb_context *ctx)
 {
+	usbi_stop_executor(ctx);
+	destroy_event_shards(ctx);
 #ifdef HAVE_OS_TIMER
 	if (usbi_using_timer(ctx)) {
-		usbi_remove_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer));
+		if (!usbi_using_io_uring(ctx))
+			usbi_remove_event_source(ctx, USBI_TIMER_OS_HANDLE(&ctx->timer));
 		usbi_destroy_timer(&ctx->timer);
 	}
 #endif
 	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event));
 	usbi_destroy_event(&ctx->event);
+#ifdef HAVE_OS_EVENT_ENGINE
+	usbi_destroy_event_engine(ctx);
+#endif
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
+	free(ctx->timeout_heap);
 	cleanup_removed_event_sources(ctx);
-	free(ctx->event_data);
+	usbi_free_event_data(ctx);
+	free(ctx->multi_locked);
+	free(ctx->multi_ready);
+	destroy_realtime_reserve(ctx);
 }
 
 static void calculate_timeout(struct usbi_transfer *itransfer)
 {
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout;
+	unsigned int slack_us = ITRANSFER_CTX(itransfer)->timeout_slack_us;
 
 	if (!timeout) {
 		TIMESPEC_CLEAR(&itransfer->timeout);
@@ -1260,6 +1506,58 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 		++itransfer->timeout.tv_sec;
 		itransfer->timeout.tv_nsec -= NSEC_PER_SEC;
 	}
+
+	if (slack_us) {
+		/* round up to the end of the slack interval, so that transfers
+		 * expiring close to each other share the same deadline */
+		uint64_t slack_ns = (uint64_t)slack_us * 1000U;
+		uint64_t ns = (uint64_t)itransfer->timeout.tv_sec * NSEC_PER_SEC +
+			(uint64_t)itransfer->timeout.tv_nsec;
+
+		ns = (ns + slack_ns - 1) / slack_ns * slack_ns;
+		itransfer->timeout.tv_sec = (time_t)(ns / NSEC_PER_SEC);
+		itransfer->timeout.tv_nsec = (long)(ns % NSEC_PER_SEC);
+	}
+}
+
+/* size of the memory block holding a transfer: the backend private data,
+ * the usbi_transfer and the libusb_transfer with its iso packet descriptors */
+static size_t transfer_alloc_size(int iso_packets)
+{
+	return PTR_ALIGN(usbi_backend.transfer_priv_size)
+		+ sizeof(struct usbi_transfer)
+		+ sizeof(struct libusb_transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
+}
+
+/* set up a zeroed memory block of transfer_alloc_size() bytes as a transfer */
+static struct usbi_transfer *init_transfer(unsigned char *ptr, int iso_packets)
+{
+	struct usbi_transfer *itransfer;
+
+	itransfer = (struct usbi_transfer *)(ptr + PTR_ALIGN(usbi_backend.transfer_priv_size));
+	itransfer->num_iso_packets = iso_packets;
+	itransfer->priv = ptr;
+	usbi_mutex_init(&itransfer->lock);
+	return itransfer;
+}
+
+/* return a transfer to the pool it was taken from */
+static void transfer_pool_put(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer_pool *pool = itransfer->pool;
+	struct usbi_transfer_pool_shard *shard =
+		&pool->shards[usbi_get_tid() % USBI_TRANSFER_POOL_SHARDS];
+
+	if (itransfer->dev) {
+		libusb_unref_device(itransfer->dev);
+		itransfer->dev = NULL;
+	}
+
+	usbi_mutex_lock(&shard->lock);
+	list_add(&itransfer->list, &shard->free_transfers);
+	usbi_mutex_unlock(&shard->lock);
+	(void)usbi_atomic_dec(&pool->in_use);
 }
 
 /** \ingroup libusb_asyncio
@@ -1289,31 +1587,19 @@ DEFAULT_VISIBILITY
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	int iso_packets)
 {
-	size_t priv_size;
-	size_t alloc_size;
 	unsigned char *ptr;
 	struct usbi_transfer *itransfer;
-	struct libusb_transfer *transfer;
 
 	assert(iso_packets >= 0);
 	if (iso_packets < 0)
 		return NULL;
 
-	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
-	alloc_size = priv_size
-		+ sizeof(struct usbi_transfer)
-		+ sizeof(struct libusb_transfer)
-		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
-	ptr = calloc(1, alloc_size);
+	ptr = calloc(1, transfer_alloc_size(iso_packets));
 	if (!ptr)
 		return NULL;
 
-	itransfer = (struct usbi_transfer *)(ptr + priv_size);
-	itransfer->num_iso_packets = iso_packets;
-	itransfer->priv = ptr;
-	usbi_mutex_init(&itransfer->lock);
-	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	return transfer;
+	itransfer = init_transfer(ptr, iso_packets);
+	return USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
 /** \ingroup libusb_asyncio
@@ -1331,6 +1617,11 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
  * It is not legal to free an active transfer (one which has been submitted
  * and has not yet completed).
  *
+ * If the transfer was obtained from libusb_transfer_pool_alloc(), it is
+ * returned to its pool instead of being freed. A buffer attached with
+ * libusb_buffer_pool_attach() is returned to its pool as well, whatever the
+ * flags of the transfer.
+ *
  * \param transfer the transfer to free
  */
 void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
@@ -1343,10 +1634,25 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		return;
 
 	usbi_dbg(TRANSFER_CTX(transfer), "transfer %p", (void *) transfer);
-	if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER)
+	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (itransfer->buffer_pool) {
+		libusb_buffer_pool_free(itransfer->buffer_pool, itransfer->pool_buffer);
+		itransfer->buffer_pool = NULL;
+		itransfer->pool_buffer = NULL;
+	} else if (itransfer->alloc_buffer) {
+		libusb_buffer_free(ITRANSFER_CTX(itransfer), itransfer->alloc_buffer);
+		itransfer->alloc_buffer = NULL;
+	} else if (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER) {
 		free(transfer->buffer);
+	}
 
-	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (itransfer->pool) {
+		transfer_pool_put(itransfer);
+		return;
+	}
+
+	if (usbi_backend.destroy_transfer)
+		usbi_backend.destroy_transfer(itransfer);
 	usbi_mutex_destroy(&itransfer->lock);
 	if (itransfer->dev)
 		libusb_unref_device(itransfer->dev);
@@ -1357,131 +1663,1023 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	free(ptr);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
- * returns 0 on success or a LIBUSB_ERROR code on failure.
+/** \ingroup libusb_asyncio
+ * Create a pool of preallocated transfers. All transfers of the pool are
+ * allocated and initialized at once, including the backend private data, so
+ * that obtaining a transfer with libusb_transfer_pool_alloc() and returning
+ * it with libusb_free_transfer() never goes through the system memory
+ * allocator.
+ *
+ * Every transfer of the pool has room for iso_packets isochronous packet
+ * descriptors, see libusb_alloc_transfer() for details.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context the pool is used with, or NULL for the default context
+ * \param num_transfers number of transfers in the pool. Must be positive.
+ * \param iso_packets number of isochronous packet descriptors of each transfer.
+ * Must be non-negative.
+ * \returns a newly allocated pool, or NULL on error
  */
-#ifdef HAVE_OS_TIMER
-static int arm_timer_for_next_timeout(struct libusb_context *ctx)
+DEFAULT_VISIBILITY
+libusb_transfer_pool * LIBUSB_CALL libusb_transfer_pool_create(
+	libusb_context *ctx, int num_transfers, int iso_packets)
 {
-	struct usbi_transfer *itransfer;
+	struct libusb_transfer_pool *pool;
+	int i;
 
-	if (!usbi_using_timer(ctx))
-		return 0;
+	if (num_transfers <= 0 || iso_packets < 0)
+		return NULL;
 
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
 
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			break;
+	pool->ctx = usbi_get_context(ctx);
+	pool->num_transfers = num_transfers;
+	pool->iso_packets = iso_packets;
+	pool->transfer_size = PTR_ALIGN(transfer_alloc_size(iso_packets));
+	pool->slab = calloc((size_t)num_transfers, pool->transfer_size);
+	if (!pool->slab) {
+		free(pool);
+		return NULL;
+	}
 
-		/* act on first transfer that has not already been handled */
-		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			usbi_dbg(ctx, "next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-			return usbi_arm_timer(&ctx->timer, cur_ts);
-		}
+	for (i = 0; i < USBI_TRANSFER_POOL_SHARDS; i++) {
+		usbi_mutex_init(&pool->shards[i].lock);
+		list_init(&pool->shards[i].free_transfers);
 	}
 
-	usbi_dbg(ctx, "no timeouts, disarming timer");
-	return usbi_disarm_timer(&ctx->timer);
+	for (i = 0; i < num_transfers; i++) {
+		unsigned char *ptr = pool->slab + (size_t)i * pool->transfer_size;
+		struct usbi_transfer *itransfer = init_transfer(ptr, iso_packets);
+
+		itransfer->pool = pool;
+		list_add_tail(&itransfer->list,
+			&pool->shards[i % USBI_TRANSFER_POOL_SHARDS].free_transfers);
+	}
+
+	usbi_dbg(pool->ctx, "pool %p with %d transfers", (void *) pool, num_transfers);
+	return pool;
 }
-#else
-static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
+
+/** \ingroup libusb_asyncio
+ * Take a transfer from a pool. The returned transfer is initialized in the
+ * same way as one returned by libusb_alloc_transfer(). Pass it to
+ * libusb_free_transfer() (or set \ref LIBUSB_TRANSFER_FREE_TRANSFER) to
+ * return it to the pool.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to take the transfer from
+ * \returns a transfer, or NULL if all transfers of the pool are in use
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_alloc(
+	libusb_transfer_pool *pool)
 {
-	UNUSED(ctx);
-	return 0;
+	unsigned int start = usbi_get_tid() % USBI_TRANSFER_POOL_SHARDS;
+	struct usbi_transfer *itransfer = NULL;
+	struct libusb_transfer *transfer;
+	unsigned int i;
+
+	/* start with this thread's shard, then steal from the others */
+	for (i = 0; i < USBI_TRANSFER_POOL_SHARDS && !itransfer; i++) {
+		struct usbi_transfer_pool_shard *shard =
+			&pool->shards[(start + i) % USBI_TRANSFER_POOL_SHARDS];
+
+		usbi_mutex_lock(&shard->lock);
+		if (!list_empty(&shard->free_transfers)) {
+			itransfer = list_first_entry(&shard->free_transfers,
+				struct usbi_transfer, list);
+			list_del(&itransfer->list);
+		}
+		usbi_mutex_unlock(&shard->lock);
+	}
+
+	if (!itransfer) {
+		usbi_dbg(pool->ctx, "pool %p exhausted", (void *) pool);
+		return NULL;
+	}
+
+	(void)usbi_atomic_inc(&pool->in_use);
+
+	itransfer->transferred = 0;
+	itransfer->stream_id = 0;
+	usbi_atomic_store(&itransfer->state_flags, 0);
+	itransfer->timeout_flags = 0;
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	memset(transfer, 0, sizeof(*transfer)
+		+ (sizeof(struct libusb_iso_packet_descriptor) * (size_t)pool->iso_packets));
+	return transfer;
 }
-#endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
- * This function will return non 0 if fails to update the timer,
- * in which case the transfer is *not* on the flying_transfers list. */
-static int add_to_flying_list(struct usbi_transfer *itransfer)
+/** \ingroup libusb_asyncio
+ * Destroy a transfer pool. All transfers taken from the pool must have been
+ * returned with libusb_free_transfer() before calling this function.
+ *
+ * It is legal to call this function with a NULL pool. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to destroy
+ */
+void API_EXPORTED libusb_transfer_pool_destroy(libusb_transfer_pool *pool)
 {
-	struct usbi_transfer *cur;
-	struct timespec *timeout = &itransfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
-	int first = 1;
+	long in_use;
+	int i;
 
-	calculate_timeout(itransfer);
+	if (!pool)
+		return;
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&itransfer->list, &ctx->flying_transfers);
-		goto out;
-	}
+	in_use = (long)usbi_atomic_load(&pool->in_use);
+	if (in_use)
+		usbi_warn(pool->ctx, "destroying pool %p with %ld transfers still in use",
+			  (void *) pool, in_use);
 
-	/* if we have infinite timeout, append to end of list */
-	if (!TIMESPEC_IS_SET(timeout)) {
-		list_add_tail(&itransfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
+	for (i = 0; i < pool->num_transfers; i++) {
+		unsigned char *ptr = pool->slab + (size_t)i * pool->transfer_size;
+		struct usbi_transfer *itransfer = (struct usbi_transfer *)
+			(ptr + PTR_ALIGN(usbi_backend.transfer_priv_size));
+
+		if (usbi_backend.destroy_transfer)
+			usbi_backend.destroy_transfer(itransfer);
+		usbi_mutex_destroy(&itransfer->lock);
 	}
+	for (i = 0; i < USBI_TRANSFER_POOL_SHARDS; i++)
+		usbi_mutex_destroy(&pool->shards[i].lock);
 
-	/* otherwise, find appropriate place in list */
-	for_each_transfer(ctx, cur) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timespec *cur_ts = &cur->timeout;
+	free(pool->slab);
+	free(pool);
+}
 
-		if (!TIMESPEC_IS_SET(cur_ts) || TIMESPEC_CMP(cur_ts, timeout, >)) {
-			list_add_tail(&itransfer->list, &cur->list);
-			goto out;
+/* Obtain a transfer for the synchronous API, from the real-time reserve if the
+ * context has one. If buffer_size is not 0, the transfer comes with a buffer
+ * of that size which is released along with the transfer. */
+struct libusb_transfer *usbi_alloc_sync_transfer(struct libusb_context *ctx,
+	size_t buffer_size)
+{
+	struct usbi_realtime_reserve *rt = ctx->realtime;
+	struct libusb_transfer *transfer;
+	unsigned char *ptr;
+	size_t idx;
+
+	if (!rt) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer || !buffer_size)
+			return transfer;
+
+		transfer->buffer = libusb_buffer_alloc(ctx, buffer_size);
+		if (!transfer->buffer) {
+			libusb_free_transfer(transfer);
+			return NULL;
 		}
-		first = 0;
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->alloc_buffer = transfer->buffer;
+		return transfer;
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&itransfer->list, &ctx->flying_transfers);
-out:
-#ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
-		/* if this transfer has the lowest timeout of all active transfers,
-		 * rearm the timer with this transfer's timeout */
-		usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
+	if (buffer_size > USBI_REALTIME_CONTROL_SIZE) {
+		usbi_dbg(ctx, "buffer of %zu bytes exceeds the real-time reserve", buffer_size);
+		return NULL;
 	}
-#else
-	UNUSED(first);
-#endif
 
-	if (r)
-		list_del(&itransfer->list);
+	transfer = libusb_transfer_pool_alloc(rt->transfers);
+	if (!transfer || !buffer_size)
+		return transfer;
 
-	return r;
+	/* each transfer of the reserve has its own control buffer */
+	ptr = (unsigned char *)LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)
+		- PTR_ALIGN(usbi_backend.transfer_priv_size);
+	idx = (size_t)(ptr - rt->transfers->slab) / rt->transfers->transfer_size;
+	transfer->buffer = rt->control_buffers + idx * USBI_REALTIME_CONTROL_SIZE;
+	return transfer;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout. */
-static int remove_from_flying_list(struct usbi_transfer *itransfer)
+/** \ingroup libusb_asyncio
+ * Create a pool of transfer buffers for a device handle. The buffers are
+ * carved out of a single block of device memory obtained with
+ * libusb_dev_mem_alloc(), so that the host controller transfers data directly
+ * from and to them, without the copy through kernel memory ordinary buffers
+ * go through. This takes one mapping per pool instead of one per buffer.
+ *
+ * If the platform does not provide device memory, or cannot provide that
+ * much (e.g. because of the usbfs_memory_mb limit on Linux), the buffers are
+ * carved out of ordinary memory instead, which
+ * libusb_buffer_pool_is_device_memory() reports.
+ *
+ * With \ref LIBUSB_NUMA_BIND_BUFFER_POOLS, ordinary memory is made to prefer
+ * the NUMA node of the device.
+ *
+ * Each buffer is aligned on 64 bytes, so that buffers do not share cache
+ * lines. The pool must be destroyed before the device handle is closed.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle the device handle the buffers are used with
+ * \param buffer_size size of each buffer. Must be positive.
+ * \param num_buffers number of buffers in the pool. Must be positive.
+ * \returns a newly allocated pool, or NULL on error
+ */
+DEFAULT_VISIBILITY
+libusb_buffer_pool * LIBUSB_CALL libusb_buffer_pool_create(
+	libusb_device_handle *dev_handle, size_t buffer_size, int num_buffers)
 {
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int rearm_timer;
-	int r = 0;
+	struct libusb_buffer_pool *pool;
+	int i;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
-	list_del(&itransfer->list);
-	if (rearm_timer)
-		r = arm_timer_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (!dev_handle || !buffer_size || num_buffers <= 0)
+		return NULL;
 
-	return r;
-}
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
 
-/** \ingroup libusb_asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
+	pool->dev_handle = dev_handle;
+	pool->buffer_size = buffer_size;
+	pool->stride = (buffer_size + USBI_BUFFER_POOL_ALIGN - 1) & ~(size_t)(USBI_BUFFER_POOL_ALIGN - 1);
+	pool->num_buffers = num_buffers;
+	pool->mem_size = pool->stride * (size_t)num_buffers;
+
+	pool->mem = libusb_dev_mem_alloc(dev_handle, pool->mem_size);
+	if (pool->mem) {
+		pool->dev_mem = 1;
+	} else {
+		usbi_dbg(HANDLE_CTX(dev_handle), "no device memory, using ordinary memory");
+		pool->mem_alloc = malloc(pool->mem_size + USBI_BUFFER_POOL_ALIGN - 1);
+		if (!pool->mem_alloc) {
+			free(pool);
+			return NULL;
+		}
+		pool->mem = (unsigned char *)(((uintptr_t)pool->mem_alloc + USBI_BUFFER_POOL_ALIGN - 1)
+			& ~(uintptr_t)(USBI_BUFFER_POOL_ALIGN - 1));
+		if ((HANDLE_CTX(dev_handle)->numa_binding & LIBUSB_NUMA_BIND_BUFFER_POOLS)
+		    && dev_handle->dev && dev_handle->dev->numa_node >= 0
+		    && usbi_backend.numa_bind_memory)
+			usbi_backend.numa_bind_memory(dev_handle->dev, pool->mem, pool->mem_size);
+	}
+
+	usbi_mutex_init(&pool->lock);
+	for (i = num_buffers - 1; i >= 0; i--) {
+		void **buffer = (void **)(void *)(pool->mem + (size_t)i * pool->stride);
+
+		*buffer = pool->free_buffers;
+		pool->free_buffers = buffer;
+	}
+
+	usbi_dbg(HANDLE_CTX(dev_handle), "pool %p with %d buffers of %zu bytes", (void *) pool,
+		 num_buffers, buffer_size);
+	return pool;
+}
+
+/** \ingroup libusb_asyncio
+ * Take a buffer from a pool. Return it with libusb_buffer_pool_free().
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to take the buffer from
+ * \returns a buffer of the size given to libusb_buffer_pool_create(), or NULL
+ * if all buffers of the pool are in use
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_buffer_pool_alloc(libusb_buffer_pool *pool)
+{
+	void **buffer;
+
+	usbi_mutex_lock(&pool->lock);
+	buffer = pool->free_buffers;
+	if (buffer)
+		pool->free_buffers = *buffer;
+	usbi_mutex_unlock(&pool->lock);
+
+	if (!buffer) {
+		usbi_dbg(HANDLE_CTX(pool->dev_handle), "pool %p exhausted", (void *) pool);
+		return NULL;
+	}
+
+	(void)usbi_atomic_inc(&pool->in_use);
+	return (unsigned char *)buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Return a buffer to the pool it was taken from.
+ *
+ * It is legal to call this function with a NULL buffer. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool the buffer was taken from
+ * \param buffer the buffer to return
+ */
+void API_EXPORTED libusb_buffer_pool_free(libusb_buffer_pool *pool,
+	unsigned char *buffer)
+{
+	void **free_buffer = (void **)(void *)buffer;
+
+	if (!buffer)
+		return;
+
+	assert(buffer >= pool->mem && buffer < pool->mem + pool->mem_size);
+	usbi_mutex_lock(&pool->lock);
+	*free_buffer = pool->free_buffers;
+	pool->free_buffers = free_buffer;
+	usbi_mutex_unlock(&pool->lock);
+	(void)usbi_atomic_dec(&pool->in_use);
+}
+
+/** \ingroup libusb_asyncio
+ * Take a buffer from a pool and use it as the buffer of a transfer. The
+ * \ref libusb_transfer::buffer "buffer" and \ref libusb_transfer::length
+ * "length" fields of the transfer are set to the buffer and its size. The
+ * buffer stays with the transfer when it is resubmitted, and returns to the
+ * pool when the transfer is freed with libusb_free_transfer(), or after its
+ * callback if \ref LIBUSB_TRANSFER_FREE_TRANSFER is set. A buffer attached
+ * before to the transfer returns to its pool right away.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to take the buffer from
+ * \param transfer the transfer to attach the buffer to. Must not be in flight.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NO_MEM if all buffers of the pool are in use
+ */
+int API_EXPORTED libusb_buffer_pool_attach(libusb_buffer_pool *pool,
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	unsigned char *buffer;
+
+	if (itransfer->buffer_pool) {
+		libusb_buffer_pool_free(itransfer->buffer_pool, itransfer->pool_buffer);
+		itransfer->buffer_pool = NULL;
+		itransfer->pool_buffer = NULL;
+	}
+
+	buffer = libusb_buffer_pool_alloc(pool);
+	if (!buffer)
+		return LIBUSB_ERROR_NO_MEM;
+
+	itransfer->buffer_pool = pool;
+	itransfer->pool_buffer = buffer;
+	transfer->buffer = buffer;
+	transfer->length = (int)pool->buffer_size;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Tell whether the buffers of a pool are device memory, or ordinary memory
+ * because device memory was not available.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to query
+ * \returns 1 if the buffers are device memory, 0 otherwise
+ */
+int API_EXPORTED libusb_buffer_pool_is_device_memory(libusb_buffer_pool *pool)
+{
+	return pool->dev_mem;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a buffer pool. All buffers taken from the pool must have been
+ * returned, and the transfers they are attached to freed, before calling
+ * this function. The device handle of the pool must still be open.
+ *
+ * It is legal to call this function with a NULL pool. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to destroy
+ */
+void API_EXPORTED libusb_buffer_pool_destroy(libusb_buffer_pool *pool)
+{
+	long in_use;
+
+	if (!pool)
+		return;
+
+	in_use = (long)usbi_atomic_load(&pool->in_use);
+	if (in_use)
+		usbi_warn(HANDLE_CTX(pool->dev_handle),
+			  "destroying pool %p with %ld buffers still in use", (void *) pool, in_use);
+
+	if (pool->dev_mem)
+		libusb_dev_mem_free(pool->dev_handle, pool->mem, pool->mem_size);
+	else
+		free(pool->mem_alloc);
+	usbi_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* append a completed transfer to the ring of a completion queue, or to its
+ * overflow list if the ring is full or the overflow list is in use so that
+ * transfers are delivered in completion order */
+static void cq_push(struct libusb_cq *cq, struct libusb_transfer *transfer)
+{
+	struct usbi_cq_slot *slot = NULL;
+	long pos, diff;
+
+	if (!usbi_atomic_load(&cq->overflowed)) {
+		pos = usbi_atomic_load(&cq->head);
+		for (;;) {
+			slot = &cq->slots[pos & cq->mask];
+			diff = usbi_atomic_load(&slot->seq) - pos;
+			if (diff == 0) {
+				if (usbi_atomic_cas(&cq->head, pos, pos + 1))
+					break;
+				pos = usbi_atomic_load(&cq->head);
+			} else if (diff < 0) {
+				slot = NULL;
+				break;
+			} else {
+				pos = usbi_atomic_load(&cq->head);
+			}
+		}
+	}
+
+	if (slot) {
+		slot->transfer = transfer;
+		usbi_atomic_store(&slot->seq, pos + 1);
+	} else {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+		usbi_mutex_lock(&cq->overflow_lock);
+		list_add_tail(&itransfer->list, &cq->overflow);
+		(void)usbi_atomic_inc(&cq->overflowed);
+		usbi_mutex_unlock(&cq->overflow_lock);
+	}
+
+	if (usbi_atomic_inc(&cq->pending) == 1) {
+		usbi_mutex_lock(&cq->event_lock);
+		if (!cq->signaled) {
+			usbi_signal_event(&cq->event);
+			cq->signaled = 1;
+		}
+		usbi_mutex_unlock(&cq->event_lock);
+	}
+}
+
+/* take the oldest transfer from the ring of a completion queue */
+static struct libusb_transfer *cq_pop(struct libusb_cq *cq)
+{
+	struct libusb_transfer *transfer;
+	struct usbi_cq_slot *slot;
+	long pos, diff;
+
+	pos = usbi_atomic_load(&cq->tail);
+	for (;;) {
+		slot = &cq->slots[pos & cq->mask];
+		diff = usbi_atomic_load(&slot->seq) - (pos + 1);
+		if (diff == 0) {
+			if (usbi_atomic_cas(&cq->tail, pos, pos + 1))
+				break;
+			pos = usbi_atomic_load(&cq->tail);
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = usbi_atomic_load(&cq->tail);
+		}
+	}
+
+	transfer = slot->transfer;
+	usbi_atomic_store(&slot->seq, pos + cq->mask + 1);
+	return transfer;
+}
+
+/* completion queue a completed transfer is delivered to, if any */
+static struct libusb_cq *transfer_cq(struct libusb_transfer *transfer)
+{
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+
+	if (dev_handle && dev_handle->cq)
+		return dev_handle->cq;
+	return TRANSFER_CTX(transfer)->cq;
+}
+
+/** \ingroup libusb_asyncio
+ * Create a completion queue. Once attached to a device handle or to a whole
+ * context with libusb_cq_attach(), the transfers completing on it are not
+ * passed to their callback by the event handling thread. They are queued
+ * instead, to be collected by any thread with libusb_cq_poll(). See
+ * \ref asynccq for details.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param size number of transfers the queue holds without allocating. It is
+ * rounded up to a power of two. Must be positive.
+ * \param cq output location for the new completion queue
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if size is invalid
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_cq_create(libusb_context *ctx, int size,
+	libusb_cq **cq)
+{
+	struct libusb_cq *_cq;
+	long slots = 1;
+	long i;
+	int r;
+
+	if (size <= 0 || size > (1 << 24))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	while (slots < size)
+		slots <<= 1;
+
+	_cq = calloc(1, sizeof(*_cq));
+	if (!_cq)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_cq->slots = calloc((size_t)slots, sizeof(*_cq->slots));
+	if (!_cq->slots) {
+		free(_cq);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	r = usbi_create_event(&_cq->event);
+	if (r) {
+		free(_cq->slots);
+		free(_cq);
+		return r;
+	}
+
+	for (i = 0; i < slots; i++)
+		usbi_atomic_store(&_cq->slots[i].seq, i);
+	_cq->mask = slots - 1;
+	_cq->ctx = usbi_get_context(ctx);
+	usbi_mutex_init(&_cq->overflow_lock);
+	list_init(&_cq->overflow);
+	usbi_mutex_init(&_cq->event_lock);
+
+	usbi_dbg(_cq->ctx, "completion queue %p with %ld slots", (void *) _cq, slots);
+	*cq = _cq;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a completion queue. The queue must have been detached from all
+ * device handles and from its context with libusb_cq_detach(), and no
+ * transfer delivered to it may still be in flight. Transfers still queued
+ * are lost.
+ *
+ * It is legal to call this function with a NULL queue. In this case, the
+ * function will simply return safely.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue to destroy
+ */
+void API_EXPORTED libusb_cq_destroy(libusb_cq *cq)
+{
+	long pending;
+
+	if (!cq)
+		return;
+
+	pending = (long)usbi_atomic_load(&cq->pending);
+	if (pending > 0)
+		usbi_warn(cq->ctx, "destroying completion queue %p with %ld transfers queued",
+			  (void *) cq, pending);
+	if (cq->ctx->cq == cq)
+		usbi_warn(cq->ctx, "destroying completion queue %p still attached to its context",
+			  (void *) cq);
+
+	usbi_destroy_event(&cq->event);
+	usbi_mutex_destroy(&cq->event_lock);
+	usbi_mutex_destroy(&cq->overflow_lock);
+	free(cq->slots);
+	free(cq);
+}
+
+/** \ingroup libusb_asyncio
+ * Deliver the transfers completing on a device handle, or on all device
+ * handles of the context of the queue, to a completion queue. A queue
+ * attached to a device handle takes precedence over the one attached to the
+ * context. Attaching a queue replaces the one previously attached.
+ *
+ * This function must not be called while transfers of the device handles
+ * concerned are in flight.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue
+ * \param dev_handle a device handle opened on the context of the queue, or
+ * NULL to attach the queue to the context
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the device handle belongs to
+ * another context
+ */
+int API_EXPORTED libusb_cq_attach(libusb_cq *cq,
+	libusb_device_handle *dev_handle)
+{
+	if (!dev_handle) {
+		cq->ctx->cq = cq;
+		return 0;
+	}
+
+	if (HANDLE_CTX(dev_handle) != cq->ctx)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	dev_handle->cq = cq;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Stop delivering the transfers completing on a device handle, or on the
+ * device handles of the context of the queue, to a completion queue.
+ * Afterwards, the transfers completing there invoke their callback again,
+ * unless another queue applies. Nothing is done if the queue is not the one
+ * attached there.
+ *
+ * This function must not be called while transfers of the device handles
+ * concerned are in flight.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue
+ * \param dev_handle the device handle to detach the queue from, or NULL to
+ * detach it from the context
+ */
+void API_EXPORTED libusb_cq_detach(libusb_cq *cq,
+	libusb_device_handle *dev_handle)
+{
+	if (!dev_handle) {
+		if (cq->ctx->cq == cq)
+			cq->ctx->cq = NULL;
+	} else if (dev_handle->cq == cq) {
+		dev_handle->cq = NULL;
+	}
+}
+
+/** \ingroup libusb_asyncio
+ * Collect completed transfers from a completion queue, oldest first. This
+ * function never blocks; use libusb_cq_get_fd() to wait for completions.
+ * It may be called from any thread, and from several threads concurrently.
+ *
+ * The collected transfers have their status and actual_length populated just
+ * as they would be for a callback, and the caller is free to resubmit or free
+ * them. The \ref LIBUSB_TRANSFER_FREE_TRANSFER flag is ignored for transfers
+ * delivered to a completion queue.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue
+ * \param transfers output array of at least max transfers
+ * \param max maximum number of transfers to collect
+ * \returns the number of transfers stored in transfers, 0 if there is none
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if max is negative
+ */
+int API_EXPORTED libusb_cq_poll(libusb_cq *cq,
+	struct libusb_transfer **transfers, int max)
+{
+	int n = 0;
+	int i;
+
+	if (max < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	while (n < max) {
+		struct libusb_transfer *transfer = cq_pop(cq);
+
+		if (!transfer)
+			break;
+		transfers[n++] = transfer;
+	}
+
+	if (n < max && usbi_atomic_load(&cq->overflowed)) {
+		struct usbi_transfer *itransfer;
+
+		usbi_mutex_lock(&cq->overflow_lock);
+		while (n < max && !list_empty(&cq->overflow)) {
+			itransfer = list_first_entry(&cq->overflow,
+				struct usbi_transfer, list);
+			list_del(&itransfer->list);
+			(void)usbi_atomic_dec(&cq->overflowed);
+			transfers[n++] = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+		}
+		usbi_mutex_unlock(&cq->overflow_lock);
+	}
+
+	for (i = 0; i < n; i++)
+		(void)usbi_atomic_dec(&cq->pending);
+
+	/* keep the event signalled for as long as anything is queued. A
+	 * producer making the queue non-empty signals it again under the lock */
+	if (usbi_atomic_load(&cq->pending) <= 0) {
+		usbi_mutex_lock(&cq->event_lock);
+		if (cq->signaled && usbi_atomic_load(&cq->pending) <= 0) {
+			usbi_clear_event(&cq->event);
+			cq->signaled = 0;
+		}
+		usbi_mutex_unlock(&cq->event_lock);
+	}
+
+	return n;
+}
+
+/** \ingroup libusb_asyncio
+ * Retrieve a file descriptor that is readable while transfers are waiting in
+ * a completion queue. It can be monitored with poll() or similar, followed by
+ * libusb_cq_poll() when it becomes readable. The file descriptor is owned by
+ * the queue and must not be read from or closed by the application.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param cq the completion queue
+ * \returns the file descriptor on success
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED on platforms without file
+ * descriptors, e.g. Windows
+ */
+int API_EXPORTED libusb_cq_get_fd(libusb_cq *cq)
+{
+#if !defined(PLATFORM_WINDOWS)
+	return USBI_EVENT_OS_HANDLE(&cq->event);
+#else
+	UNUSED(cq);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/* timeout heap helpers. The heap holds the in-flight transfers whose timeout
+ * still needs to be processed by libusb, ordered by expiration. All of these
+ * must be called with the flying_transfers_lock held. */
+static void timeout_heap_set(struct libusb_context *ctx, size_t idx,
+	struct usbi_transfer *itransfer)
+{
+	ctx->timeout_heap[idx] = itransfer;
+	itransfer->timeout_heap_pos = idx + 1;
+}
+
+static void timeout_heap_sift_up(struct libusb_context *ctx, size_t idx)
+{
+	struct usbi_transfer *itransfer = ctx->timeout_heap[idx];
+
+	while (idx > 0) {
+		size_t parent = (idx - 1) / 2;
+
+		if (!TIMESPEC_CMP(&itransfer->timeout, &ctx->timeout_heap[parent]->timeout, <))
+			break;
+		timeout_heap_set(ctx, idx, ctx->timeout_heap[parent]);
+		idx = parent;
+	}
+	timeout_heap_set(ctx, idx, itransfer);
+}
+
+static void timeout_heap_sift_down(struct libusb_context *ctx, size_t idx)
+{
+	struct usbi_transfer *itransfer = ctx->timeout_heap[idx];
+	size_t len = ctx->timeout_heap_len;
+
+	for (;;) {
+		size_t child = 2 * idx + 1;
+
+		if (child >= len)
+			break;
+		if (child + 1 < len &&
+		    TIMESPEC_CMP(&ctx->timeout_heap[child + 1]->timeout, &ctx->timeout_heap[child]->timeout, <))
+			child++;
+		if (!TIMESPEC_CMP(&ctx->timeout_heap[child]->timeout, &itransfer->timeout, <))
+			break;
+		timeout_heap_set(ctx, idx, ctx->timeout_heap[child]);
+		idx = child;
+	}
+	timeout_heap_set(ctx, idx, itransfer);
+}
+
+static int timeout_heap_push(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	if (ctx->timeout_heap_len == ctx->timeout_heap_size) {
+		struct usbi_transfer **heap;
+		size_t new_size;
+
+		if (ctx->realtime) {
+			usbi_dbg(ctx, "all %zu timeouts of the real-time reserve in use",
+				 ctx->timeout_heap_size);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+
+		new_size = ctx->timeout_heap_size ? 2 * ctx->timeout_heap_size : 32;
+
+		heap = realloc(ctx->timeout_heap, new_size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = new_size;
+	}
+
+	ctx->timeout_heap[ctx->timeout_heap_len] = itransfer;
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_len++);
+	return 0;
+}
+
+static void timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	size_t idx = itransfer->timeout_heap_pos - 1;
+	struct usbi_transfer *last;
+
+	assert(itransfer->timeout_heap_pos && ctx->timeout_heap[idx] == itransfer);
+	itransfer->timeout_heap_pos = 0;
+
+	last = ctx->timeout_heap[--ctx->timeout_heap_len];
+	if (last == itransfer)
+		return;
+
+	/* move the last entry into the hole and restore the heap property */
+	timeout_heap_set(ctx, idx, last);
+	if (idx > 0 && TIMESPEC_CMP(&last->timeout, &ctx->timeout_heap[(idx - 1) / 2]->timeout, <))
+		timeout_heap_sift_up(ctx, idx);
+	else
+		timeout_heap_sift_down(ctx, idx);
+}
+
+/* returns the transfer with the soonest timeout that libusb still has to
+ * handle, or NULL if there is none. Transfers whose timeout is handled by the
+ * OS are dropped from the heap along the way. */
+static struct usbi_transfer *timeout_heap_first(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *itransfer = ctx->timeout_heap[0];
+
+		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return itransfer;
+		timeout_heap_remove(ctx, itransfer);
+	}
+
+	return NULL;
+}
+
+#ifdef HAVE_OS_TIMER
+/* arm the timer for the given absolute expiration, unless it is already
+ * armed for exactly that time.
+ * must be called with flying_list locked. */
+static int arm_timer(struct libusb_context *ctx, const struct timespec *timeout)
+{
+	int r;
+
+	if (TIMESPEC_CMP(&ctx->timer_expiry, timeout, ==)) {
+		usbi_stat_inc(ctx, LIBUSB_STAT_TIMER_REARMS_AVOIDED);
+		return 0;
+	}
+
+	r = usbi_arm_timer(&ctx->timer, timeout);
+	if (r == 0)
+		ctx->timer_expiry = *timeout;
+	else
+		TIMESPEC_CLEAR(&ctx->timer_expiry);
+
+	return r;
+}
+
+/* disarm the timer, unless it is not armed.
+ * must be called with flying_list locked. */
+static int disarm_timer(struct libusb_context *ctx)
+{
+	if (!TIMESPEC_IS_SET(&ctx->timer_expiry))
+		return 0;
+
+	TIMESPEC_CLEAR(&ctx->timer_expiry);
+	return usbi_disarm_timer(&ctx->timer);
+}
+
+/* rearms the timer based on the next upcoming timeout.
+ * must be called with flying_list locked.
+ * returns 0 on success or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timer_for_next_timeout(struct libusb_context *ctx)
+{
+	struct usbi_transfer *itransfer;
+
+	if (!usbi_using_timer(ctx))
+		return 0;
+
+	itransfer = timeout_heap_first(ctx);
+	if (itransfer) {
+		usbi_dbg(ctx, "next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
+		return arm_timer(ctx, &itransfer->timeout);
+	}
+
+	usbi_dbg(ctx, "no timeouts, disarming timer");
+	return disarm_timer(ctx);
+}
+#else
+static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+	return 0;
+}
+#endif
+
+/* add a transfer to the active transfers list and, if it has a finite
+ * timeout, to the timeout heap, without touching the timer.
+ * This function will return non 0 if the timeout heap cannot grow,
+ * in which case the transfer is *not* on the flying_transfers list.
+ * must be called with flying_list locked. */
+static int attach_flying_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int r;
+
+	calculate_timeout(itransfer);
+
+	list_add_tail(&itransfer->list, &transfer->dev_handle->flying_transfers);
+	ctx->num_flying_transfers++;
+
+	/* transfers with infinite timeout only go on the list */
+	if (!TIMESPEC_IS_SET(&itransfer->timeout))
+		return 0;
+
+	r = timeout_heap_push(ctx, itransfer);
+	if (r) {
+		list_del(&itransfer->list);
+		ctx->num_flying_transfers--;
+	}
+
+	return r;
+}
+
+/* add a transfer to the active transfers list and, if it has a finite
+ * timeout, to the timeout heap.
+ * This function will return non 0 if fails to update the timer,
+ * in which case the transfer is *not* on the flying_transfers list. */
+static int add_to_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct timespec *timeout = &itransfer->timeout;
+#ifdef HAVE_OS_TIMER
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+#endif
+	int r;
+
+	r = attach_flying_transfer(itransfer);
+	if (r || !TIMESPEC_IS_SET(timeout))
+		return r;
+
+	/* the event handler of a shard waits for the first timeout itself */
+	if (itransfer->timeout_heap_pos == 1 && transfer->dev_handle->shard)
+		usbi_signal_shard_event(transfer->dev_handle->shard);
+
+#ifdef HAVE_OS_TIMER
+	if (itransfer->timeout_heap_pos == 1 && usbi_using_timer(ctx)) {
+		/* if this transfer has the lowest timeout of all active transfers,
+		 * rearm the timer with this transfer's timeout */
+		usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
+		r = arm_timer(ctx, timeout);
+	}
+#endif
+
+	if (r)
+		usbi_detach_flying_transfer(itransfer);
+
+	return r;
+}
+
+/* remove a transfer from the active transfers list and the timeout heap,
+ * without touching the timer.
+ * must be called with flying_list locked. */
+void usbi_detach_flying_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+
+	if (itransfer->timeout_heap_pos)
+		timeout_heap_remove(ctx, itransfer);
+	list_del(&itransfer->list);
+	ctx->num_flying_transfers--;
+}
+
+/* remove a transfer from the active transfers list.
+ * This function will *always* remove the transfer from the
+ * flying_transfers list. It will return a LIBUSB_ERROR code
+ * if it fails to update the timer for the next timeout. */
+static int remove_from_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	int rearm_timer;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	rearm_timer = (itransfer->timeout_heap_pos == 1);
+	usbi_detach_flying_transfer(itransfer);
+	if (rearm_timer)
+		r = arm_timer_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
  * \returns 0 on success
  * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
  * \returns \ref LIBUSB_ERROR_BUSY if the transfer has already been submitted.
@@ -1540,36 +2738,189 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	 */
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 	usbi_mutex_lock(&itransfer->lock);
-	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
+	if (usbi_atomic_load(&itransfer->state_flags) & USBI_TRANSFER_IN_FLIGHT) {
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 		usbi_mutex_unlock(&itransfer->lock);
 		return LIBUSB_ERROR_BUSY;
 	}
-	itransfer->transferred = 0;
-	itransfer->state_flags = 0;
-	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return r;
+	itransfer->transferred = 0;
+	usbi_atomic_store(&itransfer->state_flags, 0);
+	itransfer->timeout_flags = 0;
+	r = add_to_flying_list(itransfer);
+	if (r) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return r;
+	}
+	/*
+	 * We must release the flying transfers lock here, because with
+	 * some backends the submit_transfer method is synchronous.
+	 */
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	r = usbi_backend.submit_transfer(itransfer);
+	if (r == LIBUSB_SUCCESS) {
+		usbi_atomic_or(&itransfer->state_flags, USBI_TRANSFER_IN_FLIGHT);
+	}
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (r != LIBUSB_SUCCESS)
+		remove_from_flying_list(itransfer);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit several transfers at once. This behaves like calling
+ * libusb_submit_transfer() on each of them in order, but takes the context
+ * locks once for the whole batch and updates the timeout timer at most once,
+ * which makes queueing many transfers at the start of a stream cheaper.
+ *
+ * The transfers may be for different devices, but all devices must belong
+ * to the same context.
+ *
+ * Submission stops at the first transfer that fails. The transfers before
+ * it are in flight, while it and the ones after it are left untouched and
+ * may be submitted again once the problem is resolved. The reason for the
+ * failure can be obtained by submitting the failed transfer on its own. A
+ * transfer that appears more than once in the array fails with
+ * \ref LIBUSB_ERROR_BUSY where it appears again.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfers array of transfers to submit
+ * \param count number of transfers in the array
+ * \returns the number of transfers submitted, which is less than count if
+ * a transfer failed to submit
+ * \returns a LIBUSB_ERROR code, as returned by libusb_submit_transfer(), if
+ * the first transfer failed to submit
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the arguments are invalid
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers, int count)
+{
+	struct libusb_context *ctx;
+	struct usbi_transfer *first_timeout;
+	int i, prepared, submitted;
+	int r = 0;
+
+	if (!transfers || count < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (!count)
+		return 0;
+
+	assert(transfers[0]->dev_handle);
+	ctx = HANDLE_CTX(transfers[0]->dev_handle);
+	usbi_dbg(ctx, "%d transfers", count);
+
+	/* the locks are taken in the same order as in libusb_submit_transfer(),
+	 * with the lock of every transfer in the batch held while the flying
+	 * transfers lock is. */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	first_timeout = timeout_heap_first(ctx);
+	for (prepared = 0; prepared < count; prepared++) {
+		struct libusb_transfer *transfer = transfers[prepared];
+		struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+		assert(transfer->dev_handle);
+		if (HANDLE_CTX(transfer->dev_handle) != ctx) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			break;
+		}
+
+		/* a transfer appearing twice in the batch has its lock held
+		 * already, taking it again would never return */
+		if (usbi_atomic_load(&itransfer->state_flags) & USBI_TRANSFER_BATCHED) {
+			r = LIBUSB_ERROR_BUSY;
+			break;
+		}
+
+		usbi_mutex_lock(&itransfer->lock);
+		if (usbi_atomic_load(&itransfer->state_flags) & USBI_TRANSFER_IN_FLIGHT) {
+			usbi_mutex_unlock(&itransfer->lock);
+			r = LIBUSB_ERROR_BUSY;
+			break;
+		}
+
+		if (itransfer->dev)
+			libusb_unref_device(itransfer->dev);
+		itransfer->dev = libusb_ref_device(transfer->dev_handle->dev);
+		itransfer->transferred = 0;
+		usbi_atomic_store(&itransfer->state_flags, 0);
+		itransfer->timeout_flags = 0;
+
+		r = attach_flying_transfer(itransfer);
+		if (r) {
+			usbi_mutex_unlock(&itransfer->lock);
+			break;
+		}
+		usbi_atomic_or(&itransfer->state_flags, USBI_TRANSFER_BATCHED);
+	}
+
+	/* a single timer update covers the whole batch */
+	if (prepared && timeout_heap_first(ctx) != first_timeout) {
+		struct libusb_device_handle *first_handle =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(timeout_heap_first(ctx))->dev_handle;
+		int rt = arm_timer_for_next_timeout(ctx);
+
+		if (first_handle->shard)
+			usbi_signal_shard_event(first_handle->shard);
+
+		if (rt) {
+			for (i = 0; i < prepared; i++) {
+				struct usbi_transfer *itransfer =
+					LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+				usbi_detach_flying_transfer(itransfer);
+				usbi_atomic_and(&itransfer->state_flags, ~(long)USBI_TRANSFER_BATCHED);
+				usbi_mutex_unlock(&itransfer->lock);
+			}
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
+			return rt;
+		}
 	}
-	/*
-	 * We must release the flying transfers lock here, because with
-	 * some backends the submit_transfer method is synchronous.
-	 */
 	usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
-	r = usbi_backend.submit_transfer(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
+	/* hand the transfers to the backend back to back. each transfer lock is
+	 * dropped as soon as the transfer is in flight so that its completion
+	 * can be handled while the rest of the batch is submitted. */
+	for (submitted = 0; submitted < prepared; submitted++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[submitted]);
+
+		r = usbi_backend.submit_transfer(itransfer);
+		if (r != LIBUSB_SUCCESS)
+			break;
+		usbi_atomic_and(&itransfer->state_flags, ~(long)USBI_TRANSFER_BATCHED);
+		usbi_atomic_or(&itransfer->state_flags, USBI_TRANSFER_IN_FLIGHT);
+		usbi_mutex_unlock(&itransfer->lock);
 	}
-	usbi_mutex_unlock(&itransfer->lock);
 
-	if (r != LIBUSB_SUCCESS)
-		remove_from_flying_list(itransfer);
+	if (submitted < prepared) {
+		int rearm_timer = 0;
 
-	return r;
+		for (i = submitted; i < prepared; i++) {
+			struct usbi_transfer *itransfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+			usbi_atomic_and(&itransfer->state_flags, ~(long)USBI_TRANSFER_BATCHED);
+			usbi_mutex_unlock(&itransfer->lock);
+		}
+
+		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		for (i = submitted; i < prepared; i++) {
+			struct usbi_transfer *itransfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+			if (itransfer->timeout_heap_pos == 1)
+				rearm_timer = 1;
+			usbi_detach_flying_transfer(itransfer);
+		}
+		if (rearm_timer)
+			arm_timer_for_next_timeout(ctx);
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	}
+
+	return submitted ? submitted : r;
 }
 
 /** \ingroup libusb_asyncio
@@ -1613,12 +2964,14 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 	struct usbi_transfer *itransfer =
 		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	long state_flags;
 	int r;
 
 	usbi_dbg(ctx, "transfer %p", (void *) transfer );
 	usbi_mutex_lock(&itransfer->lock);
-	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
-			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
+	state_flags = usbi_atomic_load(&itransfer->state_flags);
+	if (!(state_flags & USBI_TRANSFER_IN_FLIGHT)
+			|| (state_flags & USBI_TRANSFER_CANCELLING)) {
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
 	}
@@ -1631,51 +2984,493 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 			usbi_dbg(ctx, "cancel transfer failed error %d", r);
 
 		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
+			usbi_atomic_or(&itransfer->state_flags, USBI_TRANSFER_DEVICE_DISAPPEARED);
+	}
+
+	usbi_atomic_or(&itransfer->state_flags, USBI_TRANSFER_CANCELLING);
+
+out:
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+/* invoke the callback of a completed transfer and free it if requested */
+static void invoke_transfer_callback(struct libusb_transfer *transfer)
+{
+	uint8_t flags = transfer->flags;
+
+	usbi_dbg(TRANSFER_CTX(transfer), "transfer %p has callback %p",
+		 (void *) transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* The executor runs the transfer and hotplug callbacks on a pool of threads
+ * (LIBUSB_OPTION_CALLBACK_THREADS), so that event handling only has to reap
+ * the completions. Callbacks are queued on strands, see struct usbi_strand,
+ * to keep those of an endpoint in order. */
+
+/* make a strand runnable if it is not already. Call with the executor lock
+ * held */
+static void executor_schedule(struct usbi_executor *executor,
+	struct usbi_strand *strand)
+{
+	if (strand->scheduled)
+		return;
+
+	strand->scheduled = 1;
+	list_add_tail(&strand->run_list, &executor->runnable);
+	if (executor->idle_threads)
+		usbi_cond_signal(&executor->work_cond);
+}
+
+/* queue the callback of a completed transfer on the strand of its endpoint.
+ * Returns 0 if the transfer was queued, or an error if the callback has to
+ * be invoked right away */
+static int executor_queue_transfer(struct usbi_executor *executor,
+	struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct usbi_strand *strand;
+	int i;
+
+	/* the handle was closed while the transfer was in flight */
+	if (!dev_handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	usbi_mutex_lock(&executor->lock);
+	if (!dev_handle->strands) {
+		dev_handle->strands = calloc(USBI_ENDPOINT_STRANDS, sizeof(*strand));
+		if (!dev_handle->strands) {
+			usbi_mutex_unlock(&executor->lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		for (i = 0; i < USBI_ENDPOINT_STRANDS; i++) {
+			list_init(&dev_handle->strands[i].queue);
+			dev_handle->strands[i].dev_handle = dev_handle;
+		}
+	}
+
+	strand = &dev_handle->strands[(transfer->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) |
+		((transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK) >> 3)];
+	list_add_tail(&itransfer->list, &strand->queue);
+	dev_handle->queued_callbacks++;
+	executor_schedule(executor, strand);
+	usbi_mutex_unlock(&executor->lock);
+	return 0;
+}
+
+/* run the oldest callback of a strand. Called with the executor lock held,
+ * which is dropped while the callback runs */
+static void executor_run_strand(struct usbi_executor *executor,
+	struct usbi_strand *strand)
+{
+	struct libusb_context *ctx = executor->ctx;
+	struct libusb_device_handle *dev_handle = strand->dev_handle;
+	struct usbi_transfer *itransfer;
+	struct usbi_strand *previous = usbi_tls_key_get(executor->current_strand_key);
+	struct list_head hotplug_msgs;
+
+	strand->running = 1;
+	usbi_tls_key_set(executor->current_strand_key, strand);
+
+	if (strand == &executor->hotplug) {
+		/* the hotplug strand handles all of its messages at once */
+		list_cut(&hotplug_msgs, &strand->queue);
+		usbi_mutex_unlock(&executor->lock);
+		usbi_hotplug_process(ctx, &hotplug_msgs);
+		usbi_mutex_lock(&executor->lock);
+	} else {
+		itransfer = list_first_entry(&strand->queue, struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		usbi_mutex_unlock(&executor->lock);
+		invoke_transfer_callback(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+		usbi_mutex_lock(&executor->lock);
+
+		if (strand->orphaned) {
+			/* the callback closed the device handle */
+			usbi_tls_key_set(executor->current_strand_key, previous);
+			free(strand->orphaned);
+			return;
+		}
+
+		dev_handle->queued_callbacks--;
+		if (executor->flush_waiters)
+			usbi_cond_broadcast(&executor->idle_cond);
+	}
+
+	usbi_tls_key_set(executor->current_strand_key, previous);
+	strand->running = 0;
+	if (list_empty(&strand->queue))
+		strand->scheduled = 0;
+	else
+		list_add_tail(&strand->run_list, &executor->runnable);
+}
+
+static USBI_THREAD_RETURN_TYPE executor_thread_main(void *arg)
+{
+	struct usbi_executor *executor = arg;
+	struct usbi_strand *strand;
+
+	usbi_mutex_lock(&executor->lock);
+	for (;;) {
+		if (list_empty(&executor->runnable)) {
+			if (executor->stop)
+				break;
+			executor->idle_threads++;
+			usbi_cond_wait(&executor->work_cond, &executor->lock);
+			executor->idle_threads--;
+			continue;
+		}
+
+		strand = list_first_entry(&executor->runnable, struct usbi_strand, run_list);
+		list_del(&strand->run_list);
+		executor_run_strand(executor, strand);
+
+		if (list_empty(&executor->runnable)) {
+			/* let a thread waiting in libusb_handle_events_completed()
+			 * recheck its condition, now that the callbacks have run */
+			usbi_mutex_unlock(&executor->lock);
+			libusb_interrupt_event_handler(executor->ctx);
+			usbi_mutex_lock(&executor->lock);
+		}
+	}
+	usbi_mutex_unlock(&executor->lock);
+
+	return 0;
+}
+
+static USBI_THREAD_RETURN_TYPE event_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	int r;
+
+	for (;;) {
+		r = libusb_handle_events_completed(ctx, &ctx->event_thread_stop);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "event handling failed (%d), stopping event thread", r);
+			break;
+		}
+
+		usbi_mutex_lock(&ctx->event_waiters_lock);
+		r = ctx->event_thread_stop;
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		if (r)
+			break;
+	}
+
+	return 0;
+}
+
+/* start the internal event thread, if the context is configured to use one */
+int usbi_start_event_thread(struct libusb_context *ctx)
+{
+	int r;
+
+	if (!ctx->event_thread_enabled)
+		return 0;
+
+	ctx->event_thread_stop = 0;
+	if (ctx->event_thread_num_cpus || ctx->event_thread_priority)
+		r = usbi_thread_create_scheduled(&ctx->event_thread, event_thread_main,
+			ctx, ctx->event_thread_num_cpus ? &ctx->event_thread_cpus : NULL,
+			ctx->event_thread_priority);
+	else
+		r = usbi_thread_create(&ctx->event_thread, event_thread_main, ctx);
+	if (r) {
+		usbi_err(ctx, "failed to start event thread (%d)", r);
+		return r;
+	}
+	ctx->event_thread_running = 1;
+
+	usbi_dbg(ctx, "handling events on internal thread, %u cpus priority %d",
+		 ctx->event_thread_num_cpus, ctx->event_thread_priority);
+	return 0;
+}
+
+/* stop the internal event thread, once it is done with the events it is
+ * handling */
+void usbi_stop_event_thread(struct libusb_context *ctx)
+{
+	if (!ctx->event_thread_running)
+		return;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	ctx->event_thread_stop = 1;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	libusb_interrupt_event_handler(ctx);
+
+	usbi_thread_join(ctx->event_thread);
+	ctx->event_thread_running = 0;
+}
+
+/* move the internal event thread to the NUMA node of a device that was just
+ * opened, if it is the first one with a known node and the context is
+ * configured to do so (LIBUSB_NUMA_BIND_EVENT_THREAD) */
+void usbi_numa_bind_event_thread(struct libusb_device *dev)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	int r;
+
+	if (!(ctx->numa_binding & LIBUSB_NUMA_BIND_EVENT_THREAD) ||
+	    !ctx->event_thread_running || ctx->event_thread_num_cpus ||
+	    dev->numa_node < 0 || !usbi_backend.numa_bind_thread)
+		return;
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	if (ctx->event_thread_numa_node >= 0) {
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		return;
+	}
+	ctx->event_thread_numa_node = dev->numa_node;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+	r = usbi_backend.numa_bind_thread(ctx, ctx->event_thread, dev->numa_node);
+	if (r)
+		usbi_warn(ctx, "failed to move event thread to NUMA node %d (%d)",
+			  dev->numa_node, r);
+	else
+		usbi_dbg(ctx, "event thread moved to NUMA node %d", dev->numa_node);
+}
+
+/* start the executor threads, if the context is configured to use them */
+int usbi_start_executor(struct libusb_context *ctx)
+{
+	struct usbi_executor *executor;
+	unsigned int i;
+	int r;
+
+	if (!ctx->callback_threads)
+		return 0;
+
+	executor = calloc(1, sizeof(*executor)
+		+ ctx->callback_threads * sizeof(executor->threads[0]));
+	if (!executor)
+		return LIBUSB_ERROR_NO_MEM;
+
+	executor->ctx = ctx;
+	usbi_mutex_init(&executor->lock);
+	usbi_cond_init(&executor->work_cond);
+	usbi_cond_init(&executor->idle_cond);
+	list_init(&executor->runnable);
+	list_init(&executor->hotplug.queue);
+	usbi_tls_key_create(&executor->current_strand_key);
+	ctx->executor = executor;
+
+	for (i = 0; i < ctx->callback_threads; i++) {
+		r = usbi_thread_create(&executor->threads[i], executor_thread_main, executor);
+		if (r) {
+			usbi_err(ctx, "failed to start callback thread %u", i);
+			usbi_stop_executor(ctx);
+			return r;
+		}
+		executor->num_threads++;
+	}
+
+	usbi_dbg(ctx, "running callbacks on %u threads", executor->num_threads);
+	return 0;
+}
+
+/* run the callbacks still queued and stop the executor threads */
+void usbi_stop_executor(struct libusb_context *ctx)
+{
+	struct usbi_executor *executor = ctx->executor;
+	unsigned int i;
+
+	if (!executor)
+		return;
+
+	usbi_mutex_lock(&executor->lock);
+	executor->stop = 1;
+	usbi_cond_broadcast(&executor->work_cond);
+	usbi_mutex_unlock(&executor->lock);
+
+	for (i = 0; i < executor->num_threads; i++)
+		usbi_thread_join(executor->threads[i]);
+
+	ctx->executor = NULL;
+	usbi_tls_key_delete(executor->current_strand_key);
+	usbi_cond_destroy(&executor->idle_cond);
+	usbi_cond_destroy(&executor->work_cond);
+	usbi_mutex_destroy(&executor->lock);
+	free(executor);
+}
+
+/* take a strand of a device handle off the runnable list, if any. Call with
+ * the executor lock held */
+static struct usbi_strand *executor_take_strand(
+	struct libusb_device_handle *dev_handle)
+{
+	struct usbi_strand *strand;
+	int i;
+
+	for (i = 0; i < USBI_ENDPOINT_STRANDS; i++) {
+		strand = &dev_handle->strands[i];
+		if (strand->scheduled && !strand->running) {
+			list_del(&strand->run_list);
+			return strand;
+		}
+	}
+
+	return NULL;
+}
+
+/* wait for the callbacks queued for a device handle to have run, except the
+ * one the calling thread may be running, and release its strands. Called
+ * when the handle is closed */
+void usbi_executor_flush_handle(struct libusb_device_handle *dev_handle)
+{
+	struct usbi_executor *executor = HANDLE_CTX(dev_handle)->executor;
+	struct usbi_strand *current, *running, *strand;
+
+	if (!executor)
+		return;
+
+	current = usbi_tls_key_get(executor->current_strand_key);
+	running = current && current->dev_handle == dev_handle ? current : NULL;
+
+	usbi_mutex_lock(&executor->lock);
+	executor->flush_waiters++;
+	while (dev_handle->queued_callbacks > (running ? 1U : 0U)) {
+		/* the callbacks queued behind the one closing its handle */
+		if (running && !list_empty(&running->queue)) {
+			struct usbi_transfer *itransfer = list_first_entry(&running->queue,
+				struct usbi_transfer, list);
+
+			list_del(&itransfer->list);
+			usbi_mutex_unlock(&executor->lock);
+			invoke_transfer_callback(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+			usbi_mutex_lock(&executor->lock);
+			dev_handle->queued_callbacks--;
+			continue;
+		}
+
+		/* a callback closing a handle must not wait for the thread
+		 * running it, run the callbacks of the handle here instead */
+		if (current) {
+			strand = executor_take_strand(dev_handle);
+			if (strand) {
+				executor_run_strand(executor, strand);
+				continue;
+			}
+		}
+		usbi_cond_wait(&executor->idle_cond, &executor->lock);
+	}
+	executor->flush_waiters--;
+
+	/* the strand of a callback closing its own handle is freed by the
+	 * executor thread once the callback returns. The strands allocated
+	 * again by callbacks queued since an earlier flush don't hold it */
+	if (running && !running->orphaned)
+		running->orphaned = dev_handle->strands;
+	else
+		free(dev_handle->strands);
+	dev_handle->strands = NULL;
+	usbi_mutex_unlock(&executor->lock);
+}
+
+/* queue hotplug messages, if any, on the hotplug strand of the executor and
+ * schedule it to process them and the deregistered callbacks */
+static void executor_queue_hotplug(struct usbi_executor *executor,
+	struct list_head *hotplug_msgs)
+{
+	usbi_mutex_lock(&executor->lock);
+	if (!list_empty(hotplug_msgs)) {
+		list_splice_tail(hotplug_msgs, &executor->hotplug.queue);
+		list_init(hotplug_msgs);
+	}
+	executor_schedule(executor, &executor->hotplug);
+	usbi_mutex_unlock(&executor->lock);
+}
+
+/* report the completion of a transfer that is off the in-flight list */
+static void complete_transfer(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct libusb_cq *cq;
+
+	/* the backend is done with the transfer. A concurrent cancellation
+	 * holding the transfer lock finds nothing left to cancel, and the
+	 * transfer can't be resubmitted before the flag is cleared */
+	usbi_atomic_and(&itransfer->state_flags, ~(long)USBI_TRANSFER_IN_FLIGHT);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg(ctx, "interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
 	}
 
-	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
-
-out:
-	usbi_mutex_unlock(&itransfer->lock);
-	return r;
-}
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
 
-/** \ingroup libusb_asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
- */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
-{
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	/* the synchronous API waits for its transfers while handling events */
+	if (transfer->callback == usbi_sync_transfer_cb) {
+		invoke_transfer_callback(transfer);
+		return;
+	}
 
-	itransfer->stream_id = stream_id;
-}
+	cq = transfer_cq(transfer);
+	if (cq) {
+		usbi_dbg(ctx, "transfer %p queued to %p", (void *) transfer, (void *) cq);
+		cq_push(cq, transfer);
+		return;
+	}
 
-/** \ingroup libusb_asyncio
- * Get a transfers bulk stream id.
- *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
- *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
- */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
-{
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	if (ctx->executor && executor_queue_transfer(ctx->executor, itransfer) == 0)
+		return;
 
-	return itransfer->stream_id;
+	invoke_transfer_callback(transfer);
 }
 
 /* Handle completion of a transfer (completion might be an error condition).
@@ -1689,42 +3484,79 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	uint8_t flags;
 	int r;
 
 	r = remove_from_flying_list(itransfer);
 	if (r < 0)
-		usbi_err(ctx, "failed to set timer for next timeout");
+		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout");
 
-	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	usbi_mutex_unlock(&itransfer->lock);
+	complete_transfer(itransfer, status);
+	return r;
+}
 
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg(ctx, "interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
+/* Handle the completion of several transfers, linked through their
+ * completed_list, at once. The status of each transfer must already be set
+ * to its outcome, LIBUSB_TRANSFER_CANCELLED standing for a cancellation as
+ * reported by usbi_handle_transfer_cancellation(). The transfers are taken
+ * off the in-flight list with a single acquisition of the flying transfers
+ * lock and a single timer update, which the backends reaping completions in
+ * batches use to keep the lock traffic per completion down.
+ * Must be called while handling events, the completed list is empty on
+ * return. */
+int usbi_handle_transfer_completions(struct libusb_context *ctx,
+	struct list_head *completed)
+{
+	struct list_head **completing_slot, *completing;
+	struct usbi_transfer *itransfer;
+	int rearm_timer = 0;
+	int r = 0;
+
+	if (list_empty(completed))
+		return 0;
+
+	/* the transfers all belong to device handles served by the calling
+	 * event handler */
+	itransfer = list_first_entry(completed, struct usbi_transfer, completed_list);
+	completing_slot = usbi_completing_transfers(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle);
+	completing = *completing_slot;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	__for_each_completed_transfer(completed, itransfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		if (itransfer->timeout_heap_pos == 1)
+			rearm_timer = 1;
+		usbi_detach_flying_transfer(itransfer);
+
+		/* if the URB was cancelled due to timeout, report timeout to the user */
+		if (transfer->status == LIBUSB_TRANSFER_CANCELLED &&
+		    (itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT)) {
+			usbi_dbg(ctx, "detected timeout cancellation");
+			transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
 		}
 	}
+	if (rearm_timer)
+		r = arm_timer_for_next_timeout(ctx);
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (r < 0)
+		usbi_err(ctx, "failed to set timer for next timeout");
+
+	/* do_close() looks here for the transfers of the device handles the
+	 * callbacks close */
+	*completing_slot = completed;
+	while (!list_empty(completed)) {
+		itransfer = list_first_entry(completed, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+
+		/* a callback closed the device handle */
+		if (!USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle)
+			continue;
+
+		complete_transfer(itransfer, USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->status);
+	}
+	*completing_slot = completing;
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	usbi_dbg(ctx, "transfer %p has callback %p",
-		 (void *) transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
 	return r;
 }
 
@@ -1774,6 +3606,91 @@ void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 	}
 }
 
+/* A thread waiting in libusb_handle_events_timeout_completed() for its
+ * completion flag while another thread is handling events. Lives on the
+ * stack of the waiting thread */
+struct usbi_event_follower {
+	struct list_head list;
+	int *completed;
+	usbi_cond_t cond;
+	int woken;
+};
+
+/* Wake up the followers whose completion flag has been set, and the one that
+ * waited the longest otherwise, to take over event handling. The others keep
+ * sleeping until the next release of the events lock, which the promoted
+ * follower takes before returning. Call with the event waiters lock held */
+static void wake_event_followers(struct list_head *followers)
+{
+	struct usbi_event_follower *follower, *tmp;
+	int promoted = 0;
+
+	list_for_each_entry_safe(follower, tmp, followers, list, struct usbi_event_follower) {
+		if (!*follower->completed) {
+			if (promoted)
+				continue;
+			promoted = 1;
+		}
+
+		list_del(&follower->list);
+		follower->woken = 1;
+		usbi_cond_signal(&follower->cond);
+	}
+}
+
+/* Wait, with the event waiters lock held, until woken up by
+ * wake_event_followers(). Same return values as libusb_wait_for_event(), or 2
+ * if woken up to take over event handling, with tv updated to the time left.
+ * The caller must then retry taking the events lock rather than return, as no
+ * other follower is woken up until it is released */
+static int wait_as_event_follower(struct libusb_context *ctx,
+	struct list_head *followers, int *completed, struct timeval *tv)
+{
+	struct usbi_event_follower follower;
+	struct timespec deadline, now, left;
+	int r = 0;
+
+	usbi_get_monotonic_time(&deadline);
+	deadline.tv_sec += tv->tv_sec;
+	deadline.tv_nsec += tv->tv_usec * 1000L;
+	if (deadline.tv_nsec >= NSEC_PER_SEC) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= NSEC_PER_SEC;
+	}
+
+	follower.completed = completed;
+	follower.woken = 0;
+	usbi_cond_init(&follower.cond);
+	list_add_tail(&follower.list, followers);
+
+	while (!follower.woken) {
+		r = usbi_cond_timedwait(&follower.cond, &ctx->event_waiters_lock, tv);
+		if (r < 0)
+			break;
+	}
+
+	if (!follower.woken)
+		list_del(&follower.list);
+	usbi_cond_destroy(&follower.cond);
+
+	if (r < 0)
+		return r == LIBUSB_ERROR_TIMEOUT;
+
+	if (!*completed) {
+		usbi_get_monotonic_time(&now);
+		if (TIMESPEC_CMP(&now, &deadline, <)) {
+			TIMESPEC_SUB(&deadline, &now, &left);
+			TIMESPEC_TO_TIMEVAL(tv, &left);
+		} else {
+			tv->tv_sec = 0;
+			tv->tv_usec = 0;
+		}
+		return 2;
+	}
+
+	return 0;
+}
+
 /** \ingroup libusb_poll
  * Attempt to acquire the event handling lock. This lock is used to ensure that
  * only one thread is monitoring libusb event sources at any one time.
@@ -1796,20 +3713,9 @@ void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 {
 	int r;
-	unsigned int ru;
 
 	ctx = usbi_get_context(ctx);
 
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	ru = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (ru) {
-		usbi_dbg(ctx, "someone else is closing a device");
-		return 1;
-	}
-
 	r = usbi_mutex_trylock(&ctx->events_lock);
 	if (!r)
 		return 1;
@@ -1857,14 +3763,46 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
 	ctx->event_handler_active = 0;
 	usbi_mutex_unlock(&ctx->events_lock);
 
-	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->device_close)? */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
+	wake_event_followers(&ctx->event_followers);
+	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+/* Same as libusb_try_lock_events() for the events lock of a shard */
+int usbi_try_lock_shard_events(struct usbi_event_shard *shard)
+{
+	if (!usbi_mutex_trylock(&shard->events_lock))
+		return 1;
+
+	shard->event_handler_active = 1;
+	return 0;
+}
+
+/* Same as libusb_unlock_events() for the events lock of a shard. The threads
+ * waiting with libusb_wait_for_event() are woken up as well, as they may be
+ * waiting for a device handle of the shard to be closed */
+void usbi_unlock_shard_events(struct usbi_event_shard *shard)
+{
+	struct libusb_context *ctx = shard->ctx;
+
+	shard->event_handler_active = 0;
+	usbi_mutex_unlock(&shard->events_lock);
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	wake_event_followers(&shard->event_followers);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
+/* Wake up the thread handling the events of a shard, unless it has already
+ * been woken up and has not got round to it yet */
+void usbi_signal_shard_event(struct usbi_event_shard *shard)
+{
+	if (usbi_atomic_cas(&shard->event_pending, 0, 1))
+		usbi_signal_event(&shard->event);
+}
+
 /** \ingroup libusb_poll
  * Determine if it is still OK for this thread to be doing event handling.
  *
@@ -1888,20 +3826,10 @@ void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
  */
 int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
 {
-	unsigned int r;
-
-	ctx = usbi_get_context(ctx);
-
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * continue event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (r) {
-		usbi_dbg(ctx, "someone else is closing a device");
-		return 0;
-	}
+	UNUSED(ctx);
 
+	/* closing a device no longer requires event handlers to give up the
+	 * events lock, libusb_close() hands the device over to them instead */
 	return 1;
 }
 
@@ -1917,20 +3845,8 @@ int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
  */
 int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 {
-	unsigned int r;
-
 	ctx = usbi_get_context(ctx);
 
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling -- indicate that event handling is happening */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (r) {
-		usbi_dbg(ctx, "someone else is closing a device");
-		return 1;
-	}
-
 	return ctx->event_handler_active;
 }
 
@@ -1946,7 +3862,7 @@ int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
  */
 void API_EXPORTED libusb_interrupt_event_handler(libusb_context *ctx)
 {
-	unsigned int event_flags;
+	unsigned int event_flags, i;
 
 	usbi_dbg(ctx, " ");
 
@@ -1959,6 +3875,10 @@ void API_EXPORTED libusb_interrupt_event_handler(libusb_context *ctx)
 		usbi_signal_event(&ctx->event);
 
 	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	/* libusb_handle_events_shard() returns whenever it is woken up */
+	for (i = 0; i < ctx->num_event_shards; i++)
+		usbi_signal_shard_event(&ctx->event_shards[i]);
 }
 
 /** \ingroup libusb_poll
@@ -2064,30 +3984,21 @@ static void handle_timeouts_locked(struct libusb_context *ctx)
 	struct timespec systime;
 	struct usbi_transfer *itransfer;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!ctx->timeout_heap_len)
 		return;
 
 	/* get current time */
 	usbi_get_monotonic_time(&systime);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
-
-		/* ignore timeouts we've already handled */
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
+	/* pop transfers off the timeout heap for as long as their timeouts
+	 * have expired */
+	while ((itransfer = timeout_heap_first(ctx)) != NULL) {
 		/* if transfer has non-expired timeout, nothing more to do */
-		if (TIMESPEC_CMP(cur_ts, &systime, >))
+		if (TIMESPEC_CMP(&itransfer->timeout, &systime, >))
 			return;
 
 		/* otherwise, we've got an expired timeout to handle */
+		timeout_heap_remove(ctx, itransfer);
 		handle_timeout(itransfer);
 	}
 }
@@ -2175,8 +4086,12 @@ static int handle_event_trigger(struct libusb_context *ctx)
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 	/* process the hotplug events, if any */
-	if (hotplug_event)
-		usbi_hotplug_process(ctx, &hotplug_msgs);
+	if (hotplug_event) {
+		if (ctx->executor)
+			executor_queue_hotplug(ctx->executor, &hotplug_msgs);
+		else
+			usbi_hotplug_process(ctx, &hotplug_msgs);
+	}
 
 	return r;
 }
@@ -2188,6 +4103,9 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 
 	usbi_mutex_lock(&ctx->flying_transfers_lock);
 
+	/* the timer is a one-shot, it is no longer armed for anything */
+	TIMESPEC_CLEAR(&ctx->timer_expiry);
+
 	/* process the timeout that just happened */
 	handle_timeouts_locked(ctx);
 
@@ -2200,24 +4118,64 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 }
 #endif
 
-/* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+/* check the backend for completions over and over for up to busy_poll_us
+ * (but no longer than timeout_ms) while transfers are in flight. returns 1
+ * if anything was handled, 0 if the caller should wait for events. */
+static int busy_poll(struct libusb_context *ctx, int timeout_ms)
 {
-	struct usbi_reported_events reported_events;
-	int r, timeout_ms;
+	struct timespec now, deadline;
+	long spin_us = (long)ctx->busy_poll_us;
+	int r;
 
-	/* prevent attempts to recursively handle events (e.g. calling into
-	 * libusb_handle_events() from within a hotplug or transfer callback) */
-	if (usbi_handling_events(ctx))
-		return LIBUSB_ERROR_BUSY;
+	if ((long)timeout_ms * 1000 < spin_us)
+		spin_us = (long)timeout_ms * 1000;
+	if (!spin_us)
+		return 0;
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	r = !ctx->num_flying_transfers;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	if (r)
+		return 0;
+
+	usbi_get_monotonic_time(&deadline);
+	deadline.tv_sec += spin_us / 1000000L;
+	deadline.tv_nsec += (spin_us % 1000000L) * 1000L;
+	if (deadline.tv_nsec >= NSEC_PER_SEC) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= NSEC_PER_SEC;
+	}
+
+	do {
+		r = usbi_backend.busy_poll(ctx);
+		if (r)
+			return r;
+
+		/* don't hold up internal events, the wait returns right away */
+		usbi_mutex_lock(&ctx->event_data_lock);
+		r = ctx->event_flags != 0;
+		usbi_mutex_unlock(&ctx->event_data_lock);
+		if (r)
+			return 0;
+
+		usbi_get_monotonic_time(&now);
+	} while (TIMESPEC_CMP(&now, &deadline, <));
+
+	return 0;
+}
+
+/* only reallocate the event source data when the list of event sources has
+ * been modified since the last handle_events(), otherwise reuse them to save
+ * the additional overhead. Returns whether device handles are waiting to be
+ * closed, or a LIBUSB_ERROR code. Call with the event handling lock held. */
+static int update_event_data(struct libusb_context *ctx)
+{
+	int r, close_pending;
 
-	/* only reallocate the event source data when the list of event sources has
-	 * been modified since the last handle_events(), otherwise reuse them to
-	 * save the additional overhead */
 	usbi_mutex_lock(&ctx->event_data_lock);
+	close_pending = !list_empty(&ctx->closing_handles);
 	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
-		usbi_dbg(ctx, "event sources modified, reallocating event data");
+		usbi_dbg(ctx, "event sources modified, updating event data");
 
 		/* free anything removed since we last ran */
 		cleanup_removed_event_sources(ctx);
@@ -2238,6 +4196,25 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
+	return close_pending;
+}
+
+/* do the actual event handling. assumes that no other thread is concurrently
+ * doing the same thing. */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	struct usbi_reported_events reported_events;
+	int r, timeout_ms, close_pending;
+
+	/* prevent attempts to recursively handle events (e.g. calling into
+	 * libusb_handle_events() from within a hotplug or transfer callback) */
+	if (usbi_handling_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	close_pending = update_event_data(ctx);
+	if (close_pending < 0)
+		return close_pending;
+
 	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
 	/* round up to next millisecond */
@@ -2248,6 +4225,20 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 	usbi_start_event_handling(ctx);
 
+	if (ctx->busy_poll_us) {
+		r = busy_poll(ctx, timeout_ms);
+		if (r) {
+			/* the wait is skipped, handle the timeouts that expired
+			 * while completions kept coming in here instead */
+			usbi_mutex_lock(&ctx->flying_transfers_lock);
+			handle_timeouts_locked(ctx);
+			if (r > 0)
+				r = arm_timer_for_next_timeout(ctx);
+			usbi_mutex_unlock(&ctx->flying_transfers_lock);
+			goto done;
+		}
+	}
+
 	r = usbi_wait_for_events(ctx, &reported_events, timeout_ms);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_TIMEOUT) {
@@ -2273,7 +4264,75 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 			goto done;
 		}
 	}
-#endif
+#endif
+
+	if (!reported_events.num_ready)
+		goto done;
+
+	r = usbi_backend.handle_events(ctx, reported_events.event_data,
+		reported_events.event_data_count, reported_events.num_ready);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
+
+done:
+	/* close the devices handed over by libusb_close() now that the event
+	 * sources reported by this wait are no longer in use */
+	if (close_pending || reported_events.event_triggered)
+		usbi_handle_pending_closes(ctx, NULL);
+
+	usbi_end_event_handling(ctx);
+	return r;
+}
+
+/* do the event handling of a shard, like handle_events(). The event sources
+ * of the shard are always waited on with poll(), and the expired timeouts are
+ * handled once the wait times out rather than through the timer. */
+static int handle_shard_events(struct usbi_event_shard *shard, struct timeval *tv)
+{
+	struct libusb_context *ctx = shard->ctx;
+	struct usbi_reported_events reported_events;
+	int r, timeout_ms, close_pending;
+
+	if (usbi_handling_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	close_pending = !list_empty(&shard->closing_handles);
+	if (shard->event_sources_modified) {
+		r = usbi_alloc_shard_event_data(shard);
+		if (r) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			return r;
+		}
+		shard->event_sources_modified = 0;
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (tv->tv_usec % 1000)
+		timeout_ms++;
+
+	reported_events.event_bits = 0;
+
+	usbi_start_shard_event_handling(shard);
+
+	r = usbi_wait_for_shard_events(shard, &reported_events, timeout_ms);
+	if (r != LIBUSB_SUCCESS) {
+		if (r == LIBUSB_ERROR_TIMEOUT) {
+			handle_timeouts(ctx);
+			r = LIBUSB_SUCCESS;
+		}
+		goto done;
+	}
+
+	/* whatever the event was signalled for is looked at below or on the
+	 * next call, clear it before that so that no signal is missed */
+	if (reported_events.event_triggered) {
+		usbi_clear_event(&shard->event);
+		usbi_atomic_store(&shard->event_pending, 0);
+	}
 
 	if (!reported_events.num_ready)
 		goto done;
@@ -2284,21 +4343,70 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 done:
+	if (close_pending || reported_events.event_triggered)
+		usbi_handle_pending_closes(ctx, shard);
+
 	usbi_end_event_handling(ctx);
 	return r;
 }
 
+/* libusb_get_next_timeout() regardless of the timer of the context */
+static int get_next_transfer_timeout(struct libusb_context *ctx,
+	struct timeval *tv)
+{
+	struct usbi_transfer *itransfer;
+	struct timespec systime;
+	struct timespec next_timeout = { 0, 0 };
+
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	if (!ctx->num_flying_transfers) {
+		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_dbg(ctx, "no URBs, no timeout!");
+		return 0;
+	}
+
+	/* find next transfer which hasn't already been processed as timed out */
+	itransfer = timeout_heap_first(ctx);
+	if (itransfer)
+		next_timeout = itransfer->timeout;
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	if (!TIMESPEC_IS_SET(&next_timeout)) {
+		usbi_dbg(ctx, "no URB with timeout or all handled by OS; no timeout!");
+		return 0;
+	}
+
+	usbi_get_monotonic_time(&systime);
+
+	if (!TIMESPEC_CMP(&systime, &next_timeout, <)) {
+		usbi_dbg(ctx, "first timeout already expired");
+		timerclear(tv);
+	} else {
+		TIMESPEC_SUB(&next_timeout, &systime, &next_timeout);
+		TIMESPEC_TO_TIMEVAL(tv, &next_timeout);
+		usbi_dbg(ctx, "next timeout in %ld.%06lds", (long)tv->tv_sec, (long)tv->tv_usec);
+	}
+
+	return 1;
+}
+
 /* returns the smallest of:
  *  1. timeout of next URB
  *  2. user-supplied timeout
  * returns 1 if there is an already-expired timeout, otherwise returns 0
- * and populates out
+ * and populates out. The event handler of a shard always waits for the next
+ * timeout itself, as it does not wait on the timer of the context.
  */
-static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
-	struct timeval *out)
+static int get_next_timeout(libusb_context *ctx, struct usbi_event_shard *shard,
+	struct timeval *tv, struct timeval *out)
 {
 	struct timeval timeout;
-	int r = libusb_get_next_timeout(ctx, &timeout);
+	int r;
+
+	if (shard)
+		r = get_next_transfer_timeout(ctx, &timeout);
+	else
+		r = libusb_get_next_timeout(ctx, &timeout);
 	if (r) {
 		/* timeout already expired? */
 		if (!timerisset(&timeout))
@@ -2353,7 +4461,7 @@ int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
 		return LIBUSB_ERROR_INVALID_PARAM;
 
 	ctx = usbi_get_context(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
+	r = get_next_timeout(ctx, NULL, tv, &poll_timeout);
 	if (r) {
 		/* timeout already expired */
 		handle_timeouts(ctx);
@@ -2387,7 +4495,10 @@ retry:
 	}
 
 	usbi_dbg(ctx, "another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+	if (completed)
+		r = wait_as_event_follower(ctx, &ctx->event_followers, completed, &poll_timeout);
+	else
+		r = libusb_wait_for_event(ctx, &poll_timeout);
 
 already_done:
 	libusb_unlock_event_waiters(ctx);
@@ -2396,6 +4507,8 @@ already_done:
 		return r;
 	else if (r == 1)
 		handle_timeouts(ctx);
+	else if (r == 2)
+		goto retry;
 	return 0;
 }
 
@@ -2495,7 +4608,7 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 		return LIBUSB_ERROR_INVALID_PARAM;
 
 	ctx = usbi_get_context(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
+	r = get_next_timeout(ctx, NULL, tv, &poll_timeout);
 	if (r) {
 		/* timeout already expired */
 		handle_timeouts(ctx);
@@ -2505,6 +4618,243 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 	return handle_events(ctx, &poll_timeout);
 }
 
+/** \ingroup libusb_poll
+ * Handle any pending events of an event shard, see
+ * \ref LIBUSB_OPTION_EVENT_SHARDS. Works like
+ * libusb_handle_events_timeout_completed() for the device handles of the
+ * shard only, so that each shard can be served by its own thread while the
+ * others, and the event handling of the context, go on independently.
+ *
+ * Calling this function from within a transfer callback, or from another
+ * thread handling events for the same context, is not allowed.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param shard index of the event shard
+ * \param tv the maximum time to block waiting for events, an all zero timeval
+ * struct for non-blocking mode, or NULL for 60 seconds
+ * \param completed pointer to completion integer to check, or NULL
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the context has no such event
+ * shard or timeval is invalid
+ * \returns another LIBUSB_ERROR code on other failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_handle_events_shard(libusb_context *ctx, int shard,
+	struct timeval *tv, int *completed)
+{
+	struct usbi_event_shard *ishard;
+	struct timeval timeout, poll_timeout;
+	int r;
+
+	ctx = usbi_get_context(ctx);
+	if (shard < 0 || shard >= (int)ctx->num_event_shards)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	ishard = &ctx->event_shards[shard];
+
+	if (tv) {
+		if (!TIMEVAL_IS_VALID(tv))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		timeout = *tv;
+	} else {
+		timeout.tv_sec = 60;
+		timeout.tv_usec = 0;
+	}
+
+	r = get_next_timeout(ctx, ishard, &timeout, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		handle_timeouts(ctx);
+		return 0;
+	}
+
+retry:
+	if (usbi_try_lock_shard_events(ishard) == 0) {
+		if (completed == NULL || !*completed)
+			r = handle_shard_events(ishard, &poll_timeout);
+		usbi_unlock_shard_events(ishard);
+		return r;
+	}
+
+	/* another thread is handling the events of the shard */
+	libusb_lock_event_waiters(ctx);
+
+	if (completed && *completed)
+		goto already_done;
+
+	if (!ishard->event_handler_active) {
+		libusb_unlock_event_waiters(ctx);
+		usbi_dbg(ctx, "shard event handler was active but went away, retrying");
+		goto retry;
+	}
+
+	if (completed)
+		r = wait_as_event_follower(ctx, &ishard->event_followers, completed, &poll_timeout);
+	else
+		r = libusb_wait_for_event(ctx, &poll_timeout);
+
+already_done:
+	libusb_unlock_event_waiters(ctx);
+
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		handle_timeouts(ctx);
+	else if (r == 2)
+		goto retry;
+	return 0;
+}
+
+/* make room in the arrays of libusb_handle_events_multi() kept by a context
+ * for size contexts. Call with the events lock of the context held */
+static int grow_multi_data(struct libusb_context *ctx, unsigned int size)
+{
+	void *p;
+
+	if (size <= ctx->multi_size)
+		return 0;
+
+	p = realloc(ctx->multi_locked, size * sizeof(*ctx->multi_locked));
+	if (!p)
+		return LIBUSB_ERROR_NO_MEM;
+	ctx->multi_locked = p;
+
+	p = realloc(ctx->multi_ready, size);
+	if (!p)
+		return LIBUSB_ERROR_NO_MEM;
+	ctx->multi_ready = p;
+
+	ctx->multi_size = size;
+	return 0;
+}
+
+/** \ingroup libusb_poll
+ * Handle any pending events of several contexts from a single thread. The
+ * event sources of all the contexts are waited on at once, with a single
+ * system call, and the events are then handled by each context that reported
+ * some, as libusb_handle_events_timeout() would. This lets a process hosting
+ * many mostly idle contexts serve them all from one thread.
+ *
+ * Contexts whose events are being handled by another thread at the time of
+ * the call are left to that thread. If that is the case for all of them,
+ * this function waits for an event of the first context like
+ * libusb_handle_events_timeout() does.
+ *
+ * Not supported on Windows.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctxs the contexts to operate on
+ * \param n number of contexts in ctxs
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if timeval or the contexts are invalid
+ * \returns \ref LIBUSB_ERROR_BUSY if called from event handling context
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED on Windows
+ * \returns another LIBUSB_ERROR code on other failure
+ * \ref libusb_mtasync
+ */
+int API_EXPORTED libusb_handle_events_multi(libusb_context **ctxs, int n,
+	struct timeval *tv)
+{
+	struct timeval zero_tv = { 0, 0 };
+	struct timeval poll_timeout, ctx_timeout;
+	struct libusb_context **locked = NULL;
+	unsigned char *ready = NULL;
+	int i, num_locked = 0, timeout_ms;
+	int r = 0;
+
+	if (!ctxs || n <= 0 || !tv || !TIMEVAL_IS_VALID(tv))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	for (i = 0; i < n; i++) {
+		if (!ctxs[i])
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (usbi_handling_events(ctxs[i]))
+			return LIBUSB_ERROR_BUSY;
+	}
+
+	/* the events locks are only tried, so that contexts being served by
+	 * other threads are skipped rather than waited for */
+	poll_timeout = *tv;
+	for (i = 0; i < n; i++) {
+		struct libusb_context *ctx = ctxs[i];
+		int close_pending;
+
+		if (libusb_try_lock_events(ctx))
+			continue;
+		if (!num_locked) {
+			r = grow_multi_data(ctx, (unsigned int)n);
+			if (r) {
+				libusb_unlock_events(ctx);
+				return r;
+			}
+			locked = ctx->multi_locked;
+			ready = ctx->multi_ready;
+		}
+		locked[num_locked++] = ctx;
+
+		close_pending = update_event_data(ctx);
+		if (close_pending < 0) {
+			r = close_pending;
+			goto out;
+		}
+		ready[num_locked - 1] = (unsigned char)close_pending;
+
+		/* pending work is dealt with without waiting */
+		if (close_pending || get_next_timeout(ctx, NULL, &poll_timeout, &ctx_timeout))
+			timerclear(&poll_timeout);
+		else
+			poll_timeout = ctx_timeout;
+	}
+
+	if (!num_locked) {
+		/* nothing to do but wait for the thread handling the events of the
+		 * first context */
+		libusb_lock_event_waiters(ctxs[0]);
+		if (libusb_event_handler_active(ctxs[0]))
+			r = libusb_wait_for_event(ctxs[0], &poll_timeout);
+		libusb_unlock_event_waiters(ctxs[0]);
+		return r < 0 ? r : 0;
+	}
+
+	timeout_ms = (int)(poll_timeout.tv_sec * 1000) + (poll_timeout.tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (poll_timeout.tv_usec % 1000)
+		timeout_ms++;
+
+	r = usbi_wait_for_multi_events(locked, (unsigned int)num_locked, ready, timeout_ms);
+	if (r == LIBUSB_ERROR_TIMEOUT)
+		r = 0;
+	else if (r < 0)
+		goto out;
+
+	/* the contexts that reported events collect them without waiting
+	 * again, the others only need their expired timeouts handled */
+	for (i = 0; i < num_locked; i++) {
+		struct libusb_context *ctx = locked[i];
+		int ctx_r;
+
+		if (ready[i])
+			ctx_r = handle_events(ctx, &zero_tv);
+		else
+			ctx_r = 0;
+		if (get_next_timeout(ctx, NULL, &zero_tv, &ctx_timeout))
+			handle_timeouts(ctx);
+		if (ctx_r < 0 && r == 0)
+			r = ctx_r;
+	}
+
+out:
+	/* locked belongs to locked[0], which is unlocked last */
+	for (i = num_locked - 1; i >= 0; i--)
+		libusb_unlock_events(locked[i]);
+	return r;
+}
+
 /** \ingroup libusb_poll
  * Determines whether your application must apply special timing considerations
  * when monitoring libusb's file descriptors.
@@ -2570,52 +4920,11 @@ int API_EXPORTED libusb_pollfds_handle_timeouts(libusb_context *ctx)
 int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *itransfer;
-	struct timespec systime;
-	struct timespec next_timeout = { 0, 0 };
-
 	ctx = usbi_get_context(ctx);
 	if (usbi_using_timer(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg(ctx, "no URBs, no timeout!");
-		return 0;
-	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	for_each_transfer(ctx, itransfer) {
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if we've reached transfers of infinite timeout, we're done looking */
-		if (!TIMESPEC_IS_SET(&itransfer->timeout))
-			break;
-
-		next_timeout = itransfer->timeout;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
-
-	if (!TIMESPEC_IS_SET(&next_timeout)) {
-		usbi_dbg(ctx, "no URB with timeout or all handled by OS; no timeout!");
-		return 0;
-	}
-
-	usbi_get_monotonic_time(&systime);
-
-	if (!TIMESPEC_CMP(&systime, &next_timeout, <)) {
-		usbi_dbg(ctx, "first timeout already expired");
-		timerclear(tv);
-	} else {
-		TIMESPEC_SUB(&next_timeout, &systime, &next_timeout);
-		TIMESPEC_TO_TIMEVAL(tv, &next_timeout);
-		usbi_dbg(ctx, "next timeout in %ld.%06lds", (long)tv->tv_sec, (long)tv->tv_usec);
-	}
-
-	return 1;
+	return get_next_transfer_timeout(ctx, tv);
 }
 
 /** \ingroup libusb_poll
@@ -2675,10 +4984,12 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 
 /* Add an event source to the list of event sources to be monitored.
  * poll_events should be specified as a bitmask of events passed to poll(), e.g.
- * POLLIN and/or POLLOUT. */
-int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle, short poll_events)
+ * POLLIN and/or POLLOUT. user_data is handed back to the backend's
+ * handle_events() when the event source reports events. */
+int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle, short poll_events,
+	void *user_data)
 {
-	struct usbi_event_source *ievent_source = malloc(sizeof(*ievent_source));
+	struct usbi_event_source *ievent_source = alloc_event_source(ctx);
 
 	if (!ievent_source)
 		return LIBUSB_ERROR_NO_MEM;
@@ -2686,7 +4997,21 @@ int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle
 	usbi_dbg(ctx, "add " USBI_OS_HANDLE_FORMAT_STRING " events %d", os_handle, poll_events);
 	ievent_source->data.os_handle = os_handle;
 	ievent_source->data.poll_events = poll_events;
+	ievent_source->user_data = user_data;
+	ievent_source->removed = 0;
+	ievent_source->engine_busy = 0;
 	usbi_mutex_lock(&ctx->event_data_lock);
+#ifdef HAVE_OS_EVENT_ENGINE
+	if (usbi_using_event_engine(ctx)) {
+		int r = usbi_event_engine_add_event_source(ctx, ievent_source);
+
+		if (r < 0) {
+			free_event_source(ctx, ievent_source);
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			return r;
+		}
+	}
+#endif
 	list_add_tail(&ievent_source->list, &ctx->event_sources);
 	usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
@@ -2720,6 +5045,11 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 		return;
 	}
 
+	ievent_source->removed = 1;
+#ifdef HAVE_OS_EVENT_ENGINE
+	if (usbi_using_event_engine(ctx))
+		usbi_event_engine_remove_event_source(ctx, ievent_source);
+#endif
 	list_del(&ievent_source->list);
 	list_add_tail(&ievent_source->list, &ctx->removed_event_sources);
 	usbi_event_source_notification(ctx);
@@ -2731,6 +5061,74 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 #endif
 }
 
+/* Add an event source of a device handle, monitored by the event shard of the
+ * handle if it has one and by the context otherwise. */
+int usbi_add_handle_event_source(struct libusb_device_handle *dev_handle,
+	usbi_os_handle_t os_handle, short poll_events, void *user_data)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_event_shard *shard = dev_handle->shard;
+	struct usbi_event_source *ievent_source;
+
+	if (!shard)
+		return usbi_add_event_source(ctx, os_handle, poll_events, user_data);
+
+	ievent_source = alloc_event_source(ctx);
+	if (!ievent_source)
+		return LIBUSB_ERROR_NO_MEM;
+
+	usbi_dbg(ctx, "add " USBI_OS_HANDLE_FORMAT_STRING " events %d to shard %d", os_handle, poll_events,
+		 (int)(shard - ctx->event_shards));
+	ievent_source->data.os_handle = os_handle;
+	ievent_source->data.poll_events = poll_events;
+	ievent_source->user_data = user_data;
+	ievent_source->removed = 0;
+	ievent_source->engine_busy = 0;
+	usbi_mutex_lock(&ctx->event_data_lock);
+	list_add_tail(&ievent_source->list, &shard->event_sources);
+	shard->event_sources_modified = 1;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_signal_shard_event(shard);
+
+	return 0;
+}
+
+/* Remove an event source added with usbi_add_handle_event_source(). The event
+ * sources of a shard are only removed by its event handler, which is not
+ * waiting on them, so they are freed right away. */
+void usbi_remove_handle_event_source(struct libusb_device_handle *dev_handle,
+	usbi_os_handle_t os_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_event_shard *shard = dev_handle->shard;
+	struct usbi_event_source *ievent_source;
+	int found = 0;
+
+	if (!shard) {
+		usbi_remove_event_source(ctx, os_handle);
+		return;
+	}
+
+	usbi_dbg(ctx, "remove " USBI_OS_HANDLE_FORMAT_STRING " from shard %d", os_handle,
+		 (int)(shard - ctx->event_shards));
+	usbi_mutex_lock(&ctx->event_data_lock);
+	list_for_each_entry(ievent_source, &shard->event_sources, list, struct usbi_event_source) {
+		if (ievent_source->data.os_handle == os_handle) {
+			found = 1;
+			break;
+		}
+	}
+	if (found) {
+		list_del(&ievent_source->list);
+		shard->event_sources_modified = 1;
+		free_event_source(ctx, ievent_source);
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	if (!found)
+		usbi_dbg(ctx, "couldn't find " USBI_OS_HANDLE_FORMAT_STRING " to remove", os_handle);
+}
+
 /** \ingroup libusb_poll
  * Retrieve a list of file descriptors that should be polled by your main loop
  * as libusb event sources.
@@ -2784,6 +5182,39 @@ out:
 #endif
 }
 
+/** \ingroup libusb_poll
+ * Retrieve a single file descriptor that becomes readable whenever any of
+ * libusb's event sources has activity. It can be monitored by your main loop
+ * in place of the set returned by libusb_get_pollfds(), and does not change
+ * when devices are opened or closed.
+ *
+ * This is only available when the context was created with the
+ * \ref LIBUSB_EVENT_ENGINE_EPOLL or \ref LIBUSB_EVENT_ENGINE_IO_URING event
+ * engine, see \ref LIBUSB_OPTION_EVENT_ENGINE. The file descriptor is owned by
+ * libusb and must not be closed by the application.
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the file descriptor on success
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the context does not use an
+ * event engine with a single file descriptor
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+	ctx = usbi_get_context(ctx);
+#ifdef HAVE_EPOLL
+	if (usbi_using_epoll(ctx))
+		return ctx->epoll_fd;
+#endif
+#ifdef HAVE_IO_URING
+	if (usbi_using_io_uring(ctx))
+		return usbi_io_uring_fd(ctx);
+#endif
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 /** \ingroup libusb_poll
  * Free a list of libusb_pollfd structures. This should be called for all
  * pollfd lists allocated with libusb_get_pollfds().
@@ -2833,16 +5264,14 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 	while (1) {
 		to_cancel = NULL;
 		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		for_each_transfer(ctx, cur) {
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == dev_handle) {
-				usbi_mutex_lock(&cur->lock);
-				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				usbi_mutex_unlock(&cur->lock);
-
-				if (to_cancel)
-					break;
-			}
+		for_each_transfer(dev_handle, cur) {
+			usbi_mutex_lock(&cur->lock);
+			if (usbi_atomic_load(&cur->state_flags) & USBI_TRANSFER_IN_FLIGHT)
+				to_cancel = cur;
+			usbi_mutex_unlock(&cur->lock);
+
+			if (to_cancel)
+				break;
 		}
 		usbi_mutex_unlock(&ctx->flying_transfers_lock);
 
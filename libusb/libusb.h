@@ -146,7 +146,7 @@ typedef SSIZE_T ssize_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x0100010A
+#define LIBUSB_API_VERSION 0x0100010B
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -1256,9 +1256,9 @@ enum libusb_transfer_flags {
 	LIBUSB_TRANSFER_SHORT_NOT_OK = (1U << 0),
 
 	/** Automatically free() transfer buffer during libusb_free_transfer().
-	 * Note that buffers allocated with libusb_dev_mem_alloc() should not
-	 * be attempted freed in this way, since free() is not an appropriate
-	 * way to release such memory. */
+	 * Note that buffers allocated with libusb_dev_mem_alloc() or
+	 * libusb_buffer_alloc() should not be attempted freed in this way,
+	 * since free() is not an appropriate way to release such memory. */
 	LIBUSB_TRANSFER_FREE_BUFFER = (1U << 1),
 
 	/** Automatically call libusb_free_transfer() after callback returns.
@@ -1534,7 +1534,384 @@ enum libusb_option {
 	 */
 	LIBUSB_OPTION_WINUSB_RAW_IO = 3,
 
-	LIBUSB_OPTION_MAX = 4
+	/** Set the timeout slack in microseconds
+	 *
+	 * Requires one additional argument of type int, the slack in
+	 * microseconds. The default of 0 disables coalescing.
+	 *
+	 * When set, the expiration time of every transfer submitted afterwards
+	 * is rounded up to the next multiple of the slack. Transfers that
+	 * expire within the same slack interval share one deadline, so the
+	 * internal timer only has to be rearmed when that deadline changes and
+	 * all of them are timed out together. The price is that a transfer may
+	 * time out up to the slack later than requested.
+	 *
+	 * The number of timer updates saved this way can be retrieved with
+	 * \ref LIBUSB_STAT_TIMER_REARMS_AVOIDED.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_TIMEOUT_SLACK_US = 4,
+
+	/** Select the mechanism used to wait for events
+	 *
+	 * Requires one additional argument of type int, a value of
+	 * \ref libusb_event_engine. The default is \ref LIBUSB_EVENT_ENGINE_POLL.
+	 *
+	 * The engine is set up when the context is created, so this option
+	 * must be set at initialization with libusb_init_context() or as a
+	 * default option before the context is created. If the selected engine
+	 * cannot be set up at that point, libusb falls back to
+	 * \ref LIBUSB_EVENT_ENGINE_POLL.
+	 *
+	 * Returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the engine is not
+	 * available on this platform.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_ENGINE = 5,
+
+	/** Set the number of completions handled per device and wakeup
+	 *
+	 * Requires one additional argument of type int. When several devices
+	 * are ready at the same time, at most this many completed transfers
+	 * are reaped from one of them before moving on to the next, so that a
+	 * device streaming data cannot hold up the others. The device to start
+	 * with changes on every wakeup. A device that is the only one ready is
+	 * always drained. 0 removes the limit. The default is 26.
+	 *
+	 * How often the limit is reached can be retrieved with
+	 * \ref LIBUSB_STAT_REAP_BUDGET_HITS.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_REAP_BUDGET = 6,
+
+	/** Busy-poll for completions before going to sleep
+	 *
+	 * Requires one additional argument of type int, the time in
+	 * microseconds. The default of 0 disables busy-polling.
+	 *
+	 * When set, event handling that would block while transfers are in
+	 * flight first checks the devices for completed transfers over and over
+	 * for up to the given time, and only then waits for events. This
+	 * removes the scheduler wakeup from the completion path of closed-loop
+	 * protocols at the price of keeping a CPU busy while waiting.
+	 *
+	 * Only supported on Linux, other platforms always wait for events.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_BUSY_POLL_US = 7,
+
+	/** Run transfer and hotplug callbacks on a pool of threads
+	 *
+	 * Requires one additional argument of type int, the number of threads,
+	 * at most 64. The default of 0 runs the callbacks from the thread
+	 * handling events.
+	 *
+	 * When set, event handling only collects completed transfers and
+	 * hotplug events and hands their callbacks over to the threads, so
+	 * that a slow callback does not delay the completions of other
+	 * devices. The callbacks of the transfers of one endpoint of a device
+	 * handle run one at a time and in completion order, and so do the
+	 * hotplug callbacks. Callbacks of different endpoints may run
+	 * concurrently. libusb_close() waits for the callbacks still queued
+	 * for the device handle.
+	 *
+	 * The threads are started when the context is created, so this option
+	 * must be set at initialization with libusb_init_context() or as a
+	 * default option before the context is created. They are stopped by
+	 * libusb_exit(), after running the callbacks still queued.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_CALLBACK_THREADS = 8,
+
+	/** Serve the device handles from several event shards
+	 *
+	 * Requires one additional argument of type int, the number of shards,
+	 * at most 64. The default of 0 serves every device handle from the
+	 * event handling of the context.
+	 *
+	 * When set, every device handle opened is assigned to one of the
+	 * shards, the one with the fewest device handles unless another one was
+	 * chosen with libusb_set_device_shard(). The events of the device
+	 * handles of a shard are only handled by libusb_handle_events_shard(),
+	 * which different threads can call for different shards at the same
+	 * time, so that independent devices are served in parallel. The event
+	 * handling of the context keeps dealing with hotplug events. Transfer
+	 * timeouts are handled by both. The synchronous I/O functions handle the
+	 * events of the shard of their device handle. The event sources of the
+	 * shards are not returned by libusb_get_pollfds().
+	 *
+	 * The shards are set up when the context is created, so this option
+	 * must be set at initialization with libusb_init_context() or as a
+	 * default option before the context is created.
+	 *
+	 * Only supported on Linux.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_SHARDS = 9,
+
+	/** Handle the events of the context on an internal thread
+	 *
+	 * Requires one additional argument of type int. When nonzero,
+	 * libusb_init_context() starts a thread calling
+	 * libusb_handle_events_completed() in a loop, so that the application
+	 * does not need an event handling thread of its own. The thread is
+	 * stopped by libusb_exit(). The default of 0 leaves event handling to
+	 * the application.
+	 *
+	 * The application may still call the event handling functions, which
+	 * then wait for the internal thread as they would for any other thread
+	 * handling events. The events of the event shards
+	 * (\ref LIBUSB_OPTION_EVENT_SHARDS) are not handled by the thread.
+	 *
+	 * The thread is started when the context is created, so this option
+	 * must be set at initialization with libusb_init_context() or as a
+	 * default option before the context is created.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_THREAD = 10,
+
+	/** Set the CPUs the internal event thread may run on
+	 *
+	 * Requires one additional argument of type const char *, a list of
+	 * CPUs in the format of the Linux cpulist files, e.g. "0-3,8-11", with
+	 * CPUs numbered up to 1023. The default of NULL, or an empty list,
+	 * leaves the affinity of the thread alone. When passed to
+	 * libusb_init_context(), the list is given in the sval member. Only
+	 * used along with \ref LIBUSB_OPTION_EVENT_THREAD.
+	 *
+	 * Returns \ref LIBUSB_ERROR_INVALID_PARAM if the list is malformed.
+	 * libusb_init_context() fails if the affinity cannot be applied, e.g.
+	 * because none of the CPUs of the list is available.
+	 *
+	 * Only supported on Linux and Windows, where the CPUs must belong to
+	 * the first processor group (CPUs 0 to 63).
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_THREAD_CPUS = 11,
+
+	/** Run the internal event thread with real-time priority
+	 *
+	 * Requires one additional argument of type int, a priority between 1
+	 * and 99 the thread runs with under the SCHED_FIFO policy. The default
+	 * of 0 leaves the thread under the default policy. Only used along with
+	 * \ref LIBUSB_OPTION_EVENT_THREAD.
+	 *
+	 * libusb_init_context() fails with \ref LIBUSB_ERROR_ACCESS if the
+	 * process is not allowed to use real-time scheduling. On Windows, any
+	 * priority runs the thread at THREAD_PRIORITY_TIME_CRITICAL.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_THREAD_PRIORITY = 12,
+
+	/** Select where transfer buffers come from
+	 *
+	 * Requires one additional argument of type int, one of
+	 * \ref libusb_buffer_allocator. The default is
+	 * \ref LIBUSB_BUFFER_ALLOCATOR_MALLOC.
+	 *
+	 * The allocator provides the buffers returned by libusb_buffer_alloc()
+	 * and the buffers of the synchronous control transfers. Another
+	 * allocator can be installed with libusb_set_allocator(). Changing the
+	 * allocator does not affect the buffers already allocated, which are
+	 * released by the allocator that provided them.
+	 *
+	 * Returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the allocator is not
+	 * available on this platform.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_BUFFER_ALLOCATOR = 13,
+
+	/** Place memory and threads on the NUMA node of the devices
+	 *
+	 * Requires one additional argument of type int, a combination of
+	 * \ref libusb_numa_binding flags. The default of 0 leaves placement to
+	 * the operating system. The NUMA node of a device is the one of the
+	 * host controller it is attached to, see libusb_get_device_numa_node().
+	 * Devices whose node is unknown are not affected.
+	 *
+	 * Returns \ref LIBUSB_ERROR_NOT_SUPPORTED if flags are given on a
+	 * platform without NUMA support. Only supported on Linux.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_NUMA_BINDING = 14,
+
+	/** Run the context with a real-time profile
+	 *
+	 * Requires one additional argument of type int, the number of transfers
+	 * the synchronous API can perform at once. The default of 0 disables
+	 * the profile. Only used when the context is initialized.
+	 *
+	 * The context preallocates what its steady state needs when it is
+	 * initialized and locks it in memory with mlock(), so that transfers
+	 * and event handling neither call the system memory allocator nor
+	 * fault pages afterwards:
+	 * - that many transfers for the synchronous API, each with room for a
+	 *   control transfer of up to 4096 bytes of data
+	 * - room in the list of pending timeouts for these transfers and for
+	 *   \ref LIBUSB_OPTION_REALTIME_IN_FLIGHT asynchronous transfers
+	 * - 64 event sources, including the ones of open devices, and the data
+	 *   used to wait for them
+	 *
+	 * Calls that would need more fail with \ref LIBUSB_ERROR_NO_MEM rather
+	 * than allocating: submitting a transfer with a timeout while the list
+	 * of pending timeouts is full, a synchronous transfer while all
+	 * transfers of the profile are in use
+	 * or a larger synchronous control transfer, and opening a device beyond
+	 * the number of event sources. Failing to lock the memory, e.g. because
+	 * of RLIMIT_MEMLOCK, only causes a warning.
+	 *
+	 * Asynchronous transfers should come from a pool created with
+	 * libusb_transfer_pool_create(). Transfers keep the URBs of their first
+	 * submission on Linux, so resubmitting them does not allocate either.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_REALTIME = 15,
+
+	/** Perform synchronous transfers with a single system call
+	 *
+	 * Requires one additional argument of type int. A non-zero value makes
+	 * libusb_control_transfer(), libusb_bulk_transfer() and
+	 * libusb_interrupt_transfer() ask the operating system to perform the
+	 * whole transfer in one call, instead of submitting an asynchronous
+	 * transfer and handling events until it completes. The default of 0
+	 * keeps the asynchronous path.
+	 *
+	 * Only transfers that fit in a single request of the operating system
+	 * take this path, the others are performed as usual. While a transfer
+	 * is performed this way, the calling thread does not handle the events
+	 * of the context, and data received before a timeout is not reported.
+	 *
+	 * Returns \ref LIBUSB_ERROR_NOT_SUPPORTED if enabled on a platform that
+	 * does not provide such calls. Only supported on Linux.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_SYNC_FAST_PATH = 16,
+
+	/** Set the number of asynchronous transfers with a timeout that can be
+	 * in flight at once under the real-time profile
+	 *
+	 * Requires one additional argument of type int. The default of 0
+	 * leaves room for 256 transfers. Only used along with
+	 * \ref LIBUSB_OPTION_REALTIME, when the context is initialized.
+	 *
+	 *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_REALTIME_IN_FLIGHT = 17,
+
+	LIBUSB_OPTION_MAX = 18
+};
+
+/** \ingroup libusb_lib
+ * Built-in buffer allocators available through
+ * \ref LIBUSB_OPTION_BUFFER_ALLOCATOR.
+ *
+ *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_buffer_allocator {
+	/** Allocate buffers with malloc() and release them with free(). */
+	LIBUSB_BUFFER_ALLOCATOR_MALLOC = 0,
+
+	/** Back buffers of 1 MiB or more with huge pages, reserved ones if
+	 * the system has any and transparent huge pages otherwise, to reduce
+	 * TLB misses on large bulk transfers. Smaller buffers come from
+	 * malloc(). Only available on Linux. */
+	LIBUSB_BUFFER_ALLOCATOR_HUGEPAGE = 1,
+
+	/** Back each buffer of 64 KiB or more with its own memfd, so that the
+	 * data can be handed to another process without being copied, see
+	 * libusb_buffer_get_memfd(). Smaller buffers come from malloc(). Only
+	 * available on Linux 3.17 or newer. */
+	LIBUSB_BUFFER_ALLOCATOR_MEMFD = 2
+};
+
+/** \ingroup libusb_lib
+ * Flags of \ref LIBUSB_OPTION_NUMA_BINDING.
+ *
+ *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_numa_binding {
+	/** Make the buffers of buffer pools that are not device memory prefer
+	 * the NUMA node of the device, see libusb_buffer_pool_create(). Device
+	 * memory is already allocated on that node by the kernel. */
+	LIBUSB_NUMA_BIND_BUFFER_POOLS = (1U << 0),
+
+	/** Restrict the internal event thread (\ref LIBUSB_OPTION_EVENT_THREAD)
+	 * to the CPUs of the NUMA node of the first device opened with a known
+	 * node. Ignored if \ref LIBUSB_OPTION_EVENT_THREAD_CPUS is set. */
+	LIBUSB_NUMA_BIND_EVENT_THREAD = (1U << 1)
+};
+
+/** \ingroup libusb_lib
+ * Transfer buffer allocator installed with libusb_set_allocator().
+ *
+ *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_allocator {
+	/** Allocate a buffer of the given length, return NULL on failure */
+	void *(LIBUSB_CALL *alloc)(void *user_data, size_t length);
+
+	/** Release a buffer returned by alloc */
+	void (LIBUSB_CALL *free)(void *user_data, void *buffer);
+
+	/** User data passed to both functions */
+	void *user_data;
+};
+
+/** \ingroup libusb_lib
+ * Event engines available through \ref LIBUSB_OPTION_EVENT_ENGINE.
+ *
+ *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_event_engine {
+	/** Wait with poll() on the set of event sources, which is rebuilt
+	 * whenever an event source is added or removed. */
+	LIBUSB_EVENT_ENGINE_POLL = 0,
+
+	/** Wait with epoll, which keeps every event source registered in the
+	 * kernel. Only available on Linux. Recommended when many devices are
+	 * open at the same time. */
+	LIBUSB_EVENT_ENGINE_EPOLL = 1,
+
+	/** Wait with io_uring, which keeps a multishot poll armed on every
+	 * event source and waits for transfer timeouts on the ring instead of
+	 * a timerfd. Only available on Linux 5.13 or newer. As no timer file
+	 * descriptor is part of the set returned by libusb_get_pollfds(),
+	 * applications doing their own polling must monitor the descriptor
+	 * returned by libusb_get_event_fd() instead. */
+	LIBUSB_EVENT_ENGINE_IO_URING = 2
+};
+
+/** \ingroup libusb_lib
+ * Statistics counters available through libusb_get_stat().
+ *
+ *  Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_stat {
+	/** Number of times the context timer did not have to be reprogrammed
+	 * because it was already set to the requested expiration time. */
+	LIBUSB_STAT_TIMER_REARMS_AVOIDED = 0,
+
+	/** Number of times a ready device was served during event handling. */
+	LIBUSB_STAT_REAP_PASSES = 1,
+
+	/** Number of times a device was left with possibly more completed
+	 * transfers because \ref LIBUSB_OPTION_REAP_BUDGET was reached. */
+	LIBUSB_STAT_REAP_BUDGET_HITS = 2,
+
+	LIBUSB_STAT_MAX = 3
 };
 
 /** \ingroup libusb_lib
@@ -1547,6 +1924,7 @@ struct libusb_init_option {
   /** An integer value used by the option (if applicable). */
   union {
     int64_t ival;
+    const char *sval;
   } value;
 };
 
@@ -1633,6 +2011,7 @@ int LIBUSB_CALL libusb_get_port_path(libusb_context *ctx, libusb_device *dev, ui
 libusb_device * LIBUSB_CALL libusb_get_parent(libusb_device *dev);
 uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device *dev);
 int LIBUSB_CALL libusb_get_device_speed(libusb_device *dev);
+int LIBUSB_CALL libusb_get_device_numa_node(libusb_device *dev);
 int LIBUSB_CALL libusb_get_max_packet_size(libusb_device *dev,
 	unsigned char endpoint);
 int LIBUSB_CALL libusb_get_max_iso_packet_size(libusb_device *dev,
@@ -1651,6 +2030,8 @@ int LIBUSB_CALL libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, li
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
 libusb_device * LIBUSB_CALL libusb_get_device(libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_set_device_shard(libusb_device *dev, int shard);
+int LIBUSB_CALL libusb_get_handle_shard(libusb_device_handle *dev_handle);
 
 int LIBUSB_CALL libusb_set_configuration(libusb_device_handle *dev_handle,
 	int configuration);
@@ -1677,6 +2058,13 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 	size_t length);
 int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length);
+int LIBUSB_CALL libusb_set_allocator(libusb_context *ctx,
+	const struct libusb_allocator *allocator);
+unsigned char * LIBUSB_CALL libusb_buffer_alloc(libusb_context *ctx,
+	size_t length);
+void LIBUSB_CALL libusb_buffer_free(libusb_context *ctx, unsigned char *buffer);
+int LIBUSB_CALL libusb_buffer_get_memfd(libusb_context *ctx,
+	unsigned char *buffer, size_t *offset);
 
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	int interface_number);
@@ -1760,10 +2148,62 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 	setup->wLength = libusb_cpu_to_le16(wLength);
 }
 
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of preallocated transfers. This is an opaque
+ * type for which you are only ever provided with a pointer, originating from
+ * libusb_transfer_pool_create().
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_transfer_pool libusb_transfer_pool;
+
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of transfer buffers. This is an opaque type
+ * for which you are only ever provided with a pointer, originating from
+ * libusb_buffer_pool_create().
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_buffer_pool libusb_buffer_pool;
+
+/** \ingroup libusb_asyncio
+ * Structure representing a completion queue. This is an opaque type for
+ * which you are only ever provided with a pointer, originating from
+ * libusb_cq_create().
+ *
+ * Since version 1.0.28, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_cq libusb_cq;
+
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers, int count);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+libusb_transfer_pool * LIBUSB_CALL libusb_transfer_pool_create(
+	libusb_context *ctx, int num_transfers, int iso_packets);
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_pool_alloc(
+	libusb_transfer_pool *pool);
+void LIBUSB_CALL libusb_transfer_pool_destroy(libusb_transfer_pool *pool);
+libusb_buffer_pool * LIBUSB_CALL libusb_buffer_pool_create(
+	libusb_device_handle *dev_handle, size_t buffer_size, int num_buffers);
+unsigned char * LIBUSB_CALL libusb_buffer_pool_alloc(libusb_buffer_pool *pool);
+void LIBUSB_CALL libusb_buffer_pool_free(libusb_buffer_pool *pool,
+	unsigned char *buffer);
+int LIBUSB_CALL libusb_buffer_pool_attach(libusb_buffer_pool *pool,
+	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_buffer_pool_is_device_memory(libusb_buffer_pool *pool);
+void LIBUSB_CALL libusb_buffer_pool_destroy(libusb_buffer_pool *pool);
+int LIBUSB_CALL libusb_cq_create(libusb_context *ctx, int size,
+	libusb_cq **cq);
+void LIBUSB_CALL libusb_cq_destroy(libusb_cq *cq);
+int LIBUSB_CALL libusb_cq_attach(libusb_cq *cq,
+	libusb_device_handle *dev_handle);
+void LIBUSB_CALL libusb_cq_detach(libusb_cq *cq,
+	libusb_device_handle *dev_handle);
+int LIBUSB_CALL libusb_cq_poll(libusb_cq *cq,
+	struct libusb_transfer **transfers, int max);
+int LIBUSB_CALL libusb_cq_get_fd(libusb_cq *cq);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
@@ -2101,6 +2541,10 @@ int LIBUSB_CALL libusb_handle_events(libusb_context *ctx);
 int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx, int *completed);
 int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_handle_events_shard(libusb_context *ctx, int shard,
+	struct timeval *tv, int *completed);
+int LIBUSB_CALL libusb_handle_events_multi(libusb_context **ctxs, int n,
+	struct timeval *tv);
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
@@ -2145,6 +2589,7 @@ typedef void (LIBUSB_CALL *libusb_pollfd_removed_cb)(int fd, void *user_data);
 
 const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	libusb_context *ctx);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
 void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds);
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
@@ -2289,6 +2734,8 @@ void * LIBUSB_CALL libusb_hotplug_get_user_data(libusb_context *ctx,
 	libusb_hotplug_callback_handle callback_handle);
 
 int LIBUSB_CALLV libusb_set_option(libusb_context *ctx, enum libusb_option option, ...);
+int LIBUSB_CALL libusb_get_stat(libusb_context *ctx, enum libusb_stat stat,
+	uint64_t *value);
 
 #ifdef _MSC_VER
 #pragma warning(pop)
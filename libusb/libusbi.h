@@ -92,6 +92,11 @@
  *   usbi_atomic_store() - Atomically write a new value value to a variable
  *   usbi_atomic_inc() - Atomically increment a variable's value and return the new value
  *   usbi_atomic_dec() - Atomically decrement a variable's value and return the new value
+ *   usbi_atomic_cas() - Atomically replace a variable's value if it equals an
+ *                       expected value and return non-zero if it did
+ *   usbi_atomic_or() - Atomically set bits of a variable's value
+ *   usbi_atomic_and() - Atomically clear the bits of a variable's value that
+ *                       are not set in a mask
  *
  * All of these operations are ordered with each other, thus the effects of
  * any one operation is guaranteed to be seen by any other operation.
@@ -102,6 +107,9 @@ typedef volatile LONG usbi_atomic_t;
 #define usbi_atomic_store(a, v)	(*(a)) = (v)
 #define usbi_atomic_inc(a)	InterlockedIncrement((a))
 #define usbi_atomic_dec(a)	InterlockedDecrement((a))
+#define usbi_atomic_cas(a, e, v)	(InterlockedCompareExchange((a), (v), (e)) == (e))
+#define usbi_atomic_or(a, v)	(void)InterlockedOr((a), (v))
+#define usbi_atomic_and(a, v)	(void)InterlockedAnd((a), (v))
 #else
 #include <stdatomic.h>
 typedef atomic_long usbi_atomic_t;
@@ -109,8 +117,26 @@ typedef atomic_long usbi_atomic_t;
 #define usbi_atomic_store(a, v)	atomic_store((a), (v))
 #define usbi_atomic_inc(a)	(atomic_fetch_add((a), 1) + 1)
 #define usbi_atomic_dec(a)	(atomic_fetch_add((a), -1) - 1)
+#define usbi_atomic_cas(a, e, v)	atomic_compare_exchange_strong((a), &(long){(e)}, (v))
+#define usbi_atomic_or(a, v)	(void)atomic_fetch_or((a), (v))
+#define usbi_atomic_and(a, v)	(void)atomic_fetch_and((a), (v))
 #endif
 
+/* Set of CPUs a thread may run on (LIBUSB_OPTION_EVENT_THREAD_CPUS) */
+#define USBI_MAX_CPUS		1024
+#define USBI_CPU_WORD_BITS	(8 * sizeof(unsigned long))
+
+struct usbi_cpu_set {
+	unsigned long bits[USBI_MAX_CPUS / USBI_CPU_WORD_BITS];
+};
+
+static inline int usbi_cpu_isset(const struct usbi_cpu_set *cpus, unsigned int cpu)
+{
+	return (cpus->bits[cpu / USBI_CPU_WORD_BITS] >> (cpu % USBI_CPU_WORD_BITS)) & 1;
+}
+
+int usbi_parse_cpu_list(const char *list, struct usbi_cpu_set *cpus);
+
 /* Internal abstractions for event handling and thread synchronization */
 #if defined(PLATFORM_POSIX)
 #include "os/events_posix.h"
@@ -141,12 +167,22 @@ extern "C" {
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_HANDLE_EVENT_SOURCES		0x00040000
+
+/* Maximum number of event shards (LIBUSB_OPTION_EVENT_SHARDS) */
+#define USBI_MAX_EVENT_SHARDS	64
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
 /* Terminator for log lines */
 #define USBI_LOG_LINE_END	"\n"
 
+/* Default for LIBUSB_OPTION_REAP_BUDGET */
+#define USBI_DEFAULT_REAP_BUDGET	26
+
+/* Maximum number of threads running callbacks (LIBUSB_OPTION_CALLBACK_THREADS) */
+#define USBI_MAX_CALLBACK_THREADS	64
+
 struct list_head {
 	struct list_head *prev, *next;
 };
@@ -247,6 +283,14 @@ static inline void list_splice_front(struct list_head *list, struct list_head *h
 	head->next = list->next;
 }
 
+static inline void list_splice_tail(struct list_head *list, struct list_head *head)
+{
+	list->next->prev = head->prev;
+	list->prev->next = head;
+	head->prev->next = list->next;
+	head->prev = list->prev;
+}
+
 static inline void *usbi_reallocf(void *ptr, size_t size)
 {
 	void *ret = realloc(ptr, size);
@@ -355,8 +399,90 @@ struct libusb_context {
 	/* used for timeout handling, if supported by OS.
 	 * this timer is maintained to trigger on the next pending timeout */
 	usbi_timer_t timer;
+
+	/* absolute expiration the timer is currently armed for, cleared when
+	 * the timer is disarmed or has fired. Protected by
+	 * flying_transfers_lock. */
+	struct timespec timer_expiry;
+#endif
+
+	/* event engine requested through LIBUSB_OPTION_EVENT_ENGINE, only
+	 * looked at when the context is initialized */
+	enum libusb_event_engine event_engine;
+
+#ifdef HAVE_EPOLL
+	/* epoll instance all event sources are registered with, or -1 if
+	 * events are not waited for with epoll */
+	int epoll_fd;
 #endif
 
+#ifdef HAVE_IO_URING
+	/* io_uring instance event sources are polled with, or NULL if events
+	 * are not waited for with io_uring */
+	struct usbi_io_uring *io_uring;
+#endif
+
+	/* expiration times of new transfers are rounded up to a multiple of
+	 * this value (LIBUSB_OPTION_TIMEOUT_SLACK_US) */
+	unsigned int timeout_slack_us;
+
+	/* maximum number of completions handled per device and wakeup, or 0
+	 * for no limit (LIBUSB_OPTION_REAP_BUDGET) */
+	unsigned int reap_budget;
+
+	/* time to busy-poll the backend for completions before waiting for
+	 * events (LIBUSB_OPTION_BUSY_POLL_US) */
+	unsigned int busy_poll_us;
+
+	/* provider of the transfer buffers (LIBUSB_OPTION_BUFFER_ALLOCATOR,
+	 * libusb_set_allocator()) */
+	struct libusb_allocator allocator;
+
+	/* statistics counters, see enum libusb_stat */
+	usbi_atomic_t stats[LIBUSB_STAT_MAX];
+
+	/* completion queue receiving the transfers of handles without their
+	 * own queue, or NULL to invoke the transfer callbacks */
+	struct libusb_cq *cq;
+
+	/* number of threads running the transfer and hotplug callbacks, or 0
+	 * to run them while handling events (LIBUSB_OPTION_CALLBACK_THREADS) */
+	unsigned int callback_threads;
+	struct usbi_executor *executor;
+
+	/* event shards serving the device handles in place of the event
+	 * handling of the context (LIBUSB_OPTION_EVENT_SHARDS) */
+	unsigned int num_event_shards;
+	struct usbi_event_shard *event_shards;
+
+	/* internal thread handling the events of the context
+	 * (LIBUSB_OPTION_EVENT_THREAD), its affinity and SCHED_FIFO priority.
+	 * event_thread_stop is protected by event_waiters_lock */
+	int event_thread_enabled;
+	struct usbi_cpu_set event_thread_cpus;
+	unsigned int event_thread_num_cpus;
+	int event_thread_priority;
+	int event_thread_running;
+	int event_thread_stop;
+	usbi_thread_t event_thread;
+
+	/* what is placed on the NUMA node of the devices
+	 * (LIBUSB_OPTION_NUMA_BINDING). event_thread_numa_node is the node the
+	 * event thread was moved to, or -1, protected by event_waiters_lock */
+	int numa_binding;
+	int event_thread_numa_node;
+
+	/* capacities preallocated by the real-time profile
+	 * (LIBUSB_OPTION_REALTIME and LIBUSB_OPTION_REALTIME_IN_FLIGHT), NULL if
+	 * the profile is not used */
+	unsigned int realtime_transfers;
+	unsigned int realtime_in_flight;
+	struct usbi_realtime_reserve *realtime;
+
+	/* perform synchronous transfers with the sync_*_transfer operations of
+	 * the backend (LIBUSB_OPTION_SYNC_FAST_PATH) */
+	int sync_fast_path;
+
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
@@ -373,11 +499,24 @@ struct libusb_context {
 	/* A flag to indicate that the context is ready for hotplug notifications */
 	usbi_atomic_t hotplug_ready;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
+	/* number of in-flight transfers. They are listed by their device
+	 * handle, those with a finite timeout are additionally tracked in
+	 * timeout_heap. Protected by flying_transfers_lock. */
+	unsigned int num_flying_transfers;
+
+	/* binary min-heap of in-flight transfers ordered by timeout expiration.
+	 * Only transfers whose timeout still has to be handled by libusb are
+	 * kept here, the soonest one being timeout_heap[0]. Protected by
+	 * flying_transfers_lock. */
+	struct usbi_transfer **timeout_heap;
+	size_t timeout_heap_len;
+	size_t timeout_heap_size;
+
+	/* completed transfers being reported by usbi_handle_transfer_completions(),
+	 * which are no longer on the in-flight lists. Only accessed with
+	 * the event handling lock held */
+	struct list_head *completing_transfers;
+
 	/* Note paths taking both this and usbi_transfer->lock must always
 	 * take this lock first */
 	usbi_mutex_t flying_transfers_lock;
@@ -404,6 +543,11 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* The threads waiting in libusb_handle_events_timeout_completed() for
+	 * their completion flag, each woken up on its own rather than through
+	 * event_waiters_cond. Protected by event_waiters_lock. */
+	struct list_head event_followers;
+
 	/* A lock to protect internal context event data. */
 	usbi_mutex_t event_data_lock;
 
@@ -411,9 +555,9 @@ struct libusb_context {
 	 * be handled. Protected by event_data_lock. */
 	unsigned int event_flags;
 
-	/* A counter that is set when we want to interrupt and prevent event handling,
-	 * in order to safely close a device. Protected by event_data_lock. */
-	unsigned int device_close;
+	/* A list of device handles waiting for the event handler to close them,
+	 * see libusb_close(). Protected by event_data_lock. */
+	struct list_head closing_handles;
 
 	/* A list of currently active event sources. Protected by event_data_lock. */
 	struct list_head event_sources;
@@ -427,6 +571,14 @@ struct libusb_context {
 	void *event_data;
 	unsigned int event_data_cnt;
 
+	/* The contexts locked by libusb_handle_events_multi() and whether they
+	 * have events, for up to multi_size contexts, kept from one call to the
+	 * next by the first context it locks. Only accessed during event
+	 * handling. */
+	struct libusb_context **multi_locked;
+	unsigned char *multi_ready;
+	unsigned int multi_size;
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
@@ -475,10 +627,15 @@ enum usbi_event_flags {
 	/* One or more completed transfers are pending */
 	USBI_EVENT_TRANSFER_COMPLETED = 1U << 4,
 
-	/* A device is in the process of being closed */
+	/* One or more device handles are waiting to be closed */
 	USBI_EVENT_DEVICE_CLOSE = 1U << 5,
 };
 
+static inline void usbi_stat_inc(struct libusb_context *ctx, enum libusb_stat stat)
+{
+	(void)usbi_atomic_inc(&ctx->stats[stat]);
+}
+
 /* Macros for managing event handling state */
 static inline int usbi_handling_events(struct libusb_context *ctx)
 {
@@ -495,6 +652,55 @@ static inline void usbi_end_event_handling(struct libusb_context *ctx)
 	usbi_tls_key_set(ctx->event_handling_key, NULL);
 }
 
+/* A subset of the device handles of a context whose event sources are waited
+ * on by libusb_handle_events_shard() rather than by the event handling of the
+ * context, so that several threads can serve disjoint sets of devices. The
+ * event handling lock and the event waiters of a shard work like those of the
+ * context, the event waiters lock and the event data lock of the context are
+ * shared by all shards. */
+struct usbi_event_shard {
+	struct libusb_context *ctx;
+
+	/* ensures that only one thread is handling the events of the shard */
+	usbi_mutex_t events_lock;
+	int event_handler_active;
+
+	/* wakes up the thread handling the events of the shard, signalled once
+	 * until the event handler clears it */
+	usbi_event_t event;
+	usbi_atomic_t event_pending;
+
+	/* event sources of the device handles of the shard, and whether they
+	 * were modified since the event data was built. Protected by the
+	 * event_data_lock of the context. Sources are only ever removed with
+	 * the events lock of the shard held. */
+	struct list_head event_sources;
+	int event_sources_modified;
+
+	/* device handles waiting to be closed, see libusb_close(). Protected
+	 * by the event_data_lock of the context */
+	struct list_head closing_handles;
+
+	/* threads waiting for their completion flag, see
+	 * libusb_handle_events_shard(). Protected by the event_waiters_lock of
+	 * the context */
+	struct list_head event_followers;
+
+	/* as for the context, only accessed with the events lock held */
+	struct list_head *completing_transfers;
+	void *event_data;
+	unsigned int event_data_cnt;
+
+	/* number of open device handles assigned to the shard. Protected by
+	 * open_devs_lock */
+	unsigned int num_handles;
+};
+
+static inline void usbi_start_shard_event_handling(struct usbi_event_shard *shard)
+{
+	usbi_tls_key_set(shard->ctx->event_handling_key, shard);
+}
+
 struct libusb_device {
 	usbi_atomic_t refcnt;
 
@@ -511,6 +717,14 @@ struct libusb_device {
 
 	struct libusb_device_descriptor device_descriptor;
 	usbi_atomic_t attached;
+
+	/* event shard the handles of the device are assigned to, or -1 to pick
+	 * the least loaded one, see libusb_set_device_shard() */
+	int event_shard;
+
+	/* NUMA node of the host controller the device is attached to, or -1
+	 * if unknown, see libusb_get_device_numa_node() */
+	int numa_node;
 };
 
 struct libusb_device_handle {
@@ -521,8 +735,47 @@ struct libusb_device_handle {
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* in-flight transfers of this handle, in no particular order, so that
+	 * closing or disconnecting it only visits its own transfers. Protected
+	 * by the flying_transfers_lock of the context */
+	struct list_head flying_transfers;
+
+	/* completion queue receiving the transfers of this handle, or NULL
+	 * to use the one of the context */
+	struct libusb_cq *cq;
+
+	/* one strand per endpoint address, allocated when the first callback
+	 * of the handle is queued on the executor, and the number of callbacks
+	 * queued or running. Protected by the executor lock */
+	struct usbi_strand *strands;
+	unsigned int queued_callbacks;
+
+	/* event shard serving the handle, or NULL if its events are handled by
+	 * the event handling of the context */
+	struct usbi_event_shard *shard;
 };
 
+/* Whether the calling thread handles the events of the device handle */
+static inline int usbi_handling_events_of(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	void *handler = usbi_tls_key_get(ctx->event_handling_key);
+
+	if (dev_handle->shard)
+		return handler == dev_handle->shard;
+	return handler == ctx;
+}
+
+/* Where the transfers whose completion is being reported for the device
+ * handle are found, see usbi_handle_transfer_completions() */
+static inline struct list_head **usbi_completing_transfers(struct libusb_device_handle *dev_handle)
+{
+	if (dev_handle->shard)
+		return &dev_handle->shard->completing_transfers;
+	return &HANDLE_CTX(dev_handle)->completing_transfers;
+}
+
 /* Function called by backend during device initialization to convert
  * multi-byte fields in the device descriptor to host-endian format.
  */
@@ -574,9 +827,28 @@ struct usbi_transfer {
 	struct timespec timeout;
 	int transferred;
 	uint32_t stream_id;
-	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
+	/* Changed with atomic operations. Submission and cancellation also
+	 * hold usbi_transfer->lock so as not to race with each other, the
+	 * completion path does not */
+	usbi_atomic_t state_flags;
 	uint32_t timeout_flags; /* Protected by the flying_stransfers_lock */
 
+	/* 1-based position in the context timeout heap, 0 if not in the heap.
+	 * Protected by the flying_transfers_lock */
+	size_t timeout_heap_pos;
+
+	/* The pool this transfer was allocated from, if any */
+	struct libusb_transfer_pool *pool;
+
+	/* The buffer attached with libusb_buffer_pool_attach() and its pool,
+	 * returned when the transfer is freed */
+	struct libusb_buffer_pool *buffer_pool;
+	unsigned char *pool_buffer;
+
+	/* The buffer a synchronous transfer got from libusb_buffer_alloc(),
+	 * released when the transfer is freed */
+	unsigned char *alloc_buffer;
+
 	/* The device reference is held until destruction for logging
 	 * even after dev_handle is set to NULL.  */
 	struct libusb_device *dev;
@@ -604,6 +876,10 @@ enum usbi_transfer_state_flags {
 
 	/* Operation on the transfer failed because the device disappeared */
 	USBI_TRANSFER_DEVICE_DISAPPEARED = 1U << 2,
+
+	/* Prepared by libusb_submit_transfers(), which holds the transfer lock
+	 * until the transfer is handed to the backend */
+	USBI_TRANSFER_BATCHED = 1U << 3,
 };
 
 enum usbi_transfer_timeout_flags {
@@ -617,6 +893,144 @@ enum usbi_transfer_timeout_flags {
 	USBI_TRANSFER_TIMED_OUT = 1U << 2,
 };
 
+/* Transfer pools hand out transfers that are carved out of a single slab and
+ * initialized once. Free transfers are spread over a few independently locked
+ * shards, a thread uses the shard selected by its thread ID first so that
+ * threads allocating and freeing concurrently rarely contend. */
+#define USBI_TRANSFER_POOL_SHARDS	8
+
+struct usbi_transfer_pool_shard {
+	usbi_mutex_t lock;
+	struct list_head free_transfers;
+};
+
+struct libusb_transfer_pool {
+	struct libusb_context *ctx;
+	int num_transfers;
+	int iso_packets;
+	size_t transfer_size;
+	unsigned char *slab;
+
+	/* number of transfers currently handed out */
+	usbi_atomic_t in_use;
+
+	struct usbi_transfer_pool_shard shards[USBI_TRANSFER_POOL_SHARDS];
+};
+
+/* The real-time profile (LIBUSB_OPTION_REALTIME) preallocates everything the
+ * steady state needs when the context is initialized and locks it in memory:
+ * a transfer pool for the synchronous API with a control buffer per transfer,
+ * room in the timeout heap for those and for the asynchronous transfers in
+ * flight, and a fixed number of event sources along with their event data.
+ * The completed transfers and the slots of completion queues need no
+ * allocation, the former are linked through the transfers themselves and the
+ * latter are allocated along with the queue. Running out of any of them
+ * fails the call with LIBUSB_ERROR_NO_MEM rather than allocating. */
+#define USBI_REALTIME_EVENT_SOURCES	64
+#define USBI_REALTIME_IN_FLIGHT		256
+#define USBI_REALTIME_CONTROL_SIZE	(LIBUSB_CONTROL_SETUP_SIZE + 4096)
+
+struct usbi_realtime_reserve {
+	struct libusb_transfer_pool *transfers;
+	unsigned char *control_buffers;
+
+	/* free event sources, protected by event_data_lock */
+	struct usbi_event_source *event_sources;
+	struct list_head free_event_sources;
+};
+
+/* Buffer pools carve fixed-size buffers out of a single block of device
+ * memory (libusb_dev_mem_alloc()), or of ordinary memory if the backend
+ * cannot provide it. Free buffers are linked through their first bytes. */
+#define USBI_BUFFER_POOL_ALIGN	64
+
+struct libusb_buffer_pool {
+	struct libusb_device_handle *dev_handle;
+	size_t buffer_size;
+	size_t stride;
+	int num_buffers;
+	unsigned char *mem;
+	size_t mem_size;
+	int dev_mem;
+
+	/* ordinary memory the buffers are carved out of, before alignment */
+	void *mem_alloc;
+
+	/* Protects free_buffers */
+	usbi_mutex_t lock;
+	void *free_buffers;
+
+	/* number of buffers currently handed out */
+	usbi_atomic_t in_use;
+};
+
+struct usbi_cq_slot {
+	/* sequence number telling producers and consumers whose turn it is */
+	usbi_atomic_t seq;
+	struct libusb_transfer *transfer;
+};
+
+struct libusb_cq {
+	struct libusb_context *ctx;
+
+	/* bounded multi-producer multi-consumer ring of completed transfers */
+	struct usbi_cq_slot *slots;
+	long mask;
+	usbi_atomic_t head;
+	usbi_atomic_t tail;
+
+	/* transfers completed while the ring was full, linked through
+	 * usbi_transfer->list. Protected by overflow_lock */
+	usbi_mutex_t overflow_lock;
+	struct list_head overflow;
+	usbi_atomic_t overflowed;
+
+	/* number of queued transfers, the event is signalled while non-zero */
+	usbi_atomic_t pending;
+	usbi_mutex_t event_lock;
+	int signaled; /* Protected by event_lock */
+	usbi_event_t event;
+};
+
+/* Strands run the callbacks queued on them one at a time and in order, on
+ * any of the executor threads. There is one strand per endpoint of each
+ * device handle and one for the hotplug callbacks of the context. */
+#define USBI_ENDPOINT_STRANDS	32
+
+struct usbi_strand {
+	/* completed transfers linked through usbi_transfer->list, or hotplug
+	 * messages for the hotplug strand */
+	struct list_head queue;
+	struct list_head run_list;
+	struct libusb_device_handle *dev_handle;
+	/* strands of a device handle closed by the callback running on this
+	 * strand, to be freed once it returns */
+	struct usbi_strand *orphaned;
+	int scheduled;		/* on the runnable list or being run */
+	int running;
+};
+
+struct usbi_executor {
+	struct libusb_context *ctx;
+
+	/* protects everything below and the strands */
+	usbi_mutex_t lock;
+	usbi_cond_t work_cond;
+	usbi_cond_t idle_cond;
+	struct list_head runnable;
+	unsigned int idle_threads;
+	unsigned int flush_waiters;
+	int stop;
+
+	/* strand the calling thread is running a callback of, if any */
+	usbi_tls_key_t current_strand_key;
+
+	struct usbi_strand hotplug;
+
+	unsigned int num_threads;
+	usbi_thread_t threads[ZERO_SIZED_ARRAY];
+};
+
 #define USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)	\
 	((struct libusb_transfer *)			\
 	 ((unsigned char *)(itransfer)			\
@@ -789,9 +1203,23 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	unsigned long session_id);
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *dev_handle);
-
+void usbi_handle_pending_closes(struct libusb_context *ctx,
+	struct usbi_event_shard *shard);
+void usbi_detach_flying_transfer(struct usbi_transfer *itransfer);
+
+int usbi_start_event_thread(struct libusb_context *ctx);
+void usbi_stop_event_thread(struct libusb_context *ctx);
+void usbi_numa_bind_event_thread(struct libusb_device *dev);
+struct libusb_transfer *usbi_alloc_sync_transfer(struct libusb_context *ctx,
+	size_t buffer_size);
+int usbi_start_executor(struct libusb_context *ctx);
+void usbi_stop_executor(struct libusb_context *ctx);
+void usbi_executor_flush_handle(struct libusb_device_handle *dev_handle);
+void LIBUSB_CALL usbi_sync_transfer_cb(struct libusb_transfer *transfer);
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
+int usbi_handle_transfer_completions(struct libusb_context *ctx,
+	struct list_head *completed);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer);
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer);
 
@@ -803,17 +1231,35 @@ struct usbi_event_source {
 		usbi_os_handle_t os_handle;
 		short poll_events;
 	} data;
+	void *user_data;
+
+	/* set once the event source has been removed */
+	int removed;
+
+	/* set while the event engine may still report events for the event
+	 * source, which must not be freed until it is cleared */
+	int engine_busy;
+
 	struct list_head list;
 };
 
 int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle,
-	short poll_events);
+	short poll_events, void *user_data);
 void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle);
+int usbi_add_handle_event_source(struct libusb_device_handle *dev_handle,
+	usbi_os_handle_t os_handle, short poll_events, void *user_data);
+void usbi_remove_handle_event_source(struct libusb_device_handle *dev_handle,
+	usbi_os_handle_t os_handle);
+
+int usbi_try_lock_shard_events(struct usbi_event_shard *shard);
+void usbi_unlock_shard_events(struct usbi_event_shard *shard);
+void usbi_signal_shard_event(struct usbi_event_shard *shard);
 
 struct usbi_option {
   int is_set;
   union {
     int ival;
+    char *sval;
   } arg;
 };
 
@@ -831,6 +1277,22 @@ int usbi_arm_timer(usbi_timer_t *timer, const struct timespec *timeout);
 int usbi_disarm_timer(usbi_timer_t *timer);
 #endif
 
+#ifdef HAVE_OS_EVENT_ENGINE
+int usbi_create_event_engine(struct libusb_context *ctx);
+void usbi_destroy_event_engine(struct libusb_context *ctx);
+int usbi_event_engine_add_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source);
+void usbi_event_engine_remove_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source);
+#endif
+
+#ifdef HAVE_IO_URING
+int usbi_io_uring_fd(struct libusb_context *ctx);
+#ifdef HAVE_OS_TIMER
+void usbi_create_io_uring_timer(struct libusb_context *ctx, usbi_timer_t *timer);
+#endif
+#endif
+
 static inline int usbi_using_timer(struct libusb_context *ctx)
 {
 #ifdef HAVE_OS_TIMER
@@ -841,6 +1303,42 @@ static inline int usbi_using_timer(struct libusb_context *ctx)
 #endif
 }
 
+static inline int usbi_using_epoll(struct libusb_context *ctx)
+{
+#ifdef HAVE_EPOLL
+	return ctx->epoll_fd >= 0;
+#else
+	UNUSED(ctx);
+	return 0;
+#endif
+}
+
+/* io_uring reports readiness once per wakeup of an event source rather
+ * than for as long as it is ready, so backends have to handle all pending
+ * events of a ready event source before returning from handle_events() */
+static inline int usbi_using_io_uring(struct libusb_context *ctx)
+{
+#ifdef HAVE_IO_URING
+	return ctx->io_uring != NULL;
+#else
+	UNUSED(ctx);
+	return 0;
+#endif
+}
+
+static inline int usbi_using_event_engine(struct libusb_context *ctx)
+{
+	return usbi_using_epoll(ctx) || usbi_using_io_uring(ctx);
+}
+
+/* An event source that has reported events, as handed to the backend's
+ * handle_events(). user_data is the pointer given when the event source
+ * was added. */
+struct usbi_ready_event {
+	void *user_data;
+	short revents;
+};
+
 struct usbi_reported_events {
 	union {
 		struct {
@@ -857,8 +1355,17 @@ struct usbi_reported_events {
 };
 
 int usbi_alloc_event_data(struct libusb_context *ctx);
+int usbi_reserve_event_data(struct libusb_context *ctx, unsigned int size);
+void usbi_free_event_data(struct libusb_context *ctx);
+int usbi_lock_memory(void *mem, size_t len);
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms);
+int usbi_wait_for_multi_events(struct libusb_context **ctxs, unsigned int n,
+	unsigned char *ready, int timeout_ms);
+int usbi_alloc_shard_event_data(struct usbi_event_shard *shard);
+void usbi_free_shard_event_data(struct usbi_event_shard *shard);
+int usbi_wait_for_shard_events(struct usbi_event_shard *shard,
+	struct usbi_reported_events *reported_events, int timeout_ms);
 
 /* accessor functions for structure private data */
 
@@ -1274,6 +1781,55 @@ struct usbi_os_backend {
 	int (*dev_mem_free)(struct libusb_device_handle *handle, void *buffer,
 		size_t len);
 
+	/* Make the given memory, which is going to be used for transfers with
+	 * the device, prefer the NUMA node of the device. Called for memory
+	 * that does not come from dev_mem_alloc, only for devices with a
+	 * known numa_node. Best effort, optional to implement.
+	 */
+	void (*numa_bind_memory)(struct libusb_device *dev, void *mem, size_t len);
+
+	/* Restrict a thread to the CPUs of the given NUMA node. Optional.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_FOUND if the node has no CPUs
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*numa_bind_thread)(struct libusb_context *ctx, usbi_thread_t thread,
+		int node);
+
+	/* Perform a control transfer synchronously, in a single call to the
+	 * operating system. Optional, used by libusb_control_transfer() when
+	 * LIBUSB_OPTION_SYNC_FAST_PATH is set.
+	 *
+	 * The parameters are the ones of libusb_control_transfer(). This
+	 * function is called without any lock held, and must not handle
+	 * the events of the context.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfer cannot be performed this
+	 *   way, in which case it is submitted as an asynchronous transfer
+	 * - another LIBUSB_ERROR code on transfer failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *dev_handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer synchronously, in a single call
+	 * to the operating system. Optional, used by libusb_bulk_transfer() and
+	 * libusb_interrupt_transfer() when LIBUSB_OPTION_SYNC_FAST_PATH is set.
+	 *
+	 * The parameters are the ones of libusb_bulk_transfer(), and the
+	 * return values the ones of sync_control_transfer except that 0 is
+	 * returned on success, with the number of bytes transferred stored in
+	 * transferred.
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout);
+
 	/* Determine if a kernel driver is active on an interface. Optional.
 	 *
 	 * The presence of a kernel driver on an interface indicates that any
@@ -1365,6 +1921,14 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Destroy a transfer. Optional.
+	 *
+	 * This function is called when a transfer is freed, or when the transfer
+	 * pool it belongs to is destroyed. It should free any resources that the
+	 * backend keeps in the transfer private data across submissions.
+	 */
+	void (*destroy_transfer)(struct usbi_transfer *itransfer);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1374,10 +1938,10 @@ struct usbi_os_backend {
 	 * This involves monitoring any active transfers and processing their
 	 * completion or cancellation.
 	 *
-	 * The function is passed a pointer that represents platform-specific
-	 * data for monitoring event sources (size count). This data is to be
-	 * (re)allocated as necessary when event sources are modified.
-	 * The num_ready parameter indicates the number of event sources that
+	 * The function is passed an array of struct usbi_ready_event (size
+	 * count), one for each event source that has reported events, carrying
+	 * the user_data pointer the event source was added with. The
+	 * num_ready parameter indicates the number of event sources that
 	 * have reported events. This should be enough information for you to
 	 * determine which actions need to be taken on the currently active
 	 * transfers.
@@ -1401,6 +1965,18 @@ struct usbi_os_backend {
 	int (*handle_events)(struct libusb_context *ctx,
 		void *event_data, unsigned int count, unsigned int num_ready);
 
+	/* Check all open devices for completed transfers without blocking.
+	 * Optional.
+	 *
+	 * Called repeatedly from the event handling path in place of waiting
+	 * for events when LIBUSB_OPTION_BUSY_POLL_US is set. Completions are
+	 * handled the same way as from handle_events().
+	 *
+	 * Return 1 if anything was handled, 0 if nothing was ready or a
+	 * LIBUSB_ERROR code on failure.
+	 */
+	int (*busy_poll)(struct libusb_context *ctx);
+
 	/* Handle transfer completion. Optional.
 	 *
 	 * Provide this function when there are no event sources available that
@@ -1468,14 +2044,17 @@ extern const struct usbi_os_backend usbi_backend;
 #define __for_each_transfer(list, t) \
 	for_each_helper(t, (list), struct usbi_transfer)
 
-#define for_each_transfer(ctx, t) \
-	__for_each_transfer(&(ctx)->flying_transfers, t)
+#define for_each_transfer(dev_handle, t) \
+	__for_each_transfer(&(dev_handle)->flying_transfers, t)
 
 #define __for_each_transfer_safe(list, t, n) \
 	for_each_safe_helper(t, n, (list), struct usbi_transfer)
 
-#define for_each_transfer_safe(ctx, t, n) \
-	__for_each_transfer_safe(&(ctx)->flying_transfers, t, n)
+#define for_each_transfer_safe(dev_handle, t, n) \
+	__for_each_transfer_safe(&(dev_handle)->flying_transfers, t, n)
+
+#define __for_each_completed_transfer(list, t) \
+	list_for_each_entry(t, (list), completed_list, struct usbi_transfer)
 
 #define __for_each_completed_transfer_safe(list, t, n) \
 	list_for_each_entry_safe(t, n, (list), completed_list, struct usbi_transfer)
@@ -531,7 +531,7 @@ int em_handle_transfer_completion(usbi_transfer *itransfer) {
 
   auto result_val = WebUsbTransferPtr(itransfer).take();
 
-  if (itransfer->state_flags & USBI_TRANSFER_CANCELLING) {
+  if (usbi_atomic_load(&itransfer->state_flags) & USBI_TRANSFER_CANCELLING) {
     return usbi_handle_transfer_cancellation(itransfer);
   }
 
@@ -22,9 +22,18 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
 #endif
+#include <sys/mman.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_TIMERFD
 #include <sys/timerfd.h>
 #endif
@@ -176,6 +185,373 @@ void usbi_clear_event(usbi_event_t *event)
 		usbi_warn(NULL, "event read failed");
 }
 
+#ifdef HAVE_IO_URING
+#define IO_URING_SQ_ENTRIES	64
+#define IO_URING_CQ_ENTRIES	1024
+
+/* multishot polls need Linux 5.13, which is also the first version to report
+ * IORING_FEAT_RSRC_TAGS */
+#define IO_URING_REQUIRED_FEATURES \
+	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | \
+	 IORING_FEAT_RSRC_TAGS)
+
+/* the user data of a multishot poll is the event source it was armed for.
+ * event sources are allocated with malloc(), so the low bits are free to tag
+ * the other requests. */
+#define IO_URING_TAG_MASK	3ULL
+#define IO_URING_TAG_TIMER	1ULL
+#define IO_URING_TAG_IGNORE	2ULL
+
+struct usbi_io_uring {
+	int fd;
+	void *ring;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/* requests can be submitted from any thread. sq_lock protects the
+	 * submission queue and the timer state below, and is always the last
+	 * lock taken. */
+	usbi_mutex_t sq_lock;
+	unsigned int *sq_khead;
+	unsigned int *sq_ktail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+
+	/* the completion queue is only consumed while handling events */
+	unsigned int *cq_khead;
+	unsigned int *cq_ktail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* the timeout standing in for a timerfd. every arm bumps the generation
+	 * so that completions of an earlier timeout are told apart. */
+	uint64_t timer_gen;
+	int timer_armed;
+	struct timespec timer_expiry;
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	unsigned int flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+/* must be called with sq_lock held */
+static int ring_submit_locked(struct usbi_io_uring *ring, const struct io_uring_sqe *sqe)
+{
+	unsigned int tail = *ring->sq_ktail;
+	unsigned int head = __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE);
+	int r;
+
+	if (tail - head >= ring->sq_entries)
+		return LIBUSB_ERROR_BUSY;
+
+	ring->sqes[tail & ring->sq_mask] = *sqe;
+	__atomic_store_n(ring->sq_ktail, tail + 1, __ATOMIC_RELEASE);
+
+	do {
+		r = sys_io_uring_enter(ring->fd, tail + 1 - head, 0, 0, NULL, 0);
+	} while (r == -1 && errno == EINTR);
+	if (r == -1) {
+		usbi_warn(NULL, "failed to submit to io_uring, errno=%d", errno);
+		/* the kernel only consumes submissions from within io_uring_enter(),
+		 * which is always called with sq_lock held when submitting */
+		if (__atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE) == head)
+			__atomic_store_n(ring->sq_ktail, tail, __ATOMIC_RELEASE);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+static void ring_prep(struct io_uring_sqe *sqe, uint8_t opcode, int fd, uint64_t user_data)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+}
+
+/* must be called with event_data_lock held */
+static int ring_poll_add(struct usbi_io_uring *ring, struct usbi_event_source *ievent_source)
+{
+	struct io_uring_sqe sqe;
+	uint32_t events = (uint16_t)ievent_source->data.poll_events;
+	int r;
+
+	ring_prep(&sqe, IORING_OP_POLL_ADD, ievent_source->data.os_handle,
+		(uint64_t)(uintptr_t)ievent_source);
+	sqe.len = IORING_POLL_ADD_MULTI;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	/* the kernel swaps the halves back to stay compatible with poll_events */
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe.poll32_events = events;
+
+	usbi_mutex_lock(&ring->sq_lock);
+	r = ring_submit_locked(ring, &sqe);
+	usbi_mutex_unlock(&ring->sq_lock);
+	if (r == 0)
+		ievent_source->engine_busy = 1;
+
+	return r;
+}
+
+static int create_io_uring(struct libusb_context *ctx)
+{
+	struct usbi_io_uring *ring;
+	struct io_uring_params p;
+	unsigned int *sq_array;
+	unsigned int i;
+	char *base;
+	void *ptr;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return LIBUSB_ERROR_NO_MEM;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = IO_URING_CQ_ENTRIES;
+	ring->fd = sys_io_uring_setup(IO_URING_SQ_ENTRIES, &p);
+	if (ring->fd == -1) {
+		usbi_warn(ctx, "failed to create io_uring instance, errno=%d", errno);
+		free(ring);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	if ((p.features & IO_URING_REQUIRED_FEATURES) != IO_URING_REQUIRED_FEATURES) {
+		usbi_warn(ctx, "io_uring instance lacks required features (0x%x)", p.features);
+		goto err_close;
+	}
+
+	ring->ring_size = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		usbi_warn(ctx, "failed to map io_uring rings, errno=%d", errno);
+		goto err_close;
+	}
+	ring->ring = ptr;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		usbi_warn(ctx, "failed to map io_uring submission entries, errno=%d", errno);
+		goto err_unmap_ring;
+	}
+	ring->sqes = ptr;
+
+	base = ring->ring;
+	ring->sq_khead = (unsigned int *)(base + p.sq_off.head);
+	ring->sq_ktail = (unsigned int *)(base + p.sq_off.tail);
+	ring->sq_mask = *(unsigned int *)(base + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_khead = (unsigned int *)(base + p.cq_off.head);
+	ring->cq_ktail = (unsigned int *)(base + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(base + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+
+	/* submission entries are always used in order */
+	sq_array = (unsigned int *)(base + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	usbi_mutex_init(&ring->sq_lock);
+	ctx->io_uring = ring;
+	return 0;
+
+err_unmap_ring:
+	munmap(ring->ring, ring->ring_size);
+err_close:
+	close(ring->fd);
+	free(ring);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static void destroy_io_uring(struct libusb_context *ctx)
+{
+	struct usbi_io_uring *ring = ctx->io_uring;
+	struct usbi_event_source *ievent_source;
+
+	/* closing the ring cancels all requests, so the event sources can be
+	 * freed whether or not their final completion was seen */
+	usbi_mutex_lock(&ctx->event_data_lock);
+	for_each_event_source(ctx, ievent_source)
+		ievent_source->engine_busy = 0;
+	for_each_removed_event_source(ctx, ievent_source)
+		ievent_source->engine_busy = 0;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring, ring->ring_size);
+	if (close(ring->fd) == -1)
+		usbi_warn(ctx, "failed to close io_uring instance, errno=%d", errno);
+	usbi_mutex_destroy(&ring->sq_lock);
+	free(ring);
+	ctx->io_uring = NULL;
+}
+
+static int io_uring_add_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	int r = ring_poll_add(ctx->io_uring, ievent_source);
+
+	if (r < 0)
+		usbi_err(ctx, "failed to poll fd %d with io_uring", ievent_source->data.os_handle);
+
+	return r;
+}
+
+static void io_uring_remove_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct usbi_io_uring *ring = ctx->io_uring;
+	struct io_uring_sqe sqe;
+
+	if (!ievent_source->engine_busy)
+		return;
+
+	/* the event source stays allocated until the poll reports its final
+	 * completion, see cleanup_removed_event_sources() */
+	ring_prep(&sqe, IORING_OP_POLL_REMOVE, -1, IO_URING_TAG_IGNORE);
+	sqe.addr = (uint64_t)(uintptr_t)ievent_source;
+
+	usbi_mutex_lock(&ring->sq_lock);
+	if (ring_submit_locked(ring, &sqe) < 0)
+		usbi_warn(ctx, "failed to stop polling fd %d with io_uring",
+			  ievent_source->data.os_handle);
+	usbi_mutex_unlock(&ring->sq_lock);
+}
+
+int usbi_io_uring_fd(struct libusb_context *ctx)
+{
+	return ctx->io_uring->fd;
+}
+
+#ifdef HAVE_TIMERFD
+static uint64_t ring_timer_user_data(struct usbi_io_uring *ring)
+{
+	return (ring->timer_gen << 2) | IO_URING_TAG_TIMER;
+}
+
+/* must be called with sq_lock held */
+static int ring_submit_timer_locked(struct usbi_io_uring *ring)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_sqe sqe;
+
+	/* the kernel copies the expiration when the request is submitted */
+	ts.tv_sec = ring->timer_expiry.tv_sec;
+	ts.tv_nsec = ring->timer_expiry.tv_nsec;
+	ring_prep(&sqe, IORING_OP_TIMEOUT, -1, ring_timer_user_data(ring));
+	sqe.addr = (uint64_t)(uintptr_t)&ts;
+	sqe.len = 1;
+	sqe.timeout_flags = IORING_TIMEOUT_ABS;
+
+	return ring_submit_locked(ring, &sqe);
+}
+
+/* must be called with sq_lock held */
+static int ring_disarm_timer_locked(struct usbi_io_uring *ring)
+{
+	struct io_uring_sqe sqe;
+	int r;
+
+	if (!ring->timer_armed)
+		return 0;
+
+	ring_prep(&sqe, IORING_OP_TIMEOUT_REMOVE, -1, IO_URING_TAG_IGNORE);
+	sqe.addr = ring_timer_user_data(ring);
+	r = ring_submit_locked(ring, &sqe);
+
+	/* even if the removal failed, a later expiry of this timeout is
+	 * ignored as the generation no longer matches */
+	ring->timer_gen++;
+	ring->timer_armed = 0;
+	return r;
+}
+
+static int ring_arm_timer(struct usbi_io_uring *ring, const struct timespec *timeout)
+{
+	int r;
+
+	usbi_mutex_lock(&ring->sq_lock);
+	(void)ring_disarm_timer_locked(ring);
+	ring->timer_expiry = *timeout;
+	r = ring_submit_timer_locked(ring);
+	if (r == 0)
+		ring->timer_armed = 1;
+	usbi_mutex_unlock(&ring->sq_lock);
+
+	if (r < 0)
+		usbi_warn(NULL, "failed to arm io_uring timeout");
+	return r;
+}
+
+static int ring_disarm_timer(struct usbi_io_uring *ring)
+{
+	int r;
+
+	usbi_mutex_lock(&ring->sq_lock);
+	r = ring_disarm_timer_locked(ring);
+	usbi_mutex_unlock(&ring->sq_lock);
+
+	if (r < 0)
+		usbi_warn(NULL, "failed to disarm io_uring timeout");
+	return r;
+}
+
+/* handles a completion of the timeout, returns 1 if the timer expired */
+static int ring_timer_completion(struct usbi_io_uring *ring, uint64_t user_data, int res)
+{
+	int expired = 0;
+
+	usbi_mutex_lock(&ring->sq_lock);
+	if (ring->timer_armed && user_data == ring_timer_user_data(ring)) {
+		if (res == -ETIME) {
+			ring->timer_armed = 0;
+			expired = 1;
+		} else if (res == -ECANCELED) {
+			/* the kernel cancels requests when the thread that submitted
+			 * them exits. the timer is still wanted, submit it again. */
+			ring->timer_gen++;
+			if (ring_submit_timer_locked(ring) < 0) {
+				usbi_warn(NULL, "failed to rearm io_uring timeout");
+				ring->timer_armed = 0;
+				expired = 1;
+			}
+		}
+	}
+	usbi_mutex_unlock(&ring->sq_lock);
+
+	return expired;
+}
+
+void usbi_create_io_uring_timer(struct libusb_context *ctx, usbi_timer_t *timer)
+{
+	timer->timerfd = -1;
+	timer->io_uring = ctx->io_uring;
+}
+#else
+static int ring_timer_completion(struct usbi_io_uring *ring, uint64_t user_data, int res)
+{
+	UNUSED(ring);
+	UNUSED(user_data);
+	UNUSED(res);
+	return 0;
+}
+#endif
+#endif
+
 #ifdef HAVE_TIMERFD
 int usbi_create_timer(usbi_timer_t *timer)
 {
@@ -190,6 +566,13 @@ int usbi_create_timer(usbi_timer_t *timer)
 
 void usbi_destroy_timer(usbi_timer_t *timer)
 {
+#ifdef HAVE_IO_URING
+	if (timer->io_uring) {
+		(void)ring_disarm_timer(timer->io_uring);
+		timer->io_uring = NULL;
+		return;
+	}
+#endif
 	if (close(timer->timerfd) == -1)
 		usbi_warn(NULL, "failed to close timerfd, errno=%d", errno);
 }
@@ -198,6 +581,10 @@ int usbi_arm_timer(usbi_timer_t *timer, const struct timespec *timeout)
 {
 	const struct itimerspec it = { { 0, 0 }, { timeout->tv_sec, timeout->tv_nsec } };
 
+#ifdef HAVE_IO_URING
+	if (timer->io_uring)
+		return ring_arm_timer(timer->io_uring, timeout);
+#endif
 	if (timerfd_settime(timer->timerfd, TFD_TIMER_ABSTIME, &it, NULL) == -1) {
 		usbi_warn(NULL, "failed to arm timerfd, errno=%d", errno);
 		return LIBUSB_ERROR_OTHER;
@@ -210,6 +597,10 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 {
 	const struct itimerspec it = { { 0, 0 }, { 0, 0 } };
 
+#ifdef HAVE_IO_URING
+	if (timer->io_uring)
+		return ring_disarm_timer(timer->io_uring);
+#endif
 	if (timerfd_settime(timer->timerfd, 0, &it, NULL) == -1) {
 		usbi_warn(NULL, "failed to disarm timerfd, errno=%d", errno);
 		return LIBUSB_ERROR_OTHER;
@@ -219,41 +610,287 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 }
 #endif
 
+#ifdef HAVE_EPOLL
+static int create_epoll(struct libusb_context *ctx)
+{
+	ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->epoll_fd == -1) {
+		usbi_warn(ctx, "failed to create epoll instance, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+static void destroy_epoll(struct libusb_context *ctx)
+{
+	if (close(ctx->epoll_fd) == -1)
+		usbi_warn(ctx, "failed to close epoll instance, errno=%d", errno);
+	ctx->epoll_fd = -1;
+}
+
+static int epoll_add_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	struct epoll_event event;
+
+	/* the poll() and epoll event bits have the same values on Linux */
+	memset(&event, 0, sizeof(event));
+	event.events = (uint32_t)ievent_source->data.poll_events;
+	event.data.ptr = ievent_source->user_data;
+
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, ievent_source->data.os_handle, &event) == -1) {
+		usbi_err(ctx, "failed to add fd %d to epoll instance, errno=%d",
+			 ievent_source->data.os_handle, errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+static void epoll_remove_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+	if (epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, ievent_source->data.os_handle, NULL) == -1)
+		usbi_warn(ctx, "failed to remove fd %d from epoll instance, errno=%d",
+			  ievent_source->data.os_handle, errno);
+}
+#endif
+
+#ifdef HAVE_OS_EVENT_ENGINE
+int usbi_create_event_engine(struct libusb_context *ctx)
+{
+	const char *name;
+	int r;
+
+#ifdef HAVE_EPOLL
+	ctx->epoll_fd = -1;
+#endif
+
+	switch (ctx->event_engine) {
+	case LIBUSB_EVENT_ENGINE_POLL:
+		return 0;
+#ifdef HAVE_EPOLL
+	case LIBUSB_EVENT_ENGINE_EPOLL:
+		name = "epoll";
+		r = create_epoll(ctx);
+		break;
+#endif
+#ifdef HAVE_IO_URING
+	case LIBUSB_EVENT_ENGINE_IO_URING:
+		name = "io_uring";
+		r = create_io_uring(ctx);
+		break;
+#endif
+	default:
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	if (r == 0)
+		usbi_dbg(ctx, "using %s for event handling", name);
+	return r;
+}
+
+void usbi_destroy_event_engine(struct libusb_context *ctx)
+{
+#ifdef HAVE_EPOLL
+	if (usbi_using_epoll(ctx))
+		destroy_epoll(ctx);
+#endif
+#ifdef HAVE_IO_URING
+	if (usbi_using_io_uring(ctx))
+		destroy_io_uring(ctx);
+#endif
+}
+
+int usbi_event_engine_add_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+#ifdef HAVE_EPOLL
+	if (usbi_using_epoll(ctx))
+		return epoll_add_event_source(ctx, ievent_source);
+#endif
+#ifdef HAVE_IO_URING
+	if (usbi_using_io_uring(ctx))
+		return io_uring_add_event_source(ctx, ievent_source);
+#endif
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void usbi_event_engine_remove_event_source(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source)
+{
+#ifdef HAVE_EPOLL
+	if (usbi_using_epoll(ctx))
+		epoll_remove_event_source(ctx, ievent_source);
+#endif
+#ifdef HAVE_IO_URING
+	if (usbi_using_io_uring(ctx))
+		io_uring_remove_event_source(ctx, ievent_source);
+#endif
+}
+#endif
+
+/* Event data of a context, only accessed during event handling. The arrays
+ * have room for size event sources and are only reallocated when more event
+ * sources than that are added. fds and fds_user_data mirror the list of event
+ * sources when waiting with poll(), events receives the results of
+ * epoll_wait(). The event sources that reported events are collected in
+ * ready and handed to the backend, io_uring completions go there directly. */
+struct usbi_posix_event_data {
+	unsigned int size;
+	struct pollfd *fds;
+	void **fds_user_data;
+#ifdef HAVE_EPOLL
+	struct epoll_event *events;
+#endif
+	struct usbi_ready_event *ready;
+
+	/* poll set of usbi_wait_for_multi_events() when the context comes
+	 * first, with the index of the context owning each entry */
+	unsigned int multi_size;
+	struct pollfd *multi_fds;
+	unsigned int *multi_owner;
+};
+
+static int grow_event_data(struct libusb_context *ctx, struct usbi_posix_event_data *data,
+	unsigned int size)
+{
+	void *p;
+
+	if (usbi_using_epoll(ctx)) {
+#ifdef HAVE_EPOLL
+		p = realloc(data->events, size * sizeof(*data->events));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		data->events = p;
+#endif
+	} else if (!usbi_using_io_uring(ctx)) {
+		p = realloc(data->fds, size * sizeof(*data->fds));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		data->fds = p;
+
+		p = realloc(data->fds_user_data, size * sizeof(*data->fds_user_data));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		data->fds_user_data = p;
+	}
+
+	p = realloc(data->ready, size * sizeof(*data->ready));
+	if (!p)
+		return LIBUSB_ERROR_NO_MEM;
+	data->ready = p;
+
+	data->size = size;
+	return 0;
+}
+
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
+	struct usbi_posix_event_data *data = ctx->event_data;
 	struct usbi_event_source *ievent_source;
-	struct pollfd *fds;
-	size_t i = 0;
+	unsigned int cnt = 0;
+	unsigned int i = 0;
+	int r;
 
-	if (ctx->event_data) {
-		free(ctx->event_data);
-		ctx->event_data = NULL;
+	if (!data) {
+		data = calloc(1, sizeof(*data));
+		if (!data)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->event_data = data;
 	}
 
-	ctx->event_data_cnt = 0;
 	for_each_event_source(ctx, ievent_source)
-		ctx->event_data_cnt++;
+		cnt++;
 
-	fds = calloc(ctx->event_data_cnt, sizeof(*fds));
-	if (!fds)
-		return LIBUSB_ERROR_NO_MEM;
+	if (cnt > data->size) {
+		r = grow_event_data(ctx, data, MAX(cnt, 2 * data->size));
+		if (r)
+			return r;
+	}
+	ctx->event_data_cnt = cnt;
+
+	/* with an event engine the event sources are registered with the kernel
+	 * as they are added and removed, nothing to rebuild */
+	if (usbi_using_event_engine(ctx))
+		return 0;
 
 	for_each_event_source(ctx, ievent_source) {
-		fds[i].fd = ievent_source->data.os_handle;
-		fds[i].events = ievent_source->data.poll_events;
+		data->fds[i].fd = ievent_source->data.os_handle;
+		data->fds[i].events = ievent_source->data.poll_events;
+		data->fds_user_data[i] = ievent_source->user_data;
 		i++;
 	}
 
-	ctx->event_data = fds;
 	return 0;
 }
 
-int usbi_wait_for_events(struct libusb_context *ctx,
+/* allocate the event data for up to size event sources up front and lock it
+ * in memory, for the real-time profile */
+int usbi_reserve_event_data(struct libusb_context *ctx, unsigned int size)
+{
+	struct usbi_posix_event_data *data;
+	int r, failed;
+
+	data = calloc(1, sizeof(*data));
+	if (!data)
+		return LIBUSB_ERROR_NO_MEM;
+	ctx->event_data = data;
+
+	r = grow_event_data(ctx, data, size);
+	if (r)
+		return r;
+
+	failed = usbi_lock_memory(data, sizeof(*data)) != 0;
+	if (data->fds) {
+		failed |= usbi_lock_memory(data->fds, size * sizeof(*data->fds)) != 0;
+		failed |= usbi_lock_memory(data->fds_user_data, size * sizeof(*data->fds_user_data)) != 0;
+	}
+#ifdef HAVE_EPOLL
+	if (data->events)
+		failed |= usbi_lock_memory(data->events, size * sizeof(*data->events)) != 0;
+#endif
+	failed |= usbi_lock_memory(data->ready, size * sizeof(*data->ready)) != 0;
+	if (failed)
+		usbi_warn(ctx, "could not lock event data in memory");
+
+	return 0;
+}
+
+/* keep memory that the steady state uses resident */
+int usbi_lock_memory(void *mem, size_t len)
+{
+	return mlock(mem, len) == 0 ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	struct usbi_posix_event_data *data = ctx->event_data;
+
+	if (!data)
+		return;
+
+	free(data->fds);
+	free(data->fds_user_data);
+#ifdef HAVE_EPOLL
+	free(data->events);
+#endif
+	free(data->ready);
+	free(data->multi_fds);
+	free(data->multi_owner);
+	free(data);
+	ctx->event_data = NULL;
+}
+
+static int wait_poll(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms)
 {
-	struct pollfd *fds = ctx->event_data;
+	struct usbi_posix_event_data *data = ctx->event_data;
+	struct pollfd *fds = data->fds;
 	usbi_nfds_t nfds = (usbi_nfds_t)ctx->event_data_cnt;
-	int internal_fds, num_ready;
+	usbi_nfds_t n;
+	int internal_fds, num_ready, num_reported = 0;
 
 	usbi_dbg(ctx, "poll() %u fds with timeout in %dms", (unsigned int)nfds, timeout_ms);
 #ifdef __EMSCRIPTEN__
@@ -276,7 +913,7 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	usbi_dbg(ctx, "poll() returned %d", num_ready);
 	if (num_ready == 0) {
 		if (usbi_using_timer(ctx))
-			goto done;
+			return 0;
 		return LIBUSB_ERROR_TIMEOUT;
 	} else if (num_ready == -1) {
 		if (errno == EINTR)
@@ -303,34 +940,239 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	}
 #endif
 
-	if (!num_ready)
-		goto done;
-
 	/* the backend will never need to attempt to handle events on the
 	 * library's internal file descriptors, so we determine how many are
-	 * in use internally for this context and skip these when passing any
-	 * remaining pollfds to the backend. */
+	 * in use internally for this context and skip these when collecting
+	 * the ready event sources for the backend. */
 	internal_fds = usbi_using_timer(ctx) ? 2 : 1;
-	fds += internal_fds;
-	nfds -= internal_fds;
+	for (n = (usbi_nfds_t)internal_fds; n < nfds && num_reported < num_ready; n++) {
+		if (!fds[n].revents)
+			continue;
+		data->ready[num_reported].user_data = data->fds_user_data[n];
+		data->ready[num_reported].revents = fds[n].revents;
+		num_reported++;
+	}
+
+	return num_reported;
+}
+
+#ifdef HAVE_EPOLL
+static int wait_epoll(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_posix_event_data *data = ctx->event_data;
+	int i, num_ready, num_reported = 0;
+
+	usbi_dbg(ctx, "epoll_wait() %u fds with timeout in %dms", ctx->event_data_cnt, timeout_ms);
+	num_ready = epoll_wait(ctx->epoll_fd, data->events, (int)data->size, timeout_ms);
+	usbi_dbg(ctx, "epoll_wait() returned %d", num_ready);
+	if (num_ready == 0) {
+		if (usbi_using_timer(ctx))
+			return 0;
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_ready == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "epoll_wait() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	reported_events->event_triggered = 0;
+#ifdef HAVE_OS_TIMER
+	reported_events->timer_triggered = 0;
+#endif
+
+	/* the internal event sources were added with pointers to the event and
+	 * the timer as their user data */
+	for (i = 0; i < num_ready; i++) {
+		void *user_data = data->events[i].data.ptr;
+
+		if (user_data == &ctx->event) {
+			reported_events->event_triggered = 1;
+			continue;
+		}
+#ifdef HAVE_OS_TIMER
+		if (user_data == &ctx->timer) {
+			reported_events->timer_triggered = 1;
+			continue;
+		}
+#endif
+		data->ready[num_reported].user_data = user_data;
+		data->ready[num_reported].revents = (short)data->events[i].events;
+		num_reported++;
+	}
+
+	return num_reported;
+}
+#endif
+
+#ifdef HAVE_IO_URING
+/* must be called with event_data_lock held */
+static void io_uring_poll_terminated(struct libusb_context *ctx,
+	struct usbi_event_source *ievent_source, int res)
+{
+	ievent_source->engine_busy = 0;
+
+	if (ievent_source->removed) {
+		/* let the next handle_events() free it */
+		ctx->event_flags |= USBI_EVENT_EVENT_SOURCES_MODIFIED;
+		return;
+	}
+
+	/* the kernel ends a multishot poll when the completion queue overflows
+	 * or when the thread that armed it exits, arm it again from here */
+	if (res >= 0 || res == -ECANCELED) {
+		if (ring_poll_add(ctx->io_uring, ievent_source) == 0)
+			return;
+	}
+
+	usbi_err(ctx, "stopped polling fd %d with io_uring, res=%d",
+		 ievent_source->data.os_handle, res);
+}
+
+/* reaps the batch of completions that is in the completion queue. multishot
+ * polls stay armed, so nothing is submitted here unless the kernel ended
+ * one of them. */
+static int reap_io_uring(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events)
+{
+	struct usbi_posix_event_data *data = ctx->event_data;
+	struct usbi_io_uring *ring = ctx->io_uring;
+	unsigned int head = *ring->cq_khead;
+	unsigned int tail = __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE);
+	int num_reported = 0;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	while (head != tail && num_reported < (int)data->size) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		uint64_t user_data = cqe->user_data;
+		struct usbi_event_source *ievent_source;
+		int i, res = cqe->res;
+
+		if (user_data & IO_URING_TAG_MASK) {
+			if ((user_data & IO_URING_TAG_MASK) == IO_URING_TAG_TIMER &&
+			    ring_timer_completion(ring, user_data, res)) {
+#ifdef HAVE_OS_TIMER
+				reported_events->timer_triggered = 1;
+#endif
+			}
+			head++;
+			continue;
+		}
+
+		ievent_source = (struct usbi_event_source *)(uintptr_t)user_data;
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			io_uring_poll_terminated(ctx, ievent_source, res);
+		head++;
+
+		/* whether the internal event is signalled is decided below */
+		if (res <= 0 || ievent_source->removed || ievent_source->user_data == &ctx->event)
+			continue;
+
+		/* an event source may complete several times per batch */
+		for (i = 0; i < num_reported; i++) {
+			if (data->ready[i].user_data == ievent_source->user_data)
+				break;
+		}
+		if (i < num_reported) {
+			data->ready[i].revents |= (short)res;
+			continue;
+		}
+
+		data->ready[num_reported].user_data = ievent_source->user_data;
+		data->ready[num_reported].revents = (short)res;
+		num_reported++;
+	}
+	__atomic_store_n(ring->cq_khead, head, __ATOMIC_RELEASE);
+
+	/* the poll of the internal event completes when the event is signalled,
+	 * not for as long as it stays signalled, and its completions may be
+	 * stale. the event is signalled for as long as events are pending. */
+	reported_events->event_triggered = ctx->event_flags ? 1 : 0;
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	return num_reported;
+}
+
+static int wait_io_uring(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_io_uring *ring = ctx->io_uring;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int r, num_reported;
+
+	num_reported = reap_io_uring(ctx, reported_events);
+	if (num_reported || reported_events->event_bits)
+		return num_reported;
+
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+
+	usbi_dbg(ctx, "io_uring_enter() %u fds with timeout in %dms", ctx->event_data_cnt, timeout_ms);
+	r = sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(arg));
+	usbi_dbg(ctx, "io_uring_enter() returned %d", r);
+	if (r == -1 && errno != ETIME) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "io_uring_enter() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	num_reported = reap_io_uring(ctx, reported_events);
+	if (!num_reported && !reported_events->event_bits) {
+		if (usbi_using_timer(ctx))
+			return 0;
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	return num_reported;
+}
+#endif
+
+int usbi_wait_for_events(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_posix_event_data *data = ctx->event_data;
+	unsigned int num_ready;
+	int r;
+
+#ifdef HAVE_EPOLL
+	if (usbi_using_epoll(ctx))
+		r = wait_epoll(ctx, reported_events, timeout_ms);
+	else
+#endif
+#ifdef HAVE_IO_URING
+	if (usbi_using_io_uring(ctx))
+		r = wait_io_uring(ctx, reported_events, timeout_ms);
+	else
+#endif
+		r = wait_poll(ctx, reported_events, timeout_ms);
+	if (r < 0)
+		return r;
+
+	num_ready = (unsigned int)r;
+	if (!num_ready)
+		goto done;
 
 	usbi_mutex_lock(&ctx->event_data_lock);
 	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
 		struct usbi_event_source *ievent_source;
 
 		for_each_removed_event_source(ctx, ievent_source) {
-			usbi_nfds_t n;
+			unsigned int n;
 
-			for (n = 0; n < nfds; n++) {
-				if (ievent_source->data.os_handle != fds[n].fd)
-					continue;
-				if (!fds[n].revents)
+			for (n = 0; n < num_ready; n++) {
+				if (ievent_source->user_data != data->ready[n].user_data)
 					continue;
-				/* pollfd was removed between the creation of the fds array and
-				 * here. remove triggered revent as it is no longer relevant. */
-				usbi_dbg(ctx, "fd %d was removed, ignoring raised events", fds[n].fd);
-				fds[n].revents = 0;
-				num_ready--;
+				/* event source was removed between the start of the wait and
+				 * here. drop the reported events as they are no longer relevant. */
+				usbi_dbg(ctx, "fd %d was removed, ignoring raised events",
+					 ievent_source->data.os_handle);
+				data->ready[n] = data->ready[--num_ready];
 				break;
 			}
 		}
@@ -338,12 +1180,205 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 	if (num_ready) {
-		assert(num_ready > 0);
-		reported_events->event_data = fds;
-		reported_events->event_data_count = (unsigned int)nfds;
+		reported_events->event_data = data->ready;
+		reported_events->event_data_count = num_ready;
 	}
 
 done:
 	reported_events->num_ready = num_ready;
 	return LIBUSB_SUCCESS;
 }
+
+/* Wait for any of the event sources of several contexts with a single poll().
+ * A context waiting with an event engine is represented by the file
+ * descriptor of the engine, which is readable whenever one of its event
+ * sources is ready. On return, ready[i] is set for the contexts that have
+ * events to handle and left alone for the others. */
+int usbi_wait_for_multi_events(struct libusb_context **ctxs, unsigned int n,
+	unsigned char *ready, int timeout_ms)
+{
+	struct usbi_posix_event_data *multi = ctxs[0]->event_data;
+	struct pollfd *fds;
+	unsigned int *owner;
+	usbi_nfds_t nfds = 0;
+	unsigned int i, j, cnt = 0;
+	int num_ready, r = LIBUSB_SUCCESS;
+	void *p;
+
+	for (i = 0; i < n; i++)
+		cnt += usbi_using_event_engine(ctxs[i]) ? 1 : ctxs[i]->event_data_cnt;
+
+	/* the poll set is kept by the first context from one call to the
+	 * next, its events lock is held */
+	if (cnt > multi->multi_size) {
+		unsigned int size = MAX(cnt, 2 * multi->multi_size);
+
+		p = realloc(multi->multi_fds, size * sizeof(*multi->multi_fds));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		multi->multi_fds = p;
+
+		p = realloc(multi->multi_owner, size * sizeof(*multi->multi_owner));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		multi->multi_owner = p;
+
+		multi->multi_size = size;
+	}
+	fds = multi->multi_fds;
+	owner = multi->multi_owner;
+
+	for (i = 0; i < n; i++) {
+		struct libusb_context *ctx = ctxs[i];
+
+		if (usbi_using_event_engine(ctx)) {
+#ifdef HAVE_EPOLL
+			if (usbi_using_epoll(ctx))
+				fds[nfds].fd = ctx->epoll_fd;
+#endif
+#ifdef HAVE_IO_URING
+			if (usbi_using_io_uring(ctx))
+				fds[nfds].fd = usbi_io_uring_fd(ctx);
+#endif
+			fds[nfds].events = POLLIN;
+			owner[nfds++] = i;
+		} else {
+			struct usbi_posix_event_data *data = ctx->event_data;
+
+			for (j = 0; j < ctx->event_data_cnt; j++) {
+				fds[nfds] = data->fds[j];
+				owner[nfds++] = i;
+			}
+		}
+	}
+
+	usbi_dbg(ctxs[0], "poll() %u fds of %u contexts with timeout in %dms",
+		 (unsigned int)nfds, n, timeout_ms);
+	num_ready = poll(fds, nfds, timeout_ms);
+	usbi_dbg(ctxs[0], "poll() returned %d", num_ready);
+	if (num_ready == 0) {
+		r = LIBUSB_ERROR_TIMEOUT;
+	} else if (num_ready == -1) {
+		if (errno == EINTR) {
+			r = LIBUSB_ERROR_INTERRUPTED;
+		} else {
+			usbi_err(ctxs[0], "poll() failed, errno=%d", errno);
+			r = LIBUSB_ERROR_IO;
+		}
+	} else {
+		for (i = 0; i < (unsigned int)nfds; i++) {
+			if (fds[i].revents)
+				ready[owner[i]] = 1;
+		}
+	}
+
+	return r;
+}
+
+/* The event data of a shard is built for poll() whatever the event engine of
+ * the context, with the event of the shard in fds[0] followed by the event
+ * sources of its device handles. */
+int usbi_alloc_shard_event_data(struct usbi_event_shard *shard)
+{
+	struct usbi_posix_event_data *data = shard->event_data;
+	struct usbi_event_source *ievent_source;
+	unsigned int cnt = 1;
+	unsigned int i = 1;
+	void *p;
+
+	if (!data) {
+		data = calloc(1, sizeof(*data));
+		if (!data)
+			return LIBUSB_ERROR_NO_MEM;
+		shard->event_data = data;
+	}
+
+	list_for_each_entry(ievent_source, &shard->event_sources, list, struct usbi_event_source)
+		cnt++;
+
+	if (cnt > data->size) {
+		unsigned int size = MAX(cnt, 2 * data->size);
+
+		p = realloc(data->fds, size * sizeof(*data->fds));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		data->fds = p;
+
+		p = realloc(data->fds_user_data, size * sizeof(*data->fds_user_data));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		data->fds_user_data = p;
+
+		p = realloc(data->ready, size * sizeof(*data->ready));
+		if (!p)
+			return LIBUSB_ERROR_NO_MEM;
+		data->ready = p;
+
+		data->size = size;
+	}
+
+	data->fds[0].fd = USBI_EVENT_OS_HANDLE(&shard->event);
+	data->fds[0].events = USBI_EVENT_POLL_EVENTS;
+	data->fds_user_data[0] = NULL;
+	list_for_each_entry(ievent_source, &shard->event_sources, list, struct usbi_event_source) {
+		data->fds[i].fd = ievent_source->data.os_handle;
+		data->fds[i].events = ievent_source->data.poll_events;
+		data->fds_user_data[i] = ievent_source->user_data;
+		i++;
+	}
+	shard->event_data_cnt = cnt;
+
+	return 0;
+}
+
+void usbi_free_shard_event_data(struct usbi_event_shard *shard)
+{
+	struct usbi_posix_event_data *data = shard->event_data;
+
+	if (!data)
+		return;
+
+	free(data->fds);
+	free(data->fds_user_data);
+	free(data->ready);
+	free(data);
+	shard->event_data = NULL;
+}
+
+int usbi_wait_for_shard_events(struct usbi_event_shard *shard,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_posix_event_data *data = shard->event_data;
+	struct pollfd *fds = data->fds;
+	usbi_nfds_t nfds = (usbi_nfds_t)shard->event_data_cnt;
+	usbi_nfds_t n;
+	int num_ready, num_reported = 0;
+
+	num_ready = poll(fds, nfds, timeout_ms);
+	if (num_ready == 0) {
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_ready == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(shard->ctx, "poll() failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	if (fds[0].revents) {
+		reported_events->event_triggered = 1;
+		num_ready--;
+	}
+
+	for (n = 1; n < nfds && num_reported < num_ready; n++) {
+		if (!fds[n].revents)
+			continue;
+		data->ready[num_reported].user_data = data->fds_user_data[n];
+		data->ready[num_reported].revents = fds[n].revents;
+		num_reported++;
+	}
+
+	reported_events->event_data = data->ready;
+	reported_events->event_data_count = (unsigned int)num_reported;
+	reported_events->num_ready = (unsigned int)num_reported;
+	return LIBUSB_SUCCESS;
+}
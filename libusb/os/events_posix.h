@@ -42,16 +42,29 @@ typedef struct usbi_event {
 #define USBI_INVALID_EVENT	{ { -1, -1 } }
 #endif
 
+#if defined(HAVE_EPOLL) || defined(HAVE_IO_URING)
+#define HAVE_OS_EVENT_ENGINE 1
+#endif
+
 #ifdef HAVE_TIMERFD
 #define HAVE_OS_TIMER 1
 typedef struct usbi_timer {
 	int timerfd;
+#ifdef HAVE_IO_URING
+	/* set when the timer is a timeout on the context's io_uring instead
+	 * of a timerfd */
+	struct usbi_io_uring *io_uring;
+#endif
 } usbi_timer_t;
 #define USBI_TIMER_OS_HANDLE(t)	((t)->timerfd)
 #define USBI_TIMER_POLL_EVENTS	POLLIN
 
 static inline int usbi_timer_valid(usbi_timer_t *timer)
 {
+#ifdef HAVE_IO_URING
+	if (timer->io_uring)
+		return 1;
+#endif
 	return timer->timerfd >= 0;
 }
 #endif
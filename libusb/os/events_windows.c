@@ -164,6 +164,27 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	return 0;
 }
 
+/* the event data only ever covers the internal event and the timer, which is
+ * allocated once in usbi_alloc_event_data() */
+int usbi_reserve_event_data(struct libusb_context *ctx, unsigned int size)
+{
+	UNUSED(ctx);
+	UNUSED(size);
+	return 0;
+}
+
+/* keep memory that the steady state uses resident */
+int usbi_lock_memory(void *mem, size_t len)
+{
+	return VirtualLock(mem, len) ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+void usbi_free_event_data(struct libusb_context *ctx)
+{
+	free(ctx->event_data);
+	ctx->event_data = NULL;
+}
+
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms)
 {
@@ -212,3 +233,35 @@ done:
 	reported_events->num_ready = 0;
 	return LIBUSB_SUCCESS;
 }
+
+int usbi_wait_for_multi_events(struct libusb_context **ctxs, unsigned int n,
+	unsigned char *ready, int timeout_ms)
+{
+	UNUSED(ctxs);
+	UNUSED(n);
+	UNUSED(ready);
+	UNUSED(timeout_ms);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+/* Event shards need a backend adding event sources per device handle, which
+ * no Windows backend does */
+int usbi_alloc_shard_event_data(struct usbi_event_shard *shard)
+{
+	UNUSED(shard);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void usbi_free_shard_event_data(struct usbi_event_shard *shard)
+{
+	UNUSED(shard);
+}
+
+int usbi_wait_for_shard_events(struct usbi_event_shard *shard,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	UNUSED(shard);
+	UNUSED(reported_events);
+	UNUSED(timeout_ms);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
@@ -210,6 +210,11 @@ const struct usbi_os_backend usbi_backend = {
 
 	/*.dev_mem_alloc =*/ NULL,
 	/*.dev_mem_free =*/ NULL,
+	/*.numa_bind_memory =*/ NULL,
+	/*.numa_bind_thread =*/ NULL,
+
+	/*.sync_control_transfer =*/ NULL,
+	/*.sync_bulk_transfer =*/ NULL,
 
 	/*.kernel_driver_active =*/ NULL,
 	/*.detach_kernel_driver =*/ NULL,
@@ -220,8 +225,10 @@ const struct usbi_os_backend usbi_backend = {
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
 	/*.clear_transfer_priv =*/ NULL,
+	/*.destroy_transfer =*/ NULL,
 
 	/*.handle_events =*/ NULL,
+	/*.busy_poll =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
 
 	/*.context_priv_size =*/ 0,
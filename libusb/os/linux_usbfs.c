@@ -34,6 +34,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
 #include <sys/vfs.h>
 #include <unistd.h>
@@ -119,6 +120,15 @@ struct config_descriptor {
 struct linux_context_priv {
 	/* no enumeration or hot-plug detection */
 	int no_device_discovery;
+
+	/* rotates the device that is served first in op_handle_events(), which
+	 * the event handlers of several event shards may run at once */
+	usbi_atomic_t reap_rotor;
+
+	/* device handles op_busy_poll() reaps without holding open_devs_lock,
+	 * only used by the event handler */
+	struct libusb_device_handle **busy_poll_handles;
+	size_t busy_poll_size;
 };
 
 struct linux_device_priv {
@@ -152,19 +162,40 @@ enum reap_action {
 	ERROR,
 };
 
+/* distance between the isochronous URBs of a transfer, enough for a URB
+ * with the largest number of packets usbfs accepts */
+#define ISO_URB_STRIDE	(sizeof(struct usbfs_urb) + \
+	MAX_ISO_PACKETS_PER_URB * sizeof(struct usbfs_iso_packet_desc))
+
 struct linux_transfer_priv {
+	/* URBs of the submission in flight, NULL if there is none */
 	union {
 		struct usbfs_urb *urbs;
-		struct usbfs_urb **iso_urbs;
+		unsigned char *iso_urbs;
 	};
 
+	/* URB storage for control, bulk and interrupt transfers, kept across
+	 * submissions. Single URB submissions use the inline URB (last, as
+	 * it ends with a zero-length array), split transfers use urb_storage
+	 * which only ever grows. */
+	struct usbfs_urb *urb_storage;
+	int urb_storage_len;
+
+	/* URB storage for isochronous transfers, kept across submissions.
+	 * The URBs are laid out every ISO_URB_STRIDE bytes so that the index
+	 * of a reaped URB can be computed from its address. The packet
+	 * lengths of the last submission of iso_layout_packets packets are
+	 * left in place and only rewritten when they change. */
+	unsigned char *iso_arena;
+	size_t iso_arena_size;
+	int iso_layout_packets;
+
 	enum reap_action reap_action;
 	int num_urbs;
 	int num_retired;
 	enum libusb_transfer_status reap_status;
 
-	/* next iso packet in user-supplied transfer to be populated */
-	int iso_packet_offset;
+	struct usbfs_urb urb;
 };
 
 static int dev_has_config0(struct libusb_device *dev)
@@ -426,6 +457,8 @@ static void op_exit(struct libusb_context *ctx)
 {
 	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 
+	free(cpriv->busy_poll_handles);
+
 	if (cpriv->no_device_discovery) {
 		return;
 	}
@@ -564,6 +597,47 @@ static int read_sysfs_attr(struct libusb_context *ctx,
 	return 0;
 }
 
+/* The NUMA node of a device is the one of the host controller it is attached
+ * to, which is the closest ancestor in /sys/devices with a numa_node
+ * attribute. Returns -1 if no ancestor has one, or if the kernel reports -1
+ * itself because the system has a single node. */
+static int sysfs_get_numa_node(const char *sysfs_dir)
+{
+	const size_t devices_len = strlen(SYSFS_MOUNT_PATH "/devices");
+	char link[PATH_MAX], *path, *slash;
+	char buf[16];
+	size_t len;
+	ssize_t r;
+	int fd;
+
+	snprintf(link, sizeof(link), SYSFS_DEVICE_PATH "/%s", sysfs_dir);
+	path = realpath(link, NULL);
+	if (!path)
+		return -1;
+
+	len = strlen(path);
+	while (len > devices_len && strncmp(path, SYSFS_MOUNT_PATH "/devices/", devices_len + 1) == 0) {
+		snprintf(link, sizeof(link), "%s/numa_node", path);
+		fd = open(link, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			r = read(fd, buf, sizeof(buf) - 1);
+			close(fd);
+			free(path);
+			if (r <= 0)
+				return -1;
+			buf[r] = '\0';
+			return (int)strtol(buf, NULL, 10);
+		}
+
+		slash = strrchr(path, '/');
+		*slash = '\0';
+		len = (size_t)(slash - path);
+	}
+
+	free(path);
+	return -1;
+}
+
 static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
 {
 	uint8_t busnum, devaddr;
@@ -932,6 +1006,8 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 				usbi_warn(ctx, "unknown device speed: %d Mbps", speed);
 			}
 		}
+
+		dev->numa_node = sysfs_get_numa_node(sysfs_dir);
 	} else if (wrapped_fd >= 0) {
 		dev->speed = usbfs_get_speed(ctx, wrapped_fd);
 	}
@@ -1339,7 +1415,7 @@ static int initialize_handle(struct libusb_device_handle *handle, int fd)
 		hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	return usbi_add_handle_event_source(handle, hpriv->fd, POLLOUT, handle);
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1425,7 +1501,7 @@ static void op_close(struct libusb_device_handle *dev_handle)
 
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
-		usbi_remove_event_source(HANDLE_CTX(dev_handle), hpriv->fd);
+		usbi_remove_handle_event_source(dev_handle, hpriv->fd);
 	if (!hpriv->fd_keep)
 		close(hpriv->fd);
 }
@@ -1696,6 +1772,66 @@ static int op_dev_mem_free(struct libusb_device_handle *handle, void *buffer,
 	}
 }
 
+#ifdef SYS_mbind
+/* from <linux/mempolicy.h> */
+#define MPOL_PREFERRED		1
+#define MPOL_MF_MOVE		(1 << 1)
+
+#define MAX_NUMA_NODES		1024
+
+static void op_numa_bind_memory(struct libusb_device *dev, void *mem, size_t len)
+{
+	unsigned long nodemask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+	const uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t start, end;
+	int node = dev->numa_node;
+
+	if (node >= MAX_NUMA_NODES)
+		return;
+
+	/* only the pages entirely within the memory, the others may be shared
+	 * with unrelated allocations */
+	start = ((uintptr_t)mem + page_size - 1) & ~(page_size - 1);
+	end = ((uintptr_t)mem + len) & ~(page_size - 1);
+	if (start >= end)
+		return;
+
+	nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_mbind, (void *)start, (unsigned long)(end - start), MPOL_PREFERRED,
+		    nodemask, (unsigned long)MAX_NUMA_NODES + 1, MPOL_MF_MOVE) != 0)
+		usbi_dbg(DEVICE_CTX(dev), "mbind to node %d failed, errno=%d", node, errno);
+}
+#endif
+
+#ifndef __ANDROID__
+static int op_numa_bind_thread(struct libusb_context *ctx, usbi_thread_t thread,
+	int node)
+{
+	char path[64], buf[1024];
+	struct usbi_cpu_set cpus;
+	int fd;
+	ssize_t r;
+
+	snprintf(path, sizeof(path), SYSFS_MOUNT_PATH "/devices/system/node/node%d/cpulist", node);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r < 0) {
+		usbi_err(ctx, "read %s failed, errno=%d", path, errno);
+		return LIBUSB_ERROR_IO;
+	}
+	buf[r] = '\0';
+
+	if (usbi_parse_cpu_list(buf, &cpus) <= 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	return usbi_thread_set_affinity(thread, &cpus);
+}
+#endif
+
 static int op_kernel_driver_active(struct libusb_device_handle *handle,
 	uint8_t interface)
 {
@@ -1865,7 +2001,7 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 
 	for (i = last_plus_one - 1; i >= first; i--) {
 		if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
-			urb = tpriv->iso_urbs[i];
+			urb = (struct usbfs_urb *)(tpriv->iso_urbs + i * ISO_URB_STRIDE);
 		else
 			urb = &tpriv->urbs[i];
 
@@ -1887,20 +2023,28 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
-static void free_iso_urbs(struct linux_transfer_priv *tpriv)
+/* returns num_urbs cleared URBs from the storage kept with the transfer,
+ * growing it if needed */
+static struct usbfs_urb *get_urbs(struct linux_transfer_priv *tpriv, int num_urbs)
 {
-	int i;
-
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+	struct usbfs_urb *urbs;
 
-		if (!urb)
-			break;
-		free(urb);
+	if (num_urbs == 1) {
+		urbs = &tpriv->urb;
+	} else {
+		if (num_urbs > tpriv->urb_storage_len) {
+			urbs = malloc(num_urbs * sizeof(*urbs));
+			if (!urbs)
+				return NULL;
+			free(tpriv->urb_storage);
+			tpriv->urb_storage = urbs;
+			tpriv->urb_storage_len = num_urbs;
+		}
+		urbs = tpriv->urb_storage;
 	}
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	memset(urbs, 0, num_urbs * sizeof(*urbs));
+	return urbs;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
@@ -1969,7 +2113,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		num_urbs++;
 	}
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	urbs = get_urbs(tpriv, num_urbs);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urbs;
@@ -2034,7 +2178,6 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free(urbs);
 			tpriv->urbs = NULL;
 			return r;
 		}
@@ -2082,11 +2225,13 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	struct linux_device_handle_priv *hpriv =
 		usbi_get_device_handle_priv(transfer->dev_handle);
-	struct usbfs_urb **urbs;
+	struct usbfs_urb *urb;
 	int num_packets = transfer->num_iso_packets;
 	int num_packets_remaining;
 	int i, j;
 	int num_urbs;
+	int layout_valid;
+	size_t arena_size;
 	unsigned int packet_len;
 	unsigned int total_len = 0;
 	unsigned char *urb_buffer = transfer->buffer;
@@ -2094,6 +2239,10 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	if (num_packets < 1)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
+	/* usbfs limits the number of iso packets per URB */
+	num_urbs = (num_packets + (MAX_ISO_PACKETS_PER_URB - 1)) / MAX_ISO_PACKETS_PER_URB;
+	layout_valid = tpriv->iso_layout_packets == num_packets;
+
 	/* usbfs places arbitrary limits on iso URBs. this limit has changed
 	 * at least three times, but we attempt to detect this limit during
 	 * init and check it here. if the kernel rejects the request due to
@@ -2109,49 +2258,57 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 			return LIBUSB_ERROR_INVALID_PARAM;
 		}
 
+		/* compare against the packet lengths left in the URBs by the
+		 * previous submission */
+		if (layout_valid) {
+			urb = (struct usbfs_urb *)(tpriv->iso_arena +
+				(i / MAX_ISO_PACKETS_PER_URB) * ISO_URB_STRIDE);
+			if (urb->iso_frame_desc[i % MAX_ISO_PACKETS_PER_URB].length != packet_len)
+				layout_valid = 0;
+		}
+
 		total_len += packet_len;
 	}
 
 	if (transfer->length < (int)total_len)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	/* usbfs limits the number of iso packets per URB */
-	num_urbs = (num_packets + (MAX_ISO_PACKETS_PER_URB - 1)) / MAX_ISO_PACKETS_PER_URB;
-
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
 
-	urbs = calloc(num_urbs, sizeof(*urbs));
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
+	arena_size = (size_t)(num_urbs - 1) * ISO_URB_STRIDE + sizeof(*urb) +
+		(size_t)(num_packets - (num_urbs - 1) * MAX_ISO_PACKETS_PER_URB) *
+		sizeof(struct usbfs_iso_packet_desc);
+	if (arena_size > tpriv->iso_arena_size) {
+		unsigned char *arena = malloc(arena_size);
+
+		if (!arena)
+			return LIBUSB_ERROR_NO_MEM;
+		free(tpriv->iso_arena);
+		tpriv->iso_arena = arena;
+		tpriv->iso_arena_size = arena_size;
+		layout_valid = 0;
+	}
 
-	tpriv->iso_urbs = urbs;
+	tpriv->iso_urbs = tpriv->iso_arena;
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
-	tpriv->iso_packet_offset = 0;
 
-	/* allocate + initialize each URB with the correct number of packets */
+	/* initialize each URB with the correct number of packets, the packet
+	 * lengths and buffer sizes are only filled in if they changed */
 	num_packets_remaining = num_packets;
 	for (i = 0, j = 0; i < num_urbs; i++) {
 		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
-		struct usbfs_urb *urb;
-		size_t alloc_size;
 		int k;
 
-		alloc_size = sizeof(*urb)
-			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
-		urbs[i] = urb;
-
-		/* populate packet lengths */
-		for (k = 0; k < num_packets_in_urb; j++, k++) {
-			packet_len = transfer->iso_packet_desc[j].length;
-			urb->buffer_length += packet_len;
-			urb->iso_frame_desc[k].length = packet_len;
+		urb = (struct usbfs_urb *)(tpriv->iso_urbs + i * ISO_URB_STRIDE);
+		if (!layout_valid) {
+			urb->buffer_length = 0;
+			for (k = 0; k < num_packets_in_urb; j++, k++) {
+				packet_len = transfer->iso_packet_desc[j].length;
+				urb->buffer_length += packet_len;
+				urb->iso_frame_desc[k].length = packet_len;
+			}
 		}
 
 		urb->usercontext = itransfer;
@@ -2159,16 +2316,22 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		/* FIXME: interface for non-ASAP data? */
 		urb->flags = USBFS_URB_ISO_ASAP;
 		urb->endpoint = transfer->endpoint;
+		urb->status = 0;
+		urb->actual_length = 0;
+		urb->start_frame = 0;
 		urb->number_of_packets = num_packets_in_urb;
+		urb->error_count = 0;
+		urb->signr = 0;
 		urb->buffer = urb_buffer;
 
 		urb_buffer += urb->buffer_length;
 		num_packets_remaining -= num_packets_in_urb;
 	}
+	tpriv->iso_layout_packets = num_packets;
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, tpriv->iso_urbs + i * ISO_URB_STRIDE);
 
 		if (r == 0)
 			continue;
@@ -2190,7 +2353,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free_iso_urbs(tpriv);
+			tpriv->iso_urbs = NULL;
 			return r;
 		}
 
@@ -2235,9 +2398,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(*urb));
-	if (!urb)
-		return LIBUSB_ERROR_NO_MEM;
+	urb = get_urbs(tpriv, 1);
 	tpriv->urbs = urb;
 	tpriv->num_urbs = 1;
 	tpriv->reap_action = NORMAL;
@@ -2250,7 +2411,6 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2282,6 +2442,84 @@ static int op_submit_transfer(struct usbi_transfer *itransfer)
 	}
 }
 
+/* translate the errno of a synchronous control or bulk request the way the
+ * status of the equivalent URB is translated when it is reaped */
+static int sync_transfer_error(struct libusb_device_handle *handle, int err)
+{
+	switch (err) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	case EINVAL:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	default:
+		usbi_dbg(HANDLE_CTX(handle), "synchronous request failed, errno=%d", err);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_ctrltransfer ctrl;
+	int r;
+
+	/* leave the rejection of oversized requests to the regular path */
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctrl.bmRequestType = bmRequestType;
+	ctrl.bRequest = bRequest;
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_transfer_error(handle, errno);
+
+	return r;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_bulktransfer bulk;
+	int r;
+
+	/* the kernel copies the data through a single buffer of that size,
+	 * larger transfers are split or scattered by the regular path */
+	if (length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = (unsigned int)length;
+	bulk.timeout = timeout;
+	bulk.data = data;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_BULK, &bulk);
+	if (r < 0)
+		return sync_transfer_error(handle, errno);
+
+	*transferred = r;
+	return 0;
+}
+
 static int op_cancel_transfer(struct usbi_transfer *itransfer)
 {
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
@@ -2320,22 +2558,32 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		tpriv->urbs = NULL;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
-			free_iso_urbs(tpriv);
-			tpriv->iso_urbs = NULL;
-		}
+		tpriv->iso_urbs = NULL;
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer), "unknown transfer type %u", transfer->type);
 	}
 }
 
+static void op_destroy_transfer(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	free(tpriv->urb_storage);
+	tpriv->urb_storage = NULL;
+	tpriv->urb_storage_len = 0;
+	free(tpriv->iso_arena);
+	tpriv->iso_arena = NULL;
+	tpriv->iso_arena_size = 0;
+	tpriv->iso_layout_packets = 0;
+}
+
+/* The handle_*_completion() functions return 1 once the last URB of the
+ * transfer has been handled, leaving its outcome in reap_action and
+ * reap_status */
 static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
@@ -2465,12 +2713,9 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
-	return tpriv->reap_action == CANCELLED ?
-		usbi_handle_transfer_cancellation(itransfer) :
-		usbi_handle_transfer_completion(itransfer, tpriv->reap_status);
+	return 1;
 }
 
 static int handle_iso_completion(struct usbi_transfer *itransfer,
@@ -2480,32 +2725,34 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
 	int num_urbs = tpriv->num_urbs;
-	int urb_idx = 0;
+	int urb_idx = -1;
 	int i;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
+	struct libusb_iso_packet_descriptor *lib_descs;
 
 	usbi_mutex_lock(&itransfer->lock);
-	for (i = 0; i < num_urbs; i++) {
-		if (urb == tpriv->iso_urbs[i]) {
-			urb_idx = i + 1;
-			break;
-		}
+	if (tpriv->iso_urbs && (unsigned char *)urb >= tpriv->iso_urbs) {
+		size_t urb_offset = (size_t)((unsigned char *)urb - tpriv->iso_urbs);
+
+		if (urb_offset % ISO_URB_STRIDE == 0 &&
+		    urb_offset / ISO_URB_STRIDE < (size_t)num_urbs)
+			urb_idx = (int)(urb_offset / ISO_URB_STRIDE);
 	}
-	if (urb_idx == 0) {
+	if (urb_idx < 0) {
 		usbi_err(TRANSFER_CTX(transfer), "could not locate urb!");
 		usbi_mutex_unlock(&itransfer->lock);
 		return LIBUSB_ERROR_NOT_FOUND;
 	}
 
 	usbi_dbg(TRANSFER_CTX(transfer), "handling completion status %d of iso urb %d/%d", urb->status,
-		 urb_idx, num_urbs);
+		 urb_idx + 1, num_urbs);
 
 	/* copy isochronous results back in */
 
+	lib_descs = &transfer->iso_packet_desc[urb_idx * MAX_ISO_PACKETS_PER_URB];
 	for (i = 0; i < urb->number_of_packets; i++) {
 		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
-		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
+		struct libusb_iso_packet_descriptor *lib_desc = &lib_descs[i];
 
 		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
 		switch (urb_desc->status) {
@@ -2552,14 +2799,10 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 
 		if (tpriv->num_retired == num_urbs) {
 			usbi_dbg(TRANSFER_CTX(transfer), "CANCEL: last URB handled, reporting");
-			free_iso_urbs(tpriv);
-			if (tpriv->reap_action == CANCELLED) {
-				usbi_mutex_unlock(&itransfer->lock);
-				return usbi_handle_transfer_cancellation(itransfer);
-			} else {
-				usbi_mutex_unlock(&itransfer->lock);
-				return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_ERROR);
-			}
+			tpriv->iso_urbs = NULL;
+			tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
+			usbi_mutex_unlock(&itransfer->lock);
+			return 1;
 		}
 		goto out;
 	}
@@ -2583,9 +2826,10 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we've reaped all urbs then we're done */
 	if (tpriv->num_retired == num_urbs) {
 		usbi_dbg(TRANSFER_CTX(transfer), "all URBs in transfer reaped --> complete!");
-		free_iso_urbs(tpriv);
+		tpriv->iso_urbs = NULL;
+		tpriv->reap_status = status;
 		usbi_mutex_unlock(&itransfer->lock);
-		return usbi_handle_transfer_completion(itransfer, status);
+		return 1;
 	}
 
 out:
@@ -2608,10 +2852,9 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer), "cancel: unrecognised urb status %d",
 				  urb->status);
-		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
-		return usbi_handle_transfer_cancellation(itransfer);
+		return 1;
 	}
 
 	switch (urb->status) {
@@ -2648,13 +2891,19 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
+	tpriv->reap_status = status;
 	usbi_mutex_unlock(&itransfer->lock);
-	return usbi_handle_transfer_completion(itransfer, status);
+	return 1;
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
+/* Reap one URB of a device handle. The transfer it belongs to is added to
+ * the completed list if this was its last URB, its completion is reported
+ * later with usbi_handle_transfer_completions() so that the callbacks run
+ * once all the ready devices have been reaped. Returns 0 if a URB was reaped,
+ * 1 if there was none, or a LIBUSB_ERROR code */
+static int reap_for_handle(struct libusb_device_handle *handle,
+	struct list_head *completed)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
 	int r;
@@ -2680,54 +2929,78 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		return handle_iso_completion(itransfer, urb);
+		r = handle_iso_completion(itransfer, urb);
+		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		return handle_bulk_completion(itransfer, urb);
+		r = handle_bulk_completion(itransfer, urb);
+		break;
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
-		return handle_control_completion(itransfer, urb);
+		r = handle_control_completion(itransfer, urb);
+		break;
 	default:
 		usbi_err(HANDLE_CTX(handle), "unrecognised transfer type %u", transfer->type);
 		return LIBUSB_ERROR_OTHER;
 	}
+
+	if (r < 0)
+		return r;
+	if (r == 1) {
+		struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+		transfer->status = tpriv->reap_action == CANCELLED ?
+			LIBUSB_TRANSFER_CANCELLED : tpriv->reap_status;
+		list_add_tail(&itransfer->completed_list, completed);
+	}
+	return 0;
 }
 
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int count, unsigned int num_ready)
 {
-	struct pollfd *fds = event_data;
-	unsigned int n;
-	int r;
-
-	usbi_mutex_lock(&ctx->open_devs_lock);
-	for (n = 0; n < count && num_ready > 0; n++) {
-		struct pollfd *pollfd = &fds[n];
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct usbi_ready_event *ready = event_data;
+	unsigned int budget = ctx->reap_budget;
+	unsigned int i, n, start, pending;
+	struct list_head completed;
+	int r, dispatch_r;
+
+	UNUSED(num_ready);
+
+	/* a device that is the only one ready is drained, there is nobody
+	 * else to be fair to */
+	if (count == 1)
+		budget = 0;
+
+	/* start with a different device on every wakeup so that the ones
+	 * early in the ready list are not always served first */
+	start = (unsigned int)((unsigned long)usbi_atomic_inc(&cpriv->reap_rotor) % count);
+
+	/* Reap everything that is ready first and only report the completions
+	 * afterwards. No lock is needed for the device handles, they can only
+	 * be closed by the event handler serving them, that is by this thread */
+	list_init(&completed);
+again:
+	pending = 0;
+	for (i = 0; i < count; i++) {
+		/* the event sources were added with the handle as user data, which
+		 * is cleared once the handle needs no further attention */
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
-		int reap_count;
+		struct linux_device_handle_priv *hpriv;
+		unsigned int reap_count;
 
-		if (!pollfd->revents)
+		n = (start + i) % count;
+		handle = ready[n].user_data;
+		if (!handle)
 			continue;
+		hpriv = usbi_get_device_handle_priv(handle);
 
-		num_ready--;
-		for_each_open_device(ctx, handle) {
-			hpriv = usbi_get_device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
-		}
-
-		if (!hpriv || hpriv->fd != pollfd->fd) {
-			usbi_err(ctx, "cannot find handle for fd %d",
-				 pollfd->fd);
-			continue;
-		}
-
-		if (pollfd->revents & POLLERR) {
+		if (ready[n].revents & POLLERR) {
 			/* remove the fd from the pollfd set so that it doesn't continuously
 			 * trigger an event, and flag that it has been removed so op_close()
 			 * doesn't try to remove it a second time */
-			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
+			usbi_remove_handle_event_source(handle, hpriv->fd);
 			hpriv->fd_removed = 1;
 
 			/* device will still be marked as attached if hotplug monitor thread
@@ -2738,36 +3011,131 @@ static int op_handle_events(struct libusb_context *ctx,
 							  handle->dev->device_address);
 			usbi_mutex_static_unlock(&linux_hotplug_lock);
 
+			/* the URBs reaped here must be reported before the
+			 * transfers still in flight are terminated */
 			if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT) {
+				struct list_head disconnected;
+
+				list_init(&disconnected);
 				do {
-					r = reap_for_handle(handle);
+					r = reap_for_handle(handle, &disconnected);
 				} while (r == 0);
+				usbi_handle_transfer_completions(ctx, &disconnected);
 			}
 
 			usbi_handle_disconnect(handle);
+			ready[n].user_data = NULL;
 			continue;
 		}
 
+		usbi_stat_inc(ctx, LIBUSB_STAT_REAP_PASSES);
 		reap_count = 0;
 		do {
-			r = reap_for_handle(handle);
-		} while (r == 0 && ++reap_count <= 25);
+			r = reap_for_handle(handle, &completed);
+		} while (r == 0 && (!budget || ++reap_count < budget));
+
+		if (r == 0) {
+			/* budget exhausted, come back to this device later */
+			usbi_stat_inc(ctx, LIBUSB_STAT_REAP_BUDGET_HITS);
+			pending++;
+			continue;
+		}
 
+		ready[n].user_data = NULL;
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
 			goto out;
 	}
 
+	/* io_uring only reports a device again once more URBs complete, so
+	 * keep going round until everything that is there has been reaped */
+	if (pending && usbi_using_io_uring(ctx))
+		goto again;
+
 	r = 0;
 out:
+	dispatch_r = usbi_handle_transfer_completions(ctx, &completed);
+	return r < 0 ? r : dispatch_r;
+}
+
+/* Collect the device handles of the context that have transfers in flight.
+ * They are only closed by the event handler, which is the caller, so they can
+ * be reaped after open_devs_lock is released. */
+static int get_busy_poll_handles(struct libusb_context *ctx, size_t *count)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct libusb_device_handle *handle, **handles;
+	size_t i, n = 0;
+	int r = 0;
+
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	for_each_open_device(ctx, handle) {
+		struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+		/* disconnection is dealt with by op_handle_events(), and the
+		 * devices of event shards are only reaped by their shard */
+		if (hpriv->fd_removed || handle->shard)
+			continue;
+
+		if (n == cpriv->busy_poll_size) {
+			handles = realloc(cpriv->busy_poll_handles,
+				(n + 8) * sizeof(*handles));
+			if (!handles) {
+				r = LIBUSB_ERROR_NO_MEM;
+				break;
+			}
+			cpriv->busy_poll_handles = handles;
+			cpriv->busy_poll_size = n + 8;
+		}
+		cpriv->busy_poll_handles[n++] = handle;
+	}
 	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	if (r)
+		return r;
+
+	/* skip the devices with nothing to reap */
+	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	for (i = 0, *count = 0; i < n; i++) {
+		handle = cpriv->busy_poll_handles[i];
+		if (!list_empty(&handle->flying_transfers))
+			cpriv->busy_poll_handles[(*count)++] = handle;
+	}
+	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+
+	return 0;
+}
+
+static int op_busy_poll(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct list_head completed;
+	size_t i, count;
+	int handled = 0;
+	int r, dispatch_r;
+
+	r = get_busy_poll_handles(ctx, &count);
+	if (r)
+		return r;
+
+	list_init(&completed);
+	for (i = 0; i < count; i++) {
+		while ((r = reap_for_handle(cpriv->busy_poll_handles[i], &completed)) == 0)
+			handled = 1;
+		if (r < 0 && r != LIBUSB_ERROR_NO_DEVICE)
+			break;
+		r = 0;
+	}
+
+	dispatch_r = usbi_handle_transfer_completions(ctx, &completed);
+	if (r == 0)
+		r = dispatch_r;
+	return r < 0 ? r : handled;
 }
 
 const struct usbi_os_backend usbi_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|USBI_CAP_HANDLE_EVENT_SOURCES,
 	.init = op_init,
 	.exit = op_exit,
 	.set_option = op_set_option,
@@ -2793,6 +3161,12 @@ const struct usbi_os_backend usbi_backend = {
 
 	.dev_mem_alloc = op_dev_mem_alloc,
 	.dev_mem_free = op_dev_mem_free,
+#ifdef SYS_mbind
+	.numa_bind_memory = op_numa_bind_memory,
+#endif
+#ifndef __ANDROID__
+	.numa_bind_thread = op_numa_bind_thread,
+#endif
 
 	.kernel_driver_active = op_kernel_driver_active,
 	.detach_kernel_driver = op_detach_kernel_driver,
@@ -2802,9 +3176,13 @@ const struct usbi_os_backend usbi_backend = {
 
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.destroy_transfer = op_destroy_transfer,
 
 	.handle_events = op_handle_events,
+	.busy_poll = op_busy_poll,
 
 	.context_priv_size = sizeof(struct linux_context_priv),
 	.device_priv_size = sizeof(struct linux_device_priv),
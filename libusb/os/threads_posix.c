@@ -22,6 +22,7 @@
 #include "libusbi.h"
 
 #include <errno.h>
+#include <sched.h>
 #if defined(__ANDROID__)
 # include <unistd.h>
 #elif defined(__HAIKU__)
@@ -79,6 +80,90 @@ int usbi_cond_timedwait(pthread_cond_t *cond,
 		return LIBUSB_ERROR_OTHER;
 }
 
+static int thread_error(int err)
+{
+	if (err == EPERM)
+		return LIBUSB_ERROR_ACCESS;
+	else if (err == EINVAL)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	else
+		return LIBUSB_ERROR_OTHER;
+}
+
+#if defined(__linux__) && !defined(__ANDROID__)
+static void to_cpu_set(const struct usbi_cpu_set *cpus, cpu_set_t *set)
+{
+	unsigned int cpu;
+
+	CPU_ZERO(set);
+	for (cpu = 0; cpu < USBI_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+		if (usbi_cpu_isset(cpus, cpu))
+			CPU_SET(cpu, set);
+	}
+}
+#endif
+
+/* start a thread pinned to cpus, unless NULL, and running under SCHED_FIFO
+ * with the given priority, unless 0. Both are set through the attributes of
+ * the thread, so that it never runs anywhere else or with another policy */
+int usbi_thread_create_scheduled(usbi_thread_t *thread,
+	void *(*start)(void *), void *arg, const struct usbi_cpu_set *cpus,
+	int priority)
+{
+	pthread_attr_t attr;
+	int r;
+
+	if (pthread_attr_init(&attr))
+		return LIBUSB_ERROR_OTHER;
+
+	r = 0;
+	if (cpus) {
+#if defined(__linux__) && !defined(__ANDROID__)
+		cpu_set_t set;
+
+		to_cpu_set(cpus, &set);
+		r = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+#else
+		pthread_attr_destroy(&attr);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+	}
+
+	if (!r && priority) {
+		struct sched_param param = { .sched_priority = priority };
+
+		r = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		if (!r)
+			r = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		if (!r)
+			r = pthread_attr_setschedparam(&attr, &param);
+	}
+
+	if (!r)
+		r = pthread_create(thread, &attr, start, arg);
+	pthread_attr_destroy(&attr);
+
+	return r ? thread_error(r) : 0;
+}
+
+/* pin a running thread to cpus */
+int usbi_thread_set_affinity(usbi_thread_t thread,
+	const struct usbi_cpu_set *cpus)
+{
+#if defined(__linux__) && !defined(__ANDROID__)
+	cpu_set_t set;
+	int r;
+
+	to_cpu_set(cpus, &set);
+	r = pthread_setaffinity_np(thread, sizeof(set), &set);
+	return r ? thread_error(r) : 0;
+#else
+	UNUSED(thread);
+	UNUSED(cpus);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 unsigned int usbi_get_tid(void)
 {
 	static _Thread_local unsigned int tl_tid;
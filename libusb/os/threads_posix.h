@@ -66,6 +66,10 @@ static inline void usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex)
 }
 int usbi_cond_timedwait(usbi_cond_t *cond,
 	usbi_mutex_t *mutex, const struct timeval *tv);
+static inline void usbi_cond_signal(usbi_cond_t *cond)
+{
+	PTHREAD_CHECK(pthread_cond_signal(cond));
+}
 static inline void usbi_cond_broadcast(usbi_cond_t *cond)
 {
 	PTHREAD_CHECK(pthread_cond_broadcast(cond));
@@ -93,6 +97,23 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 	PTHREAD_CHECK(pthread_key_delete(key));
 }
 
+typedef pthread_t usbi_thread_t;
+#define USBI_THREAD_RETURN_TYPE	void *
+static inline int usbi_thread_create(usbi_thread_t *thread,
+	void *(*start)(void *), void *arg)
+{
+	return pthread_create(thread, NULL, start, arg) == 0 ? 0 : LIBUSB_ERROR_OTHER;
+}
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+	PTHREAD_CHECK(pthread_join(thread, NULL));
+}
+int usbi_thread_create_scheduled(usbi_thread_t *thread,
+	void *(*start)(void *), void *arg, const struct usbi_cpu_set *cpus,
+	int priority);
+int usbi_thread_set_affinity(usbi_thread_t thread,
+	const struct usbi_cpu_set *cpus);
+
 unsigned int usbi_get_tid(void);
 
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -38,3 +38,45 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	else
 		return LIBUSB_ERROR_OTHER;
 }
+
+/* start a thread pinned to cpus, unless NULL, and running at the highest
+ * priority if priority is not 0. The thread is created suspended and only
+ * resumed once both are set */
+int usbi_thread_create_scheduled(usbi_thread_t *thread,
+	unsigned (__stdcall *start)(void *), void *arg,
+	const struct usbi_cpu_set *cpus, int priority)
+{
+	DWORD_PTR mask = 0;
+	unsigned int cpu;
+	int r = 0;
+
+	for (cpu = 0; cpus && cpu < USBI_MAX_CPUS; cpu++) {
+		if (!usbi_cpu_isset(cpus, cpu))
+			continue;
+		/* the CPUs of other processor groups cannot be selected */
+		if (cpu >= 8 * sizeof(mask))
+			return LIBUSB_ERROR_NOT_SUPPORTED;
+		mask |= (DWORD_PTR)1 << cpu;
+	}
+
+	*thread = (HANDLE)_beginthreadex(NULL, 0, start, arg, CREATE_SUSPENDED, NULL);
+	if (!*thread)
+		return LIBUSB_ERROR_OTHER;
+
+	if (mask && !SetThreadAffinityMask(*thread, mask))
+		r = GetLastError() == ERROR_INVALID_PARAMETER ?
+			LIBUSB_ERROR_INVALID_PARAM : LIBUSB_ERROR_OTHER;
+	else if (priority && !SetThreadPriority(*thread, THREAD_PRIORITY_TIME_CRITICAL))
+		r = GetLastError() == ERROR_ACCESS_DENIED ?
+			LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_OTHER;
+
+	if (r) {
+		/* the thread has not run any code yet */
+		TerminateThread(*thread, 0);
+		CloseHandle(*thread);
+		return r;
+	}
+
+	ResumeThread(*thread);
+	return 0;
+}
@@ -21,6 +21,8 @@
 #ifndef LIBUSB_THREADS_WINDOWS_H
 #define LIBUSB_THREADS_WINDOWS_H
 
+#include <process.h>
+
 #define WINAPI_CHECK(expression)	ASSERT_NE(expression, 0)
 
 #define USBI_MUTEX_INITIALIZER	0L
@@ -77,6 +79,10 @@ static inline void usbi_cond_wait(usbi_cond_t *cond, usbi_mutex_t *mutex)
 }
 int usbi_cond_timedwait(usbi_cond_t *cond,
 	usbi_mutex_t *mutex, const struct timeval *tv);
+static inline void usbi_cond_signal(usbi_cond_t *cond)
+{
+	WakeConditionVariable(cond);
+}
 static inline void usbi_cond_broadcast(usbi_cond_t *cond)
 {
 	WakeAllConditionVariable(cond);
@@ -105,6 +111,23 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 	WINAPI_CHECK(TlsFree(key));
 }
 
+typedef HANDLE usbi_thread_t;
+#define USBI_THREAD_RETURN_TYPE	unsigned __stdcall
+static inline int usbi_thread_create(usbi_thread_t *thread,
+	unsigned (__stdcall *start)(void *), void *arg)
+{
+	*thread = (HANDLE)_beginthreadex(NULL, 0, start, arg, 0, NULL);
+	return *thread ? 0 : LIBUSB_ERROR_OTHER;
+}
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+int usbi_thread_create_scheduled(usbi_thread_t *thread,
+	unsigned (__stdcall *start)(void *), void *arg,
+	const struct usbi_cpu_set *cpus, int priority);
+
 static inline unsigned int usbi_get_tid(void)
 {
 	return (unsigned int)GetCurrentThreadId();
@@ -907,6 +907,10 @@ const struct usbi_os_backend usbi_backend = {
 	NULL,	/* free_streams */
 	NULL,	/* dev_mem_alloc */
 	NULL,	/* dev_mem_free */
+	NULL,	/* numa_bind_memory */
+	NULL,	/* numa_bind_thread */
+	NULL,	/* sync_control_transfer */
+	NULL,	/* sync_bulk_transfer */
 	NULL,	/* kernel_driver_active */
 	NULL,	/* detach_kernel_driver */
 	NULL,	/* attach_kernel_driver */
@@ -914,7 +918,9 @@ const struct usbi_os_backend usbi_backend = {
 	windows_submit_transfer,
 	windows_cancel_transfer,
 	NULL,	/* clear_transfer_priv */
+	NULL,	/* destroy_transfer */
 	NULL,	/* handle_events */
+	NULL,	/* busy_poll */
 	windows_handle_transfer_completion,
 	sizeof(struct windows_context_priv),
 	sizeof(union windows_device_priv),
@@ -32,7 +32,11 @@
  * may wish to consider using the \ref libusb_asyncio "asynchronous I/O API" instead.
  */
 
-static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
+/* Only flags the completion for the thread waiting in
+ * sync_transfer_wait_for_completion(), which handles the events itself. It is
+ * therefore always invoked while handling events, even with an executor or a
+ * completion queue. */
+void LIBUSB_CALL usbi_sync_transfer_cb(struct libusb_transfer *transfer)
 {
 	int *completed = transfer->user_data;
 	*completed = 1;
@@ -44,9 +48,14 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 {
 	int r, *completed = transfer->user_data;
 	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
+	int shard = libusb_get_handle_shard(transfer->dev_handle);
 
 	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+		/* the device handles of an event shard are only served by it */
+		if (shard >= 0)
+			r = libusb_handle_events_shard(ctx, shard, NULL, completed);
+		else
+			r = libusb_handle_events_completed(ctx, completed);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -106,24 +115,26 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+	if (HANDLE_CTX(dev_handle)->sync_fast_path) {
+		r = usbi_backend.sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			return r;
+	}
 
-	buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
+	transfer = usbi_alloc_sync_transfer(HANDLE_CTX(dev_handle),
+		LIBUSB_CONTROL_SETUP_SIZE + wLength);
+	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
-	}
 
+	buffer = transfer->buffer;
 	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
 		wLength);
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
 		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		usbi_sync_transfer_cb, &completed, timeout);
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
 		libusb_free_transfer(transfer);
@@ -177,12 +188,24 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
-	transfer = libusb_alloc_transfer(0);
+	if (HANDLE_CTX(dev_handle)->sync_fast_path && usbi_backend.sync_bulk_transfer) {
+		int actual_length = 0;
+
+		r = usbi_backend.sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, &actual_length, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			if (transferred)
+				*transferred = actual_length;
+			return r;
+		}
+	}
+
+	transfer = usbi_alloc_sync_transfer(HANDLE_CTX(dev_handle), 0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		sync_transfer_cb, &completed, timeout);
+		usbi_sync_transfer_cb, &completed, timeout);
 	transfer->type = type;
 
 	r = libusb_submit_transfer(transfer);
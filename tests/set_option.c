@@ -23,10 +23,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 #include "libusbi.h"
 #include "libusb_testlib.h"
 
+#if defined(HAVE_MEMFD_CREATE)
+#include <unistd.h>
+#endif
+
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <winbase.h>
 
@@ -158,6 +163,527 @@ static libusb_testlib_result test_set_log_level_env(void) {
 }
 
 
+static libusb_testlib_result test_timeout_slack(void)
+{
+  libusb_context *test_ctx = NULL;
+  uint64_t value = 1;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_TIMEOUT_SLACK_US, .value = { .ival = 1000 } },
+  };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->timeout_slack_us, 1000);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_TIMEOUT_SLACK_US, 0));
+  LIBUSB_EXPECT(==, test_ctx->timeout_slack_us, 0);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_TIMEOUT_SLACK_US, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_stat(test_ctx, LIBUSB_STAT_TIMER_REARMS_AVOIDED, &value));
+  LIBUSB_EXPECT(==, value, 0);
+  LIBUSB_EXPECT(==, libusb_get_stat(test_ctx, LIBUSB_STAT_MAX, &value),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_event_engine(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_EVENT_ENGINE, .value = { .ival = LIBUSB_EVENT_ENGINE_EPOLL } },
+  };
+#ifdef HAVE_EPOLL
+  struct timeval tv = { 0, 0 };
+  struct pollfd pfd;
+#endif
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, libusb_get_event_fd(test_ctx), LIBUSB_ERROR_NOT_SUPPORTED);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_ENGINE, 42),
+                LIBUSB_ERROR_INVALID_PARAM);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+
+#ifdef HAVE_EPOLL
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  pfd.fd = libusb_get_event_fd(test_ctx);
+  pfd.events = POLLIN;
+  LIBUSB_EXPECT(>=, pfd.fd, 0);
+
+  /* the single fd must report the internal event and be quiet once it
+   * has been handled */
+  libusb_interrupt_event_handler(test_ctx);
+  LIBUSB_EXPECT(==, poll(&pfd, 1, 0), 1);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+  LIBUSB_EXPECT(==, poll(&pfd, 1, 0), 0);
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+  test_ctx = NULL;
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_event_engine_io_uring(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_EVENT_ENGINE, .value = { .ival = LIBUSB_EVENT_ENGINE_IO_URING } },
+  };
+#ifdef HAVE_IO_URING
+  struct timeval tv = { 0, 0 };
+  struct pollfd pfd;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  pfd.fd = libusb_get_event_fd(test_ctx);
+  if (pfd.fd == LIBUSB_ERROR_NOT_SUPPORTED) {
+    /* the running kernel lacks io_uring, the context fell back to poll() */
+    libusb_exit(test_ctx);
+    return TEST_STATUS_SKIP;
+  }
+  pfd.events = POLLIN;
+  LIBUSB_EXPECT(>=, pfd.fd, 0);
+
+  /* the internal event must be reported through the ring even though it
+   * is only polled once */
+  libusb_interrupt_event_handler(test_ctx);
+  LIBUSB_EXPECT(==, poll(&pfd, 1, 1000), 1);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+  LIBUSB_EXPECT(==, poll(&pfd, 1, 0), 0);
+
+  /* and so must a second interruption */
+  libusb_interrupt_event_handler(test_ctx);
+  LIBUSB_EXPECT(==, poll(&pfd, 1, 1000), 1);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+
+  /* waiting without any events must time out */
+  tv.tv_usec = 10000;
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+  test_ctx = NULL;
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_reap_budget(void)
+{
+  libusb_context *test_ctx = NULL;
+  uint64_t value = 1;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->reap_budget, USBI_DEFAULT_REAP_BUDGET);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_REAP_BUDGET, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_REAP_BUDGET, 4));
+  LIBUSB_EXPECT(==, test_ctx->reap_budget, 4);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_REAP_BUDGET, 0));
+  LIBUSB_EXPECT(==, test_ctx->reap_budget, 0);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_stat(test_ctx, LIBUSB_STAT_REAP_PASSES, &value));
+  LIBUSB_EXPECT(==, value, 0);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_get_stat(test_ctx, LIBUSB_STAT_REAP_BUDGET_HITS, &value));
+  LIBUSB_EXPECT(==, value, 0);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_busy_poll(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct timeval tv = { 0, 1000 };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->busy_poll_us, 0);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_BUSY_POLL_US, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+#if defined(__linux__)
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_BUSY_POLL_US, 100));
+  LIBUSB_EXPECT(==, test_ctx->busy_poll_us, 100);
+
+  /* nothing is in flight, so this must wait for events as usual */
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+#else
+  /* also rejected before it becomes a default for new contexts */
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_BUSY_POLL_US, 100),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+  UNUSED(tv);
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_callback_threads(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_CALLBACK_THREADS, .value = { .ival = 4 } },
+  };
+  struct timeval tv = { 0, 0 };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->executor == NULL, 1);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_CALLBACK_THREADS, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_CALLBACK_THREADS, 65),
+                LIBUSB_ERROR_INVALID_PARAM);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->executor != NULL, 1);
+  LIBUSB_EXPECT(==, test_ctx->executor->num_threads, 4);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_event_shards(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_EVENT_SHARDS, .value = { .ival = 4 } },
+  };
+  struct timeval tv = { 0, 0 };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->num_event_shards, 0);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_SHARDS, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_SHARDS, 65),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_handle_events_shard(test_ctx, 0, &tv, NULL),
+                LIBUSB_ERROR_INVALID_PARAM);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+
+#if defined(__linux__)
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->num_event_shards, 4);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_shard(test_ctx, 3, &tv, NULL));
+  LIBUSB_EXPECT(==, libusb_handle_events_shard(test_ctx, 4, &tv, NULL),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  /* an interrupted shard returns right away */
+  libusb_interrupt_event_handler(test_ctx);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_shard(test_ctx, 0, NULL, NULL));
+
+  int completed = 1;
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_shard(test_ctx, 1, NULL, &completed));
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_handle_events_multi(void)
+{
+  libusb_context *test_ctx = NULL;
+  libusb_context *ctxs[2] = { NULL, NULL };
+  struct timeval tv = { 0, 0 };
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  ctxs[0] = test_ctx;
+  LIBUSB_EXPECT(==, libusb_handle_events_multi(ctxs, 0, &tv),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_handle_events_multi(ctxs, 2, &tv),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&ctxs[1], /*options=*/NULL,
+                                                  /*num_options=*/0));
+#if defined(_WIN32)
+  LIBUSB_EXPECT(==, libusb_handle_events_multi(ctxs, 2, &tv),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#else
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_multi(ctxs, 2, &tv));
+
+  LIBUSB_EXPECT(==, libusb_handle_events_multi(ctxs, 2, NULL),
+                LIBUSB_ERROR_INVALID_PARAM);
+
+  /* an interrupt of any of the contexts ends the wait */
+  tv.tv_sec = 10;
+  libusb_interrupt_event_handler(ctxs[1]);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_multi(ctxs, 2, &tv));
+#endif
+  libusb_exit(ctxs[1]);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_event_thread(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_EVENT_THREAD, .value = { .ival = 1 } },
+    { .option = LIBUSB_OPTION_EVENT_THREAD_CPUS, .value = { .sval = "0" } },
+    { .option = LIBUSB_OPTION_EVENT_THREAD_PRIORITY, .value = { .ival = 10 } },
+  };
+  struct timeval tv = { 0, 10000 };
+  int r;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, test_ctx->event_thread_running, 0);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_PRIORITY, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_PRIORITY, 100),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_CPUS, "x"),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_CPUS, "3-1"),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_CPUS, "0,"),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_CPUS, "1024"),
+                LIBUSB_ERROR_INVALID_PARAM);
+  /* CPUs above 31 can be selected */
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_CPUS,
+                                                "0,40-41,41"));
+  LIBUSB_EXPECT(==, test_ctx->event_thread_num_cpus, 3);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_EVENT_THREAD_CPUS,
+                                                NULL));
+  LIBUSB_EXPECT(==, test_ctx->event_thread_num_cpus, 0);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  LIBUSB_EXPECT(==, test_ctx->event_thread_running, 1);
+  /* the application waits for the internal thread to handle the events */
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_handle_events_timeout(test_ctx, &tv));
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+
+#if defined(__linux__) || defined(_WIN32)
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/2));
+  LIBUSB_EXPECT(==, test_ctx->event_thread_num_cpus, 1);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+#endif
+
+  /* real-time scheduling may not be allowed */
+  r = libusb_init_context(&test_ctx, options, /*num_options=*/3);
+  if (r == LIBUSB_ERROR_ACCESS || r == LIBUSB_ERROR_NOT_SUPPORTED)
+    LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+  LIBUSB_TEST_RETURN_ON_ERROR(r);
+  LIBUSB_EXPECT(==, test_ctx->event_thread_priority, 10);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static int counted_allocs;
+
+static void * LIBUSB_CALL counting_alloc(void *user_data, size_t length)
+{
+  (*(int *)user_data)++;
+  return malloc(length);
+}
+
+static void LIBUSB_CALL counting_free(void *user_data, void *buffer)
+{
+  (*(int *)user_data)--;
+  free(buffer);
+}
+
+static libusb_testlib_result test_buffer_allocator(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_BUFFER_ALLOCATOR,
+      .value = { .ival = LIBUSB_BUFFER_ALLOCATOR_HUGEPAGE } },
+  };
+  struct libusb_allocator allocator = {
+    counting_alloc, counting_free, &counted_allocs
+  };
+  unsigned char *small, *large;
+  size_t offset = 0;
+#if defined(__linux__)
+  struct libusb_transfer *xfr;
+#endif
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_BUFFER_ALLOCATOR, 3),
+                LIBUSB_ERROR_INVALID_PARAM);
+  small = libusb_buffer_alloc(test_ctx, 100);
+  LIBUSB_EXPECT(==, small != NULL, 1);
+  LIBUSB_EXPECT(==, libusb_buffer_get_memfd(test_ctx, small, &offset),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+  libusb_buffer_free(test_ctx, small);
+
+  allocator.free = NULL;
+  LIBUSB_EXPECT(==, libusb_set_allocator(test_ctx, &allocator),
+                LIBUSB_ERROR_INVALID_PARAM);
+  allocator.free = counting_free;
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_allocator(test_ctx, &allocator));
+  small = libusb_buffer_alloc(test_ctx, 100);
+  LIBUSB_EXPECT(==, counted_allocs, 1);
+  libusb_buffer_free(test_ctx, small);
+  LIBUSB_EXPECT(==, counted_allocs, 0);
+
+  /* a buffer is released by the allocator that provided it */
+  small = libusb_buffer_alloc(test_ctx, 100);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_allocator(test_ctx, NULL));
+  libusb_buffer_free(test_ctx, small);
+  LIBUSB_EXPECT(==, counted_allocs, 0);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+
+#if defined(__linux__)
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  small = libusb_buffer_alloc(test_ctx, 100);
+  large = libusb_buffer_alloc(test_ctx, 4 << 20);
+  LIBUSB_EXPECT(==, small != NULL, 1);
+  LIBUSB_EXPECT(==, large != NULL, 1);
+  memset(small, 0x55, 100);
+  memset(large, 0xaa, 4 << 20);
+  libusb_buffer_free(test_ctx, small);
+  libusb_buffer_free(test_ctx, large);
+
+  /* the buffers of transfers are still free()'d */
+  xfr = libusb_alloc_transfer(0);
+  LIBUSB_EXPECT(==, xfr != NULL, 1);
+  xfr->buffer = malloc(100);
+  xfr->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  libusb_free_transfer(xfr);
+  libusb_exit(test_ctx);
+  test_ctx = NULL;
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#endif
+
+#if defined(HAVE_MEMFD_CREATE)
+  unsigned char data[4] = { 0 };
+  int fd;
+
+  options[0].value.ival = LIBUSB_BUFFER_ALLOCATOR_MEMFD;
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/1));
+  small = libusb_buffer_alloc(test_ctx, 8192);
+  LIBUSB_EXPECT(==, small != NULL, 1);
+  LIBUSB_EXPECT(==, libusb_buffer_get_memfd(test_ctx, small, &offset),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+  libusb_buffer_free(test_ctx, small);
+
+  large = libusb_buffer_alloc(test_ctx, 128 << 10);
+  LIBUSB_EXPECT(==, large != NULL, 1);
+  memcpy(large, "usb", 4);
+
+  /* the data is visible through the memfd */
+  fd = libusb_buffer_get_memfd(test_ctx, large, &offset);
+  LIBUSB_EXPECT(>=, fd, 0);
+  LIBUSB_EXPECT(==, pread(fd, data, sizeof(data), (off_t)offset), (ssize_t)sizeof(data));
+  LIBUSB_EXPECT(==, memcmp(data, "usb", 4), 0);
+  libusb_buffer_free(test_ctx, large);
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_numa_binding(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_EVENT_THREAD, .value = { .ival = 1 } },
+    { .option = LIBUSB_OPTION_NUMA_BINDING,
+      .value = { .ival = LIBUSB_NUMA_BIND_BUFFER_POOLS | LIBUSB_NUMA_BIND_EVENT_THREAD } },
+  };
+#if defined(__linux__)
+  libusb_device **devs;
+  ssize_t num_devs, i;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/2));
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_NUMA_BINDING, 4),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_NUMA_BINDING, 0));
+
+  /* the node is either unknown or a valid node number */
+  num_devs = libusb_get_device_list(test_ctx, &devs);
+  for (i = 0; i < num_devs; i++) {
+    int node = libusb_get_device_numa_node(devs[i]);
+
+    LIBUSB_EXPECT(==, node >= 0 || node == LIBUSB_ERROR_NOT_FOUND, 1);
+  }
+  if (num_devs >= 0)
+    libusb_free_device_list(devs, 1);
+#else
+  LIBUSB_EXPECT(==, libusb_init_context(&test_ctx, options, /*num_options=*/2),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#endif
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_realtime(void)
+{
+  libusb_context *test_ctx = NULL;
+  struct libusb_init_option options[] = {
+    { .option = LIBUSB_OPTION_REALTIME, .value = { .ival = 4 } },
+    { .option = LIBUSB_OPTION_REALTIME_IN_FLIGHT, .value = { .ival = 16 } },
+  };
+  struct timeval tv = { 0, 0 };
+
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_REALTIME, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_REALTIME_IN_FLIGHT, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, options,
+                                                  /*num_options=*/2));
+  /* the timeouts of the asynchronous transfers come on top of the
+   * synchronous ones */
+  LIBUSB_EXPECT(==, test_ctx->timeout_heap_size, 20);
+  LIBUSB_EXPECT(==, libusb_handle_events_timeout(test_ctx, &tv), LIBUSB_SUCCESS);
+  LIBUSB_EXPECT(==, libusb_handle_events_timeout(test_ctx, &tv), LIBUSB_SUCCESS);
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
+static libusb_testlib_result test_sync_fast_path(void)
+{
+  libusb_context *test_ctx = NULL;
+
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_init_context(&test_ctx, /*options=*/NULL,
+                                                  /*num_options=*/0));
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_SYNC_FAST_PATH, -1),
+                LIBUSB_ERROR_INVALID_PARAM);
+#if defined(__linux__)
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_SYNC_FAST_PATH, 1));
+#else
+  LIBUSB_EXPECT(==, libusb_set_option(test_ctx, LIBUSB_OPTION_SYNC_FAST_PATH, 1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+  /* also rejected before it becomes a default for new contexts */
+  LIBUSB_EXPECT(==, libusb_set_option(NULL, LIBUSB_OPTION_SYNC_FAST_PATH, 1),
+                LIBUSB_ERROR_NOT_SUPPORTED);
+#endif
+  LIBUSB_TEST_RETURN_ON_ERROR(libusb_set_option(test_ctx, LIBUSB_OPTION_SYNC_FAST_PATH, 0));
+
+  LIBUSB_TEST_CLEAN_EXIT(TEST_STATUS_SUCCESS);
+}
+
 static libusb_testlib_result test_no_discovery(void)
 {
 #if defined(__linux__)
@@ -188,6 +714,19 @@ static libusb_testlib_result test_no_discovery(void)
 static const libusb_testlib_test tests[] = {
   { "test_set_log_level_basic", &test_set_log_level_basic },
   { "test_set_log_level_env", &test_set_log_level_env },
+  { "test_timeout_slack", &test_timeout_slack },
+  { "test_event_engine", &test_event_engine },
+  { "test_event_engine_io_uring", &test_event_engine_io_uring },
+  { "test_reap_budget", &test_reap_budget },
+  { "test_busy_poll", &test_busy_poll },
+  { "test_callback_threads", &test_callback_threads },
+  { "test_event_shards", &test_event_shards },
+  { "test_handle_events_multi", &test_handle_events_multi },
+  { "test_event_thread", &test_event_thread },
+  { "test_buffer_allocator", &test_buffer_allocator },
+  { "test_numa_binding", &test_numa_binding },
+  { "test_realtime", &test_realtime },
+  { "test_sync_fast_path", &test_sync_fast_path },
   { "test_no_discovery", &test_no_discovery },
   /* since default options can't be unset, run this one last */
   { "test_set_log_level_default", &test_set_log_level_default },
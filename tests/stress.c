@@ -157,12 +157,67 @@ static libusb_testlib_result test_default_context_change(void)
 	return TEST_STATUS_SUCCESS;
 }
 
+/** Tests that transfers are recycled through a transfer pool. */
+static libusb_testlib_result test_transfer_pool(void)
+{
+#define POOL_SIZE 16
+	struct libusb_transfer *transfers[POOL_SIZE];
+	libusb_transfer_pool *pool;
+	libusb_context *ctx;
+	int r;
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	pool = libusb_transfer_pool_create(ctx, POOL_SIZE, 4);
+	if (!pool) {
+		libusb_testlib_logf("Failed to create transfer pool");
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	for (int round = 0; round < 1000; ++round) {
+		for (int i = 0; i < POOL_SIZE; ++i) {
+			transfers[i] = libusb_transfer_pool_alloc(pool);
+			if (!transfers[i] || transfers[i]->timeout || transfers[i]->iso_packet_desc[3].length) {
+				libusb_testlib_logf("Bad transfer %d in round %d", i, round);
+				goto err;
+			}
+			/* dirty the transfer so that reuse has to reset it */
+			transfers[i]->timeout = 1000;
+			transfers[i]->iso_packet_desc[3].length = 64;
+		}
+
+		if (libusb_transfer_pool_alloc(pool)) {
+			libusb_testlib_logf("Pool not exhausted in round %d", round);
+			goto err;
+		}
+
+		for (int i = 0; i < POOL_SIZE; ++i)
+			libusb_free_transfer(transfers[i]);
+	}
+
+	libusb_transfer_pool_destroy(pool);
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+
+err:
+	libusb_transfer_pool_destroy(pool);
+	libusb_exit(ctx);
+	return TEST_STATUS_FAILURE;
+#undef POOL_SIZE
+}
+
 /* Fill in the list of tests. */
 static const libusb_testlib_test tests[] = {
 	{ "init_and_exit", &test_init_and_exit },
 	{ "get_device_list", &test_get_device_list },
 	{ "many_device_lists", &test_many_device_lists },
 	{ "default_context_change", &test_default_context_change },
+	{ "transfer_pool", &test_transfer_pool },
 	LIBUSB_NULL_TEST
 };
 
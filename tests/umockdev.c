@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <linux/ioctl.h>
 #include <linux/usbdevice_fs.h>
 
@@ -38,6 +39,40 @@
 #pragma GCC diagnostic ignored "-Wanalyzer-file-leak"
 #endif
 
+/* Count the heap allocations made by the current thread while count_allocs
+ * is set, to check that steady-state paths of the library do not allocate.
+ * The umockdev ioctl handler runs in a thread of its own and is not counted. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread gboolean count_allocs = FALSE;
+static __thread guint num_allocs = 0;
+
+void *
+malloc(size_t size)
+{
+	if (count_allocs)
+		num_allocs++;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (count_allocs)
+		num_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (count_allocs)
+		num_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
 typedef struct {
 	pid_t thread;
 	libusb_context *ctx;
@@ -770,9 +805,8 @@ test_get_string_descriptor(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 		  .type = USBDEVFS_URB_TYPE_CONTROL,
 		  .buffer_length = 12, /* 8 byte out*/
 		  .buffer = (const unsigned char*) "\x80\x06\x00\x03\x00\x00\x04\x00",
-		}, {
-		  .submit = FALSE,
-		}
+		},
+		{ .submit = FALSE }
 	};
 
 	fixture->chat = chat;
@@ -803,6 +837,70 @@ transfer_cb_inc_user_data(struct libusb_transfer *transfer)
 	*(int*)transfer->user_data += 1;
 }
 
+static void
+test_close_flying_other_handle(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .buffer_length = 4,
+		},
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .buffer_length = 4,
+		},
+		{ .submit = FALSE }
+	};
+	libusb_device_handle *handles[2] = { NULL };
+	struct libusb_transfer *transfers[2] = { NULL };
+	int completed = 0;
+
+	fixture->chat = chat;
+
+	/* Open the device twice and submit a transfer on each handle */
+	for (int i = 0; i < 2; i++) {
+		handles[i] = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+		g_assert_nonnull(handles[i]);
+
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i],
+					  handles[i],
+					  LIBUSB_ENDPOINT_OUT,
+					  (unsigned char*) chat[i].buffer,
+					  chat[i].buffer_length,
+					  transfer_cb_inc_user_data,
+					  &completed,
+					  0);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	/* Closing the first handle only removes its own transfer */
+	clear_libusb_log(fixture, LIBUSB_LOG_LEVEL_DEBUG);
+	libusb_close(handles[0]);
+	assert_libusb_log_msg(fixture, LIBUSB_LOG_LEVEL_ERROR, "\\[do_close\\] .*connected as far as we know");
+	assert_libusb_log_msg(fixture, LIBUSB_LOG_LEVEL_ERROR, "\\[do_close\\] .*cancellation hasn't even been scheduled");
+	assert_libusb_log_msg(fixture, LIBUSB_LOG_LEVEL_DEBUG, "\\[do_close\\] Removed transfer");
+	assert_libusb_no_log_msg(fixture, LIBUSB_LOG_LEVEL_DEBUG, "\\[do_close\\] Removed transfer");
+	g_assert_null(transfers[0]->dev_handle);
+	g_assert_true(transfers[1]->dev_handle == handles[1]);
+
+	/* The transfer of the other handle is still in flight */
+	g_assert_cmpint(libusb_cancel_transfer(transfers[1]), ==, 0);
+	while (!completed)
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+	g_assert_cmpint(transfers[1]->status, ==, LIBUSB_TRANSFER_CANCELLED);
+
+	for (int i = 0; i < 2; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_close(handles[1]);
+}
+
 static void
 test_timeout(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -851,6 +949,438 @@ test_timeout(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 	libusb_close(handle);
 }
 
+#define RESUBMIT_WARMUP 4
+#define RESUBMIT_ROUNDS 64
+static void
+test_resubmit_no_alloc(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .buffer_length = 4,
+	};
+	UsbChat reap_msg = {
+		  .reap = TRUE,
+		  .actual_length = 4,
+	};
+	UsbChat *c;
+	int completed = 0;
+	libusb_device_handle *handle = NULL;
+	struct libusb_transfer *transfer = NULL;
+
+	c = fixture->chat = g_new0(UsbChat, 2 * (RESUBMIT_WARMUP + RESUBMIT_ROUNDS) + 1);
+	for (int i = 0; i < RESUBMIT_WARMUP + RESUBMIT_ROUNDS; i++) {
+		c[2 * i] = submit_msg;
+		c[2 * i].reaps = &c[2 * i + 1];
+		c[2 * i + 1] = reap_msg;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer,
+				  handle,
+				  LIBUSB_ENDPOINT_OUT,
+				  (unsigned char*) submit_msg.buffer,
+				  submit_msg.buffer_length,
+				  transfer_cb_inc_user_data,
+				  &completed,
+				  1000);
+
+	for (int i = 0; i < RESUBMIT_WARMUP + RESUBMIT_ROUNDS; i++) {
+		if (i == RESUBMIT_WARMUP) {
+			/* logging allocates in the test log handler */
+			libusb_set_option(fixture->ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_NONE);
+			num_allocs = 0;
+			count_allocs = TRUE;
+		}
+
+		completed = 0;
+		g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+		while (!completed)
+			g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &completed), ==, 0);
+		g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	}
+
+	count_allocs = FALSE;
+	libusb_set_option(fixture->ctx, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_DEBUG);
+	g_assert_cmpuint(num_allocs, ==, 0);
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	g_free(c);
+}
+
+#define REALTIME_TRANSFERS 4
+#define REALTIME_ROUNDS 64
+static void
+test_realtime_no_alloc(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_OUT,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .buffer_length = 4,
+	};
+	UsbChat reap_msg = {
+		  .reap = TRUE,
+		  .actual_length = 4,
+	};
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_REALTIME, .value = { .ival = REALTIME_TRANSFERS } },
+	};
+	unsigned char data[4] = { 0x01, 0x02, 0x03, 0x04 };
+	UsbChat *c;
+	int transferred;
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+
+	c = fixture->chat = g_new0(UsbChat, 2 * (RESUBMIT_WARMUP + REALTIME_ROUNDS) + 1);
+	for (int i = 0; i < RESUBMIT_WARMUP + REALTIME_ROUNDS; i++) {
+		c[2 * i] = submit_msg;
+		c[2 * i].reaps = &c[2 * i + 1];
+		c[2 * i + 1] = reap_msg;
+	}
+
+	g_assert_cmpint(libusb_init_context(&ctx, options, 1), ==, 0);
+	handle = libusb_open_device_with_vid_pid(ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* the synchronous API takes its transfers from the reserve of the
+	 * real-time profile instead of allocating one per call */
+	for (int i = 0; i < RESUBMIT_WARMUP + REALTIME_ROUNDS; i++) {
+		if (i == RESUBMIT_WARMUP) {
+			num_allocs = 0;
+			count_allocs = TRUE;
+		}
+
+		g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_OUT, data,
+						     sizeof(data), &transferred, 1000), ==, 0);
+		g_assert_cmpint(transferred, ==, 4);
+	}
+
+	count_allocs = FALSE;
+	g_assert_cmpuint(num_allocs, ==, 0);
+
+	libusb_close(handle);
+	libusb_exit(ctx);
+	g_free(c);
+}
+
+#define REALTIME_ASYNC_TRANSFERS (4 * REALTIME_TRANSFERS)
+static void
+test_realtime_async(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+	};
+	UsbChat reap_msg = {
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+	};
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_REALTIME, .value = { .ival = REALTIME_TRANSFERS } },
+	};
+	struct libusb_transfer *transfers[REALTIME_ASYNC_TRANSFERS];
+	unsigned char buffers[REALTIME_ASYNC_TRANSFERS][4];
+	UsbChat *c;
+	int completed = 0;
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+
+	c = fixture->chat = g_new0(UsbChat, 2 * REALTIME_ASYNC_TRANSFERS + 1);
+	for (int i = 0; i < REALTIME_ASYNC_TRANSFERS; i++) {
+		c[i] = submit_msg;
+		c[i].reaps = &c[REALTIME_ASYNC_TRANSFERS + i];
+		c[REALTIME_ASYNC_TRANSFERS + i] = reap_msg;
+	}
+
+	g_assert_cmpint(libusb_init_context(&ctx, options, 1), ==, 0);
+	handle = libusb_open_device_with_vid_pid(ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* asynchronous transfers with a timeout are not limited by the number
+	 * of synchronous transfers of the real-time profile */
+	for (int i = 0; i < REALTIME_ASYNC_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i],
+					  handle,
+					  LIBUSB_ENDPOINT_IN,
+					  buffers[i],
+					  sizeof(buffers[i]),
+					  transfer_cb_inc_user_data,
+					  &completed,
+					  1000);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	while (completed < REALTIME_ASYNC_TRANSFERS)
+		g_assert_cmpint(libusb_handle_events(ctx), ==, 0);
+
+	for (int i = 0; i < REALTIME_ASYNC_TRANSFERS; i++) {
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		libusb_free_transfer(transfers[i]);
+	}
+
+	libusb_close(handle);
+	libusb_exit(ctx);
+	g_free(c);
+}
+
+#define BUFFER_POOL_SIZE 4
+static void
+test_buffer_pool(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	unsigned char *buffers[BUFFER_POOL_SIZE];
+	libusb_device_handle *handle = NULL;
+	libusb_buffer_pool *pool = NULL;
+	struct libusb_transfer *transfer = NULL;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	g_assert_null(libusb_buffer_pool_create(handle, 0, BUFFER_POOL_SIZE));
+	g_assert_null(libusb_buffer_pool_create(handle, 100, 0));
+
+	/* falls back to ordinary memory if the emulated device cannot map any */
+	pool = libusb_buffer_pool_create(handle, 100, BUFFER_POOL_SIZE);
+	g_assert_nonnull(pool);
+
+	for (int round = 0; round < 3; round++) {
+		for (int i = 0; i < BUFFER_POOL_SIZE; i++) {
+			buffers[i] = libusb_buffer_pool_alloc(pool);
+			g_assert_nonnull(buffers[i]);
+			g_assert_cmpuint((uintptr_t)buffers[i] % 64, ==, 0);
+			memset(buffers[i], 0xff, 100);
+		}
+		g_assert_null(libusb_buffer_pool_alloc(pool));
+
+		for (int i = 0; i < BUFFER_POOL_SIZE; i++)
+			libusb_buffer_pool_free(pool, buffers[i]);
+	}
+
+	/* an attached buffer goes back to the pool with its transfer */
+	transfer = libusb_alloc_transfer(0);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	g_assert_cmpint(libusb_buffer_pool_attach(pool, transfer), ==, 0);
+	g_assert_cmpint(libusb_buffer_pool_attach(pool, transfer), ==, 0);
+	g_assert_nonnull(transfer->buffer);
+	g_assert_cmpint(transfer->length, ==, 100);
+	for (int i = 0; i < BUFFER_POOL_SIZE - 1; i++)
+		g_assert_nonnull(buffers[i] = libusb_buffer_pool_alloc(pool));
+	g_assert_null(libusb_buffer_pool_alloc(pool));
+	libusb_free_transfer(transfer);
+
+	buffers[BUFFER_POOL_SIZE - 1] = libusb_buffer_pool_alloc(pool);
+	g_assert_nonnull(buffers[BUFFER_POOL_SIZE - 1]);
+	for (int i = 0; i < BUFFER_POOL_SIZE; i++)
+		libusb_buffer_pool_free(pool, buffers[i]);
+
+	libusb_buffer_pool_destroy(pool);
+	libusb_close(handle);
+}
+
+#define SUBMIT_BATCH_SIZE 8
+static void
+test_submit_batch(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+	};
+	UsbChat reap_msg = {
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+	};
+	struct libusb_transfer *transfers[SUBMIT_BATCH_SIZE];
+	struct libusb_transfer *batch[SUBMIT_BATCH_SIZE + 1];
+	unsigned char buffers[SUBMIT_BATCH_SIZE][4];
+	UsbChat *c;
+	int completed = 0;
+	libusb_device_handle *handle = NULL;
+
+	c = fixture->chat = g_new0(UsbChat, 2 * SUBMIT_BATCH_SIZE + 1);
+	for (int i = 0; i < SUBMIT_BATCH_SIZE; i++) {
+		c[i] = submit_msg;
+		c[i].reaps = &c[SUBMIT_BATCH_SIZE + i];
+		c[SUBMIT_BATCH_SIZE + i] = reap_msg;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < SUBMIT_BATCH_SIZE; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i],
+					  handle,
+					  LIBUSB_ENDPOINT_IN,
+					  buffers[i],
+					  sizeof(buffers[i]),
+					  transfer_cb_inc_user_data,
+					  &completed,
+					  1000);
+	}
+
+	g_assert_cmpint(libusb_submit_transfers(transfers, 0), ==, 0);
+
+	/* submission stops at a transfer that appears twice in the batch */
+	memcpy(batch, transfers, sizeof(transfers));
+	batch[SUBMIT_BATCH_SIZE] = transfers[0];
+	g_assert_cmpint(libusb_submit_transfers(batch, SUBMIT_BATCH_SIZE + 1), ==, SUBMIT_BATCH_SIZE);
+
+	/* nothing changes for a batch that starts with a transfer in flight */
+	g_assert_cmpint(libusb_submit_transfers(transfers, SUBMIT_BATCH_SIZE), ==, LIBUSB_ERROR_BUSY);
+
+	while (completed < SUBMIT_BATCH_SIZE)
+		g_assert_cmpint(libusb_handle_events(fixture->ctx), ==, 0);
+
+	for (int i = 0; i < SUBMIT_BATCH_SIZE; i++) {
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		g_assert_cmpint(transfers[i]->actual_length, ==, 4);
+		g_assert_cmpmem(buffers[i], 4, reap_msg.buffer, 4);
+		libusb_free_transfer(transfers[i]);
+	}
+
+	libusb_close(handle);
+	g_free(c);
+}
+
+#define CQ_TRANSFERS 8
+static void
+test_completion_queue(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+	};
+	UsbChat reap_msg = {
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+	};
+	struct libusb_transfer *transfers[CQ_TRANSFERS];
+	struct libusb_transfer *collected[CQ_TRANSFERS];
+	unsigned char buffers[CQ_TRANSFERS][4];
+	struct timeval tv = { 0, 100000 };
+	struct pollfd pfd;
+	UsbChat *c;
+	int completed = 0;
+	int num_collected = 0;
+	libusb_device_handle *handle = NULL;
+	libusb_cq *cq = NULL;
+
+	c = fixture->chat = g_new0(UsbChat, 2 * CQ_TRANSFERS + 1);
+	for (int i = 0; i < CQ_TRANSFERS; i++) {
+		c[i] = submit_msg;
+		c[i].reaps = &c[CQ_TRANSFERS + i];
+		c[CQ_TRANSFERS + i] = reap_msg;
+	}
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	/* smaller than the number of transfers to go through the overflow list */
+	g_assert_cmpint(libusb_cq_create(fixture->ctx, CQ_TRANSFERS / 2, &cq), ==, 0);
+	g_assert_cmpint(libusb_cq_attach(cq, handle), ==, 0);
+	pfd.fd = libusb_cq_get_fd(cq);
+	pfd.events = POLLIN;
+	g_assert_cmpint(pfd.fd, >=, 0);
+	g_assert_cmpint(poll(&pfd, 1, 0), ==, 0);
+
+	for (int i = 0; i < CQ_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(transfers[i],
+					  handle,
+					  LIBUSB_ENDPOINT_IN,
+					  buffers[i],
+					  sizeof(buffers[i]),
+					  transfer_cb_inc_user_data,
+					  &completed,
+					  1000);
+		g_assert_cmpint(libusb_submit_transfer(transfers[i]), ==, 0);
+	}
+
+	while (num_collected < CQ_TRANSFERS) {
+		g_assert_cmpint(libusb_handle_events_timeout(fixture->ctx, &tv), ==, 0);
+		num_collected += libusb_cq_poll(cq, collected + num_collected,
+						CQ_TRANSFERS - num_collected);
+	}
+
+	/* the callbacks are not invoked and the transfers come in order */
+	g_assert_cmpint(completed, ==, 0);
+	g_assert_cmpint(libusb_cq_poll(cq, collected, CQ_TRANSFERS), ==, 0);
+	g_assert_cmpint(poll(&pfd, 1, 0), ==, 0);
+	for (int i = 0; i < CQ_TRANSFERS; i++) {
+		g_assert_true(collected[i] == transfers[i]);
+		g_assert_cmpint(transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		g_assert_cmpint(transfers[i]->actual_length, ==, 4);
+		g_assert_cmpmem(buffers[i], 4, reap_msg.buffer, 4);
+		libusb_free_transfer(transfers[i]);
+	}
+
+	libusb_cq_detach(cq, handle);
+	libusb_cq_destroy(cq);
+	libusb_close(handle);
+	g_free(c);
+}
+
+static void
+test_completion_queue_sync(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .reaps = &chat[1],
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+		}, {
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+		},
+		{ .submit = FALSE }
+	};
+	struct libusb_transfer *collected[1];
+	unsigned char data[4];
+	int transferred = 0;
+	libusb_device_handle *handle = NULL;
+	libusb_cq *cq = NULL;
+
+	fixture->chat = chat;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	g_assert_cmpint(libusb_cq_create(fixture->ctx, 4, &cq), ==, 0);
+	g_assert_cmpint(libusb_cq_attach(cq, handle), ==, 0);
+
+	/* the transfers of the synchronous API complete as usual and are not
+	 * queued */
+	g_assert_cmpint(libusb_bulk_transfer(handle, LIBUSB_ENDPOINT_IN, data,
+					     sizeof(data), &transferred, 1000), ==, 0);
+	g_assert_cmpint(transferred, ==, 4);
+	g_assert_cmpmem(data, 4, chat[1].buffer, 4);
+	g_assert_cmpint(libusb_cq_poll(cq, collected, 1), ==, 0);
+
+	libusb_cq_detach(cq, handle);
+	libusb_cq_destroy(cq);
+	libusb_close(handle);
+}
+
 #define THREADED_SUBMIT_URB_SETS 64
 #define THREADED_SUBMIT_URB_IN_FLIGHT 64
 typedef struct {
@@ -955,6 +1485,342 @@ test_threaded_submit(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 	g_free (c);
 }
 
+#define SUBMIT_CANCEL_TRANSFERS 16
+#define SUBMIT_CANCEL_ROUNDS 256
+typedef struct {
+	struct libusb_transfer *transfers[SUBMIT_CANCEL_TRANSFERS];
+	gint in_flight[SUBMIT_CANCEL_TRANSFERS];
+	gint completed;
+	int done;
+} TestSubmitCancel;
+
+static gpointer
+submit_cancel_submit_thread(TestSubmitCancel *data)
+{
+	for (int round = 0; round < SUBMIT_CANCEL_ROUNDS; round++) {
+		for (int i = 0; i < SUBMIT_CANCEL_TRANSFERS; i++) {
+			/* resubmit as soon as the previous completion was reported */
+			while (g_atomic_int_get(&data->in_flight[i]))
+				g_thread_yield();
+
+			g_atomic_int_set(&data->in_flight[i], 1);
+			g_assert_cmpint(libusb_submit_transfer(data->transfers[i]), ==, 0);
+		}
+	}
+
+	return NULL;
+}
+
+static gpointer
+submit_cancel_cancel_thread(TestSubmitCancel *data)
+{
+	while (!g_atomic_int_get(&data->done)) {
+		int i = g_random_int_range(0, SUBMIT_CANCEL_TRANSFERS);
+		int r = libusb_cancel_transfer(data->transfers[i]);
+
+		g_assert_true(r == 0 || r == LIBUSB_ERROR_NOT_FOUND);
+		g_thread_yield();
+	}
+
+	return NULL;
+}
+
+static void
+test_submit_cancel_transfer_cb(struct libusb_transfer *transfer)
+{
+	TestSubmitCancel *data = transfer->user_data;
+	int i;
+
+	for (i = 0; data->transfers[i] != transfer; i++)
+		;
+
+	/* nothing completes on its own, the transfers are either cancelled or
+	 * time out, and each submission completes exactly once */
+	g_assert_true(transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+		      transfer->status == LIBUSB_TRANSFER_TIMED_OUT);
+	if (transfer->timeout == 0)
+		g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_CANCELLED);
+	g_assert_cmpint(g_atomic_int_get(&data->in_flight[i]), ==, 1);
+
+	if (g_atomic_int_add(&data->completed, 1) + 1 ==
+	    SUBMIT_CANCEL_TRANSFERS * SUBMIT_CANCEL_ROUNDS)
+		g_atomic_int_set(&data->done, TRUE);
+	g_atomic_int_set(&data->in_flight[i], 0);
+}
+
+static void
+test_threaded_submit_cancel(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	TestSubmitCancel data = { 0 };
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+	};
+	unsigned char buffers[SUBMIT_CANCEL_TRANSFERS][4];
+	GThread *submit_thread, *cancel_thread;
+	libusb_device_handle *handle = NULL;
+	UsbChat *c;
+
+	c = fixture->chat = g_new0(UsbChat, SUBMIT_CANCEL_TRANSFERS * SUBMIT_CANCEL_ROUNDS + 1);
+	for (int i = 0; i < SUBMIT_CANCEL_TRANSFERS * SUBMIT_CANCEL_ROUNDS; i++)
+		c[i] = submit_msg;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	fixture->libusb_log_silence = TRUE;
+
+	/* half of the transfers also race their timeout against the
+	 * cancellations */
+	for (int i = 0; i < SUBMIT_CANCEL_TRANSFERS; i++) {
+		data.transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(data.transfers[i],
+					  handle,
+					  LIBUSB_ENDPOINT_IN,
+					  buffers[i],
+					  sizeof(buffers[i]),
+					  test_submit_cancel_transfer_cb,
+					  &data,
+					  i % 2 ? 1 : 0);
+	}
+
+	submit_thread = g_thread_new("submit", (GThreadFunc) submit_cancel_submit_thread, &data);
+	cancel_thread = g_thread_new("cancel", (GThreadFunc) submit_cancel_cancel_thread, &data);
+
+	while (!g_atomic_int_get(&data.done))
+		g_assert_cmpint(libusb_handle_events_completed(fixture->ctx, &data.done), ==, 0);
+
+	g_thread_join(submit_thread);
+	g_thread_join(cancel_thread);
+
+	fixture->libusb_log_silence = FALSE;
+
+	for (int i = 0; i < SUBMIT_CANCEL_TRANSFERS; i++)
+		libusb_free_transfer(data.transfers[i]);
+	libusb_close(handle);
+	g_free(c);
+}
+
+#define CLOSE_ROUNDS 100
+
+typedef struct {
+	libusb_context *ctx;
+	libusb_device *dev;
+	int done;
+} TestThreadedClose;
+
+static gpointer
+threaded_close_thread(TestThreadedClose *data)
+{
+	for (int i = 0; i < CLOSE_ROUNDS; i++) {
+		libusb_device_handle *handle = NULL;
+
+		g_assert_cmpint(libusb_open(data->dev, &handle), ==, 0);
+		libusb_close(handle);
+	}
+
+	g_atomic_int_set(&data->done, TRUE);
+	libusb_interrupt_event_handler(data->ctx);
+
+	return NULL;
+}
+
+static void
+test_threaded_close(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	TestThreadedClose data = { 0 };
+	libusb_device_handle *handle = NULL;
+	GThread *thread;
+
+	handle = libusb_open_device_with_vid_pid(fixture->ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+	data.ctx = fixture->ctx;
+	data.dev = libusb_get_device(handle);
+
+	thread = g_thread_new("close", (GThreadFunc) threaded_close_thread, &data);
+
+	/* The event handler never gives up the events lock, the devices are
+	 * closed by libusb_handle_events_locked() on behalf of the thread */
+	libusb_lock_events(fixture->ctx);
+	while (!g_atomic_int_get(&data.done)) {
+		struct timeval tv = { 1, 0 };
+
+		g_assert_cmpint(libusb_handle_events_locked(fixture->ctx, &tv), ==, 0);
+	}
+	libusb_unlock_events(fixture->ctx);
+
+	g_thread_join(thread);
+	libusb_close(handle);
+}
+
+#define CALLBACK_THREADS 4
+#define CALLBACK_TRANSFERS 16
+
+typedef struct {
+	GThread *event_thread;
+	struct libusb_transfer *transfers[CALLBACK_TRANSFERS];
+	int order[CALLBACK_TRANSFERS];
+	gint completed;
+	gint running;
+	int done;
+} TestCallbackThreads;
+
+static void
+callback_threads_cb(struct libusb_transfer *transfer)
+{
+	TestCallbackThreads *data = transfer->user_data;
+	int i;
+
+	/* the callbacks of an endpoint never run concurrently */
+	g_assert_cmpint(g_atomic_int_add(&data->running, 1), ==, 0);
+	g_assert(g_thread_self() != data->event_thread);
+
+	for (i = 0; i < CALLBACK_TRANSFERS; i++) {
+		if (data->transfers[i] == transfer)
+			break;
+	}
+	g_assert_cmpint(i, <, CALLBACK_TRANSFERS);
+	data->order[g_atomic_int_get(&data->completed)] = i;
+	g_usleep(1000);
+
+	g_atomic_int_add(&data->running, -1);
+	if (g_atomic_int_add(&data->completed, 1) == CALLBACK_TRANSFERS - 1)
+		g_atomic_int_set(&data->done, TRUE);
+}
+
+static void
+test_callback_threads(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat submit_msg = {
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+	};
+	UsbChat reap_msg = {
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+	};
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_CALLBACK_THREADS, .value = { .ival = CALLBACK_THREADS } },
+	};
+	TestCallbackThreads data = { .event_thread = g_thread_self() };
+	unsigned char buffers[CALLBACK_TRANSFERS][4];
+	UsbChat *c;
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+
+	c = fixture->chat = g_new0(UsbChat, 2 * CALLBACK_TRANSFERS + 1);
+	for (int i = 0; i < CALLBACK_TRANSFERS; i++) {
+		c[i] = submit_msg;
+		c[i].reaps = &c[CALLBACK_TRANSFERS + i];
+		c[CALLBACK_TRANSFERS + i] = reap_msg;
+	}
+
+	g_assert_cmpint(libusb_init_context(&ctx, options, 1), ==, 0);
+	handle = libusb_open_device_with_vid_pid(ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	for (int i = 0; i < CALLBACK_TRANSFERS; i++) {
+		data.transfers[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(data.transfers[i],
+					  handle,
+					  LIBUSB_ENDPOINT_IN,
+					  buffers[i],
+					  sizeof(buffers[i]),
+					  callback_threads_cb,
+					  &data,
+					  1000);
+		g_assert_cmpint(libusb_submit_transfer(data.transfers[i]), ==, 0);
+	}
+
+	/* the callbacks run on the executor threads, in completion order */
+	while (!g_atomic_int_get(&data.done)) {
+		struct timeval tv = { 0, 10000 };
+
+		g_assert_cmpint(libusb_handle_events_timeout(ctx, &tv), ==, 0);
+	}
+
+	for (int i = 0; i < CALLBACK_TRANSFERS; i++) {
+		g_assert_cmpint(data.order[i], ==, i);
+		g_assert_cmpint(data.transfers[i]->status, ==, LIBUSB_TRANSFER_COMPLETED);
+		libusb_free_transfer(data.transfers[i]);
+	}
+
+	libusb_close(handle);
+	libusb_exit(ctx);
+	g_free(c);
+}
+
+static void
+callback_close_cb(struct libusb_transfer *transfer)
+{
+	int *done = transfer->user_data;
+
+	/* the handle is closed by the callback of its last transfer */
+	libusb_close(transfer->dev_handle);
+	g_atomic_int_set(done, TRUE);
+}
+
+static void
+test_callback_threads_close(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	UsbChat chat[] = {
+		{
+		  .submit = TRUE,
+		  .type = USBDEVFS_URB_TYPE_BULK,
+		  .endpoint = LIBUSB_ENDPOINT_IN,
+		  .buffer_length = 4,
+		}, {
+		  .reap = TRUE,
+		  .buffer = (unsigned char[]) { 0x01, 0x02, 0x03, 0x04 },
+		  .actual_length = 4,
+		},
+		{ .submit = FALSE }
+	};
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_CALLBACK_THREADS, .value = { .ival = 1 } },
+	};
+	unsigned char buffer[4];
+	struct libusb_transfer *transfer;
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle = NULL;
+	int done = 0;
+
+	chat[0].reaps = &chat[1];
+	fixture->chat = chat;
+
+	g_assert_cmpint(libusb_init_context(&ctx, options, 1), ==, 0);
+	handle = libusb_open_device_with_vid_pid(ctx, 0x04a9, 0x31c0);
+	g_assert_nonnull(handle);
+
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer,
+				  handle,
+				  LIBUSB_ENDPOINT_IN,
+				  buffer,
+				  sizeof(buffer),
+				  callback_close_cb,
+				  &done,
+				  1000);
+	g_assert_cmpint(libusb_submit_transfer(transfer), ==, 0);
+
+	/* the close requested from the executor thread is performed by the
+	 * event handling of this thread */
+	while (!g_atomic_int_get(&done)) {
+		struct timeval tv = { 0, 10000 };
+
+		g_assert_cmpint(libusb_handle_events_timeout(ctx, &tv), ==, 0);
+	}
+
+	g_assert_cmpint(transfer->status, ==, LIBUSB_TRANSFER_COMPLETED);
+	libusb_free_transfer(transfer);
+	libusb_exit(ctx);
+}
+
 static int
 hotplug_count_arrival_cb(libusb_context *ctx,
                          libusb_device  *device,
@@ -1136,6 +2002,11 @@ main(int argc, char **argv)
 	           test_fixture_setup_with_canon,
 	           test_close_flying,
 	           test_fixture_teardown);
+	g_test_add("/libusb/close-flying-other-handle", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_close_flying_other_handle,
+	           test_fixture_teardown);
+
 	g_test_add("/libusb/close-cancelled", UMockdevTestbedFixture, NULL,
 	           test_fixture_setup_with_canon,
 	           test_close_cancelled,
@@ -1156,11 +2027,65 @@ main(int argc, char **argv)
 	           test_timeout,
 	           test_fixture_teardown);
 
+	g_test_add("/libusb/resubmit-no-alloc", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_resubmit_no_alloc,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/realtime-no-alloc", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_realtime_no_alloc,
+	           test_fixture_teardown);
+	g_test_add("/libusb/realtime-async", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_realtime_async,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/buffer-pool", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_buffer_pool,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/submit-batch", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_submit_batch,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/completion-queue", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_completion_queue,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/completion-queue-sync", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_completion_queue_sync,
+	           test_fixture_teardown);
+
 	g_test_add("/libusb/threaded-submit", UMockdevTestbedFixture, NULL,
 	           test_fixture_setup_with_canon,
 	           test_threaded_submit,
 	           test_fixture_teardown);
 
+	g_test_add("/libusb/threaded-submit-cancel", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_threaded_submit_cancel,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/threaded-close", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_threaded_close,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/callback-threads", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_callback_threads,
+	           test_fixture_teardown);
+
+	g_test_add("/libusb/callback-threads-close", UMockdevTestbedFixture, NULL,
+	           test_fixture_setup_with_canon,
+	           test_callback_threads_close,
+	           test_fixture_teardown);
+
 	g_test_add("/libusb/hotplug/enumerate", UMockdevTestbedFixture, NULL,
 	           test_fixture_setup_with_canon,
 	           test_hotplug_enumerate,